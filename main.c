@@ -1,10 +1,30 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
+// Default geometry, every value can be changed at runtime through the command line or a config file
 #define MEM_SIZE              500  // 500 bytes of memory
 #define MAX_STACK_SIZE        200  // 200 bytes of memory for the stack
 #define MAX_HEAP_SIZE         300  // 300 bytes of memory for the heap
@@ -12,518 +32,7140 @@
 #define MAX_FRAMES            5    // 5 frames
 #define MIN_FRAME_SIZE        10   // 10 bytes of memory for each frame
 #define MAX_FRAME_SIZE        80   // 80 bytes of memory for each frame
-#define MAX_NAME_SIZE         8    // 8 bytes of memory for each name
-#define MAX_INT               20   // 20 integers per frame
-#define MAX_DOUBLE            10   // 10 doubles per frame
-#define MAX_CHAR              80   // 80 chars per frame
+#define MAX_NAME_SIZE         32   // longest name, names are stored as ids into a name table
+#define MAX_INT               20   // 20 integers per frame on average
+#define MAX_DOUBLE            10   // 10 doubles per frame on average
+#define MAX_CHAR              80   // 80 chars per frame on average
 #define MAX_POINTER           20   // 20 pointers per frame
+#define HUGE_PAGE_SIZE        (2 * 1024 * 1024)  // heaps of at least this size are backed by huge pages
 #define FRAME_METADATA_OFFSET sizeof(frame_status_t)
-#define BUFFER_METADATA_SIZE  sizeof(allocated_t)
+#define HEAP_ALIGNMENT        4    // every heap block starts on a 4 byte boundary
+#define BLOCK_HEADER_SIZE     8    // size and flags word followed by the name id word
+#define BLOCK_FOOTER_SIZE     4    // copy of the size word in the last bytes of a free block
+#define MIN_BLOCK_SIZE        ALIGN_UP(BLOCK_HEADER_SIZE + 1, HEAP_ALIGNMENT)
+#define BLOCK_FREE            1u   // flags kept in the low bits of the size word
+#define BLOCK_PREV_FREE       2u
+#define BLOCK_FLAGS           (BLOCK_FREE | BLOCK_PREV_FREE)
+#define NUM_SIZE_CLASSES      32   // power of two size classes, class k holds sizes [2^k, 2^(k+1))
+#define BUDDY_MIN_ORDER       4    // smallest buddy block is 16 bytes, enough for a header and a byte
+#define TCACHE_BINS           64   // per instance caches of freed blocks of every size up to 252 bytes
+#define TCACHE_COUNT          7    // blocks kept per cache bin before they go back to the shared heap
+#define MAX_SHARDS            64   // most independently locked ranges of a shared heap
+#define MIN_INDEX_CAPACITY    16   // initial number of slots of a name index
+#define MAX_TOKENS            3    // a command word and at most two arguments
+#define NAME_BUFFER_SIZE      64   // longer than any valid name, so overlong names are still reported
+#define PATH_BUFFER_SIZE      4096 // longest file name argument of a command
+#define TRACE_MAGIC           "SHMTRACE"  // first bytes of a compiled trace
+#define TRACE_BYTE_ORDER      0x01020304
+#define TRACE_VERSION         2
+#define OUTPUT_BUFFER_SIZE    (1 << 20)  // bytes collected before SM output is written out
+#define SNAPSHOT_MAGIC        "SHMSNAP1"  // first bytes of a binary snapshot
+#define SNAPSHOT_VERSION      2
+#define IMAGE_MAGIC           "SHMIMAGE"  // first bytes of a memory image written by SAVE
+#define IMAGE_VERSION         2
+#define IMAGE_ALIGNMENT       65536       // regions of an image start on a boundary of every page size
+#define IMAGE_INDEXES         4           // name, frame, variable and buffer index
+#define IMAGE_REGIONS         3           // stack, variable tables and heap
+#define TRACE_NO_NAME         UINT32_MAX  // name id of trace records without a name argument
+#define NO_NAME               UINT32_MAX  // id of a name that is not in a name table
+#define BENCH_HEAP_SIZE       (4 * 1024 * 1024)  // heap used by every benchmark run
+#define BENCH_LIVE_BUFFERS    2000               // buffers alive once a benchmark workload is warm
+#define BENCH_OPERATIONS      200000             // CH and DH calls per benchmark run
+#define MAX_PROF_EVENTS       (1 << 24)          // largest event ring of the allocation profiler
+#define PROF_TOP_SITES        10                 // allocating functions listed by PROF
+#define STATS_BUCKETS         32                 // latency buckets, bucket k counts [2^k, 2^(k+1)) cycles
+#define MAX_CHECKPOINTS       32                 // most CKPT levels an instance can stack
+#define CHECKPOINT_REGIONS    4                  // frame records, stack, variable tables and heap
+#define HEAP_MAP_CELLS        1024               // cells of an HM map when no cell size is given
+#define HEAP_MAP_WIDTH        64                 // cells per line of an HM map
+#ifndef HEAP_CHECK
+#define HEAP_CHECK            0                  // 1 for the checked heap of make check
+#endif
+#define HEAP_REDZONE          16                 // poisoned bytes after every buffer of a checked heap
+#define HEAP_QUARANTINE       256                // most deleted blocks a checked heap holds back from reuse
+#define REDZONE_BYTE          0xFA               // fill of the red zones of a checked heap
+#define FREED_BYTE            0xFD               // fill of the blocks in the quarantine
+
+#define ALIGN_UP(x, a)   ((((x) + (a) - 1) / (a)) * (a))
+#define ALIGN_DOWN(x, a) ((x) / (a) * (a))
+#define OPCODE(a, b)     ((uint32_t)(uint8_t)(a) | (uint32_t)(uint8_t)(b) << 8)
+#define LONG_OPCODE(n)   OPCODE(0, n)  // opcodes of longer command words, no short word starts with 0
+#define OPCODE_COMPACT   LONG_OPCODE(1)
+#define OPCODE_PROF      LONG_OPCODE(2)
+#define OPCODE_STATS     LONG_OPCODE(3)
+#define OPCODE_SAVE      LONG_OPCODE(4)
+#define OPCODE_LOAD      LONG_OPCODE(5)
+#define OPCODE_CKPT      LONG_OPCODE(6)
+#define OPCODE_UNDO      LONG_OPCODE(7)
+#define OPCODE_FILL      LONG_OPCODE(8)
+#define OPCODE_COPY      LONG_OPCODE(9)
+#define OPCODE_SUM       LONG_OPCODE(10)
+
+/**
+ * @brief Policy used to pick a free block for a new heap buffer
+ *
+ */
+typedef enum __fit_policy_t {
+    FIT_FIRST,  // lowest addressed block that is large enough
+    FIT_BEST,   // smallest block that is large enough
+    FIT_NEXT,   // first fit, resuming from where the previous search stopped
+    FIT_SEG,    // segregated fit, first fit within the smallest non-empty size class
+} fit_policy_t;
+
+/**
+ * @brief Result of running one command
+ *
+ */
+typedef enum __command_status_t {
+    COMMAND_OK,
+    COMMAND_INVALID,
+    COMMAND_QUIT,
+} command_status_t;
+
+/**
+ * @brief Structure to store a token of a command line
+ *
+ * @details Tokens point into the line they were cut from and are not NUL terminated.
+ *
+ */
+typedef struct __token_t {
+    const char *text;
+    size_t      length;
+} token_t;
+
+/**
+ * @brief Structure to store one record of a compiled trace
+ *
+ * @details Every command becomes one fixed size record holding its opcode, the id of its name
+ *        argument in the trace's name table and its value argument, if any. COPY has a second name
+ *        instead of a value.
+ *
+ */
+typedef struct __trace_record_t {
+    uint16_t opcode;
+    uint16_t reserved;
+    uint32_t name_id;
+    union {
+        int64_t  int_value;
+        double   double_value;
+        uint32_t second_id;  // id of the second name argument
+    };
+} trace_record_t;
+
+/**
+ * @brief Structure to store the header of a compiled trace
+ *
+ * @details The header is followed by the records, then the offset of every name in the name text
+ *        and then the NUL terminated names themselves. The byte order field is written natively so
+ *        traces moved to a machine of the other byte order are rejected.
+ *
+ */
+typedef struct __trace_header_t {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint64_t record_count;
+    uint64_t names_offset;
+    uint32_t name_count;
+    uint32_t names_size;
+} trace_header_t;
+
+/**
+ * @brief Size distributions of the benchmark workloads
+ *
+ */
+typedef enum __bench_sizes_t {
+    BENCH_UNIFORM,
+    BENCH_POWER_LAW,
+    BENCH_BIMODAL,
+} bench_sizes_t;
+
+/**
+ * @brief Orders in which the benchmark workloads free their buffers
+ *
+ */
+typedef enum __bench_order_t {
+    BENCH_LIFO,
+    BENCH_FIFO,
+    BENCH_RANDOM,
+} bench_order_t;
+
+/**
+ * @brief Structure to store the result of one benchmark run
+ *
+ */
+typedef struct __bench_result_t {
+    uint32_t alloc_p50;
+    uint32_t alloc_p99;
+    uint32_t free_p50;
+    uint32_t free_p99;
+    int      peak_heap;
+    int      failed;
+    double   fragmentation;  // external fragmentation left at the end of the run
+} bench_result_t;
+
+/**
+ * @brief Structure to store the traces shared by the workers of the trace runner
+ *
+ */
+typedef struct __runner_t {
+    char                  **paths;       // traces to replay, sorted
+    long                   *invalid;     // invalid commands per trace, -1 if the trace could not be run
+    int                     count;
+    const char             *output_dir;  // where the output of each trace goes, NULL to discard it
+    atomic_int              next;        // next trace to hand out
+    struct __shared_heap_t *shared;      // heap all traces allocate from, NULL for a private heap each
+    const char             *image;       // memory image every trace starts from, NULL to start empty
+    struct __stats_t       *stats;       // counters of all traces, NULL if they are not written out
+    pthread_mutex_t         stats_lock;
+} runner_t;
+
+/**
+ * @brief Structure to store what the command line asks for
+ *
+ */
+typedef struct __options_t {
+    const char *trace_path;     // text trace given with -f
+    const char *compiled_path;  // output of -o or the compiled trace of -r
+    bool        replay;         // compiled_path is a compiled trace to replay
+    const char *trace_dir;      // directory of traces given with -R
+    int         threads;        // worker threads of -R
+    int         shards;         // shards of the heap shared by the traces of -R, 0 for private heaps
+    const char *stats_path;     // file the counters are written to at exit, given with -t
+    const char *image_path;     // memory image the instances start from, given with -I
+} options_t;
+
+/**
+ * @brief Structure to store the memory geometry
+ *
+ * @details This structure is used to store the sizes of the memory regions and the per frame
+ *        limits. It starts out with the compile time defaults and is filled in from the command
+ *        line and config file before init is called.
+ *
+ */
+typedef struct __config_t {
+    int mem_size;
+    int stack_size;
+    int heap_size;
+    int max_frames;
+    int frame_size;
+    int max_ints;
+    int max_doubles;
+    int max_chars;
+    int max_pointers;
+    int compact_threshold;  // fragmentation in percent that triggers a compaction, 0 to never compact
+    int gc_slice;           // buffers swept after every command, 0 to only collect on GC
+    int spill;              // CH may put the pointer in a lower frame when the top frame has none free
+    int profile;            // events the allocation profiler buffers, 0 to leave it off
+    int latency;            // time every command with the cycle counter, 0 to only count them
+    int buddy;              // CH and DH use a binary buddy allocator over a power of two heap
+} config_t;
+
+/**
+ * @brief Type of a stack variable, as stored in the variable name index
+ *
+ */
+typedef enum __var_type_t {
+    VAR_INT,
+    VAR_DOUBLE,
+    VAR_CHAR,
+    NUM_VAR_TYPES,
+} var_type_t;
+
+/**
+ * @brief Structure to store an entry of a name index
+ *
+ * @details The key is a name id plus one, or the hash of a name in the index of a name table, so
+ *         comparing two names is a single integer compare. The scope separates equal names that
+ *         live in different frames, a key of 0 marks an empty slot.
+ *
+ */
+typedef struct __index_entry_t {
+    uint64_t key;
+    uint32_t scope;
+    int      value;
+} index_entry_t;
+
+/**
+ * @brief Structure to store a name index
+ *
+ * @details Open addressing hash table with linear probing, kept at most half full.
+ *
+ */
+typedef struct __name_index_t {
+    struct __index_entry_t *entries;
+    uint32_t                mask;
+    uint32_t                count;
+} name_index_t;
+
+/**
+ * @brief Structure to store a table of interned names
+ *
+ * @details Every distinct name is stored once, NUL terminated, and is referred to by its id: the
+ *        names of a compiled trace, and the names of the frames, variables and buffers of an
+ *        instance. Records only hold ids, so names can be longer than an id without taking more
+ *        room.
+ *
+ */
+typedef struct __name_table_t {
+    uint32_t     *offsets;  // id -> offset of the name in text
+    char         *text;
+    uint32_t      count;
+    uint32_t      size;
+    uint32_t      capacity;
+    name_index_t  index;    // hash and length of a name -> id
+} name_table_t;
+
+/**
+ * @brief Structure to store an output buffer
+ *
+ * @details Text is collected here and written to the file descriptor in large chunks.
+ *
+ */
+typedef struct __output_t {
+    int    fd;
+    size_t size;
+    char  *data;
+} output_t;
+
+/**
+ * @brief Output formats of SM
+ *
+ */
+typedef enum __sm_mode_t {
+    SM_FULL,   // tables of the whole state
+    SM_DELTA,  // tables of what changed since the last SM
+    SM_JSON,   // the whole state as JSON
+} sm_mode_t;
+
+/**
+ * @brief Kinds of records in a binary snapshot
+ *
+ */
+typedef enum __snapshot_kind_t {
+    SNAPSHOT_END,       // last record of the snapshot, the name table follows it
+    SNAPSHOT_FRAME,     // a = function address, b = frame address << 32 | frame size
+    SNAPSHOT_VARIABLE,  // type = var_type_t, a = value bytes, b = stack address, belongs to the frame before it
+    SNAPSHOT_POINTER,   // a = heap offset the pointer refers to
+    SNAPSHOT_BUFFER,    // a = block address, b = block size including the header
+    SNAPSHOT_FREE,      // a = block address, b = block size
+} snapshot_kind_t;
+
+/**
+ * @brief Structure to store the header of a binary snapshot
+ *
+ */
+typedef struct __snapshot_header_t {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    int64_t  heap_size;
+    int64_t  heap_used;
+} snapshot_header_t;
+
+/**
+ * @brief Structure to store the header of a memory image
+ *
+ * @details An image holds the whole state of an instance with a private heap. The stack, the
+ *        variable tables and the heap are stored as they are in memory at IMAGE_ALIGNMENT
+ *        boundaries, so LOAD maps them copy on write straight from the file. The rest is
+ *        stored in the state section and holds no pointers, frame pointers are heap offsets.
+ *
+ */
+typedef struct __image_header_t {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    config_t config;
+    int      stack_pointer;
+    int      heap_size;
+    int      fit_policy;
+    int      num_frames_free;
+    uint32_t name_count;
+    uint32_t name_size;
+    uint32_t index_slots[IMAGE_INDEXES];  // 0 for an index that was never used
+    uint32_t index_counts[IMAGE_INDEXES];
+    uint32_t free_blocks;
+    int      rover;                       // free block next fit resumes from, -1 for the list head
+    int      gc_active;                   // a collector cycle is being swept, its marks are stored
+    int      gc_pending;
+    int      gc_cursor;
+    uint64_t state_offset;
+    uint64_t state_size;
+    uint64_t region_offsets[IMAGE_REGIONS];
+    uint64_t region_sizes[IMAGE_REGIONS];
+} image_header_t;
+
+/**
+ * @brief Structure to store the scalars of a frame in a memory image
+ *
+ */
+typedef struct __image_frame_t {
+    int frame_address;
+    int base;
+    int size;
+    int var_first[NUM_VAR_TYPES];
+    int var_last[NUM_VAR_TYPES];
+} image_frame_t;
+
+/**
+ * @brief Structure to store one record of a binary snapshot
+ *
+ */
+typedef struct __snapshot_record_t {
+    uint8_t  kind;
+    uint8_t  type;
+    uint16_t reserved;
+    int32_t  frame;      // number of the frame the record belongs to
+    uint32_t name;       // id in the name table of the snapshot, NO_NAME for records without one
+    uint32_t reserved2;
+    int64_t  a;
+    int64_t  b;
+} snapshot_record_t;
+
+/**
+ * @brief Structure to store the frame status
+ *
+ * @details This structure is used to store the status of the frame, whether it is used or not, the
+ *         function address, frame address and the name of the function. Its size is what a frame
+ *         record takes on the simulated stack, at the frame address.
+ *
+ */
+typedef struct __frame_status_t {
+    int      number;
+    uint32_t name;  // id in the name table of the instance
+    int      func_address;
+    int      frame_address;
+    bool     used;
+} frame_status_t;
+
+/**
+ * @brief Structure to store the free list
+ *
+ * @details This structure is used to store the free list, it stores the start address of the free
+ *        block, the size of the free block and pointers to the neighbouring free blocks. The list
+ *        is kept in address order, and the same nodes also form a treap keyed on the start address
+ *        so the free neighbours of any address can be found in O(log n) when a buffer is freed.
+ *        Every node is also on the list of its power of two size class. The header of every free
+ *        block holds the slot of its node, so the node of a block next to a freed one is found in
+ *        O(1) through the boundary tags.
+ *
+ */
+typedef struct __freelist_t {
+    int                  start;
+    int                  size;
+    struct __freelist_t *next;
+    struct __freelist_t *prev;
+    struct __freelist_t *class_next;
+    struct __freelist_t *class_prev;
+    struct __freelist_t *left;
+    struct __freelist_t *right;
+    uint32_t             priority;
+    uint32_t             slot;  // stored in the header of the block so it can be found from its address
+} freelist_t;
+
+/**
+ * @brief Structure to store the free list of one range of the heap
+ *
+ * @details A private heap is one shard covering the whole heap. A shared heap is split into
+ *        shards over consecutive ranges, each behind its own lock, so instances allocating from
+ *        different shards do not contend. The counters are only updated with the lock held.
+ *
+ */
+typedef struct __heap_shard_t {
+    struct __freelist_t *freelist_head;
+    struct __freelist_t *freelist_root;   // root of the address ordered treap
+    struct __freelist_t *freelist_rover;  // where the next fit search resumes
+    struct __freelist_t *size_class[NUM_SIZE_CLASSES];
+    uint32_t             size_class_map;  // bit k is set when size_class[k] is not empty
+    int                  size_class_used[NUM_SIZE_CLASSES];  // allocated blocks per class
+    fit_policy_t         fit_policy;
+    uint32_t             priority_state;  // state of the treap priority generator
+    char                *heap;            // bytes of the whole heap the range is part of
+    struct __freelist_t **nodes;          // free block header slot -> node
+    uint32_t            *spare_slots;     // slots of released nodes, reused first
+    uint32_t             num_slots;       // slots handed out so far
+    uint32_t             num_spare;
+    uint32_t             slot_capacity;
+    int                  start;           // first address of the range
+    int                  end;             // address past the range
+    pthread_mutex_t      lock;            // taken around every use of a shared shard
+    uint64_t             acquisitions;    // times the lock was taken
+    uint64_t             contended;       // times the lock was already held by another thread
+    uint64_t             fit_probes;      // free blocks looked at by fit searches
+} heap_shard_t;
+
+/**
+ * @brief Structure to store the state of a buddy allocator heap
+ *
+ * @details The heap is split into blocks of power of two sizes, each aligned to its size, so the
+ *        buddy of a block of order k is found by flipping bit k of its address. Every order has a
+ *        bitmap of its free blocks. The state lives in the heap mapping right after the heap, so
+ *        images and checkpoints cover it along with the heap bytes, followed by the free bitmaps
+ *        of orders BUDDY_MIN_ORDER and up and the bytes CH needed for every block.
+ *
+ */
+typedef struct __buddy_t {
+    uint32_t order_map;                 // bit k is set when a block of order k is free
+    uint32_t counts[NUM_SIZE_CLASSES];  // free blocks per order
+    uint32_t hints[NUM_SIZE_CLASSES];   // no free block of order k is before this word of its bitmap
+} buddy_t;
+
+/**
+ * @brief Enum of the states of a granule in the shadow map of a checked heap
+ *
+ * @details A granule is HEAP_ALIGNMENT bytes. The states 1 to HEAP_ALIGNMENT are granules of a
+ *       buffer with that many addressable bytes.
+ *
+ */
+typedef enum __shadow_t {
+    SHADOW_FREE    = 0,     // owned by the allocator
+    SHADOW_HEADER  = 0x10,  // block header of a buffer
+    SHADOW_REDZONE = 0x20,  // after the end of a buffer
+    SHADOW_FREED   = 0x30,  // block of a buffer deleted by DH and held in the quarantine
+} shadow_t;
+
+/**
+ * @brief Structure to store the deleted blocks a checked heap holds back from reuse
+ *
+ * @details The blocks stay allocated until they leave the ring, so a write to a deleted buffer is
+ *       seen before the block is handed out again. The ring lives in the heap mapping, so
+ *       checkpoints and memory images carry it along with the heap.
+ *
+ */
+typedef struct __quarantine_t {
+    int blocks[HEAP_QUARANTINE];  // block addresses, the oldest at head
+    int head;
+    int count;
+    int bytes;
+} quarantine_t;
+
+/**
+ * @brief Structure to store a heap shared by several instances
+ *
+ * @details Every instance attached to the heap keeps its own stack, buffer names and block cache,
+ *        only the heap bytes and the shards are shared.
+ *
+ */
+typedef struct __shared_heap_t {
+    char         *heap;
+    size_t        heap_mapped;
+    int           num_shards;
+    heap_shard_t  shards[MAX_SHARDS];
+    atomic_int    next_home;      // home shard of the next instance attached
+    atomic_llong  tcache_hits;    // totals of the instances that detached
+    atomic_llong  tcache_misses;
+} shared_heap_t;
+
+/**
+ * @brief Structure to store the freed blocks an instance keeps for reuse
+ *
+ * @details Bin k holds blocks of exactly k * HEAP_ALIGNMENT bytes. Blocks in a cache stay
+ *        allocated as far as the shared heap is concerned, so a hit takes no lock at all.
+ *
+ */
+typedef struct __tcache_t {
+    int      count[TCACHE_BINS];
+    int      blocks[TCACHE_BINS][TCACHE_COUNT];
+    uint64_t hits;
+    uint64_t misses;
+} tcache_t;
+
+/**
+ * @brief Structure to store a decoded heap block header
+ *
+ * @details Every block of the heap, allocated or free, starts with an 8 byte header of two little
+ *         endian words: the block size including the header, with the flags in its low bits, and
+ *         the id of the buffer name. A free block holds the slot of its free list node instead of
+ *         a name id and repeats its size word in its last 4 bytes, and the block after it has
+ *         BLOCK_PREV_FREE set, so both neighbours of any block are found without a search. Blocks
+ *         are HEAP_ALIGNMENT aligned, so every word is read with one aligned load.
+ *
+ */
+typedef struct __block_t {
+    int      address;  // offset of the header in the heap
+    int      size;     // bytes of the block, header included
+    uint32_t flags;
+    uint32_t name;     // name id of an allocated block, node slot of a free one
+} block_t;
+
+/**
+ * @brief Union to store the value of a stack variable
+ *
+ */
+typedef union __var_value_t {
+    int    int_value;
+    double double_value;
+    char   char_value;
+} var_value_t;
+
+/**
+ * @brief Structure to store the record of a stack variable in the pool of its type
+ *
+ * @details The value itself lives on the simulated stack. The records of the variables of a frame
+ *       are linked in creation order, a free record links to the next free one instead.
+ *
+ */
+typedef struct __var_record_t {
+    uint32_t name;     // id in the name table of the instance
+    int      address;  // stack address of the value
+    int      next;     // next record of the same frame or of the free list, -1 for none
+    int      frame;    // slot of the frame that owns the record, -1 for a free record
+} var_record_t;
+
+/**
+ * @brief Structure to store a pool of the variable records of one type
+ *
+ * @details Records are handed out from the free list first and then from the untouched end of the
+ *       pool, so pages of the pool are only backed once that many variables were alive.
+ *
+ */
+typedef struct __var_pool_t {
+    int free;      // first free record, -1 for none
+    int fresh;     // records before this one have been handed out at least once
+    int capacity;
+} var_pool_t;
+
+/**
+ * @brief Structure to store the frame
+ *
+ * @details This structure is used to store the frame, it stores the frame address, the size of the
+ *       frame, its variable lists and the pointer array. The values of the variables live on the
+ *       simulated stack, right below the frame record, each at an address aligned to its size. The
+ *       variable records are allocated from one pool per type shared by all frames, the records
+ *       of a frame form one list per type, so a frame holds any mix of types until its bytes run
+ *       out and DF hands every list back to its pool at once.
+ *
+ */
+typedef struct __frame_t {
+    int           frame_address;
+    int           base;         // stack pointer before the frame was pushed, restored when it is popped
+    int           size;         // stack bytes taken by the variables, alignment padding included
+    int           var_first[NUM_VAR_TYPES];  // oldest variable record of each type, -1 for none
+    int           var_last[NUM_VAR_TYPES];   // newest variable record of each type, -1 for none
+    bool          dirty;        // changed since the last SM
+    void        **pointers;
+    uint64_t     *pointer_free;  // bit j is set when pointer slot j is free
+} frame_t;
+
+/**
+ * @brief Structure to store the totals of the heap compactions of an instance
+ *
+ */
+typedef struct __compaction_t {
+    int       runs;
+    int       automatic;  // runs started by the fragmentation threshold or a full heap
+    long long buffers;    // buffers moved
+    long long bytes;      // bytes moved, headers included
+    uint64_t  ns;         // time spent compacting
+} compaction_t;
+
+/**
+ * @brief Structure to store the garbage collector state of an instance
+ *
+ */
+typedef struct __gc_t {
+    uint64_t *marks;          // bit per HEAP_ALIGNMENT bytes, set for blocks reached in this cycle
+    bool      active;         // a cycle has been marked and is being swept
+    bool      pending;        // a frame was deleted since the last cycle started
+    int       cursor;         // address the sweep continues from
+    int       cycles;
+    long long freed_buffers;
+    long long freed_bytes;
+    int       pauses;
+    uint64_t  pause_ns;       // total time spent in pauses
+    uint64_t  max_pause_ns;
+} gc_t;
+
+/**
+ * @brief Commands counted by STATS, in the order they are listed
+ *
+ */
+typedef enum __stat_command_t {
+    STAT_CF,
+    STAT_DF,
+    STAT_CI,
+    STAT_CD,
+    STAT_CC,
+    STAT_CH,
+    STAT_DH,
+    STAT_SM,
+    STAT_SB,
+    STAT_SC,
+    STAT_AP,
+    STAT_GC,
+    STAT_COMPACT,
+    STAT_PROF,
+    STAT_STATS,
+    STAT_SAVE,
+    STAT_LOAD,
+    STAT_CKPT,
+    STAT_UNDO,
+    STAT_HM,
+    STAT_FILL,
+    STAT_COPY,
+    STAT_SUM,
+    NUM_STAT_COMMANDS,
+} stat_command_t;
+
+/**
+ * @brief Structure to store the latency histogram of one command
+ *
+ */
+typedef struct __latency_t {
+    uint64_t count;
+    uint64_t cycles;                   // total of all runs
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];  // runs by the power of two of their cycles
+} latency_t;
+
+/**
+ * @brief Structure to store the hot path counters of an instance
+ *
+ * @details The counters are always kept, they cost an add where the work is done. The latency
+ *      histograms are only filled when config.latency is set, they read the cycle counter around
+ *      every command.
+ *
+ */
+typedef struct __stats_t {
+    uint64_t  commands[NUM_STAT_COMMANDS];
+    uint64_t  invalid;        // command lines that did not parse
+    uint64_t  frame_scans;    // frame slots looked at to find the top frame or a free slot
+    uint64_t  pointer_scans;  // pointer slots looked at by CH and DH
+    uint64_t  fit_probes;     // free blocks looked at by the fit searches, taken from the shard
+    uint64_t  traffic_bytes;  // buffer bytes written or read by FILL, COPY and SUM
+    uint64_t  traffic_ns;     // time their kernels took
+    uint64_t  released_bytes; // free heap bytes given back to the system
+    latency_t latency[NUM_STAT_COMMANDS];
+    uint64_t  start_cycles;   // cycle counter and clock when the counting started, to convert
+    uint64_t  start_ns;       // cycles to time
+} stats_t;
+
+/**
+ * @brief Kind of an allocation profiler event
+ *
+ */
+typedef enum __prof_kind_t {
+    PROF_ALLOC,
+    PROF_FREE,
+} prof_kind_t;
+
+/**
+ * @brief Structure to store one CH or heap buffer free seen by the allocation profiler
+ *
+ */
+typedef struct __prof_event_t {
+    uint64_t command;       // commands run before the event
+    uint32_t name;          // id of the buffer
+    uint32_t frame;         // id of the function that owns a new buffer
+    int      func_address;
+    int      size;          // bytes asked for by CH
+    uint8_t  kind;
+} prof_event_t;
+
+/**
+ * @brief Structure to store the totals of one group of buffers of the allocation profiler
+ *
+ */
+typedef struct __prof_totals_t {
+    long long allocs;
+    long long bytes;     // bytes asked for, block headers and padding left out
+    long long frees;
+    long long lifetime;  // commands the freed buffers lived for
+} prof_totals_t;
+
+/**
+ * @brief Structure to store a call site of the allocation profiler
+ *
+ * @details A call site is the function a buffer was created in, told apart by name and address.
+ *
+ */
+typedef struct __prof_site_t {
+    uint32_t      name;
+    int           func_address;
+    prof_totals_t totals;
+} prof_site_t;
+
+/**
+ * @brief Structure to store a buffer that is alive for the allocation profiler
+ *
+ */
+typedef struct __prof_live_t {
+    uint64_t birth;  // command the buffer was created by
+    int      site;   // -1 if no buffer of this name is alive
+    int      size;
+} prof_live_t;
+
+/**
+ * @brief Structure to store the allocation profiler state of an instance
+ *
+ * @details CH and the buffer frees only append an event to a ring, the events are folded into the
+ *      totals in batches when the ring is full or PROF reads them, so a profiled command pays a
+ *      few stores. Every instance records and folds its own events, so the ring needs no locks.
+ *
+ */
+typedef struct __prof_t {
+    prof_event_t  *events;      // ring of the events not folded yet, NULL when the profiler is off
+    uint32_t       mask;        // capacity of the ring minus one
+    uint64_t       head;        // events recorded
+    uint64_t       tail;        // events folded
+    uint64_t       commands;    // commands run, the clock of the buffer lifetimes
+    prof_site_t   *sites;
+    int            num_sites;
+    name_index_t   site_index;  // (function name, function address) -> site
+    prof_live_t   *live;        // buffer name id -> creation of the buffer of that name
+    uint32_t       num_live;    // name ids covered by live
+    prof_totals_t  classes[NUM_SIZE_CLASSES];  // power of two classes of the sizes asked for
+    prof_totals_t  totals;
+} prof_t;
+
+/**
+ * @brief Structure to store one level of checkpoint
+ *
+ * @details The images hold the pages of the tracked regions as they were when the checkpoint was
+ *      taken, each at the offset of its page in the regions laid end to end. Only the pages written
+ *      since are copied, the rest of the reservation is never backed. The scalars are the state
+ *      outside the tracked regions that cannot be rebuilt from them.
+ *
+ */
+typedef struct __checkpoint_t {
+    char     *images;           // NULL while the level is not taken
+    size_t    images_mapped;
+    uint64_t *saved;            // bit p is set when page p has been copied to the images
+    int       stack_pointer;
+    int       heap_size;
+    int       num_frames_free;
+    int       rover;            // start of the free block next fit resumes from, -1 for none
+    int       fit_policy;
+    int       size_class_used[NUM_SIZE_CLASSES];
+    bool      gc_active;
+    bool      gc_pending;
+    int       gc_cursor;
+    uint64_t *gc_marks;         // marks of the cycle in progress, NULL if none was
+} checkpoint_t;
+
+/**
+ * @brief Structure to store a memory region whose pages a checkpoint tracks
+ *
+ */
+typedef struct __checkpoint_region_t {
+    char  *base;
+    size_t size;        // a whole number of granules
+    size_t granule;     // bytes that are protected and copied together
+    size_t offset;      // of the region in the images of a level
+    size_t first_page;  // number of the first page of the region in the saved bitmaps
+} checkpoint_region_t;
+
+/**
+ * @brief Structure to store the checkpoints of an instance
+ *
+ * @details While a checkpoint is taken the tracked regions are read only, the first write to a
+ *      page faults and the fault handler copies the page to the top level before it makes the page
+ *      writable again. Instances with checkpoints are on a list of their thread, so the handler of
+ *      a fault finds the instance without a lock.
+ *
+ */
+typedef struct __checkpoints_t {
+    checkpoint_t        levels[MAX_CHECKPOINTS];
+    int                 depth;      // levels taken
+    checkpoint_region_t regions[CHECKPOINT_REGIONS];
+    size_t              num_pages;  // pages of all regions together
+    struct __memory_t  *next;       // next instance of the thread with a checkpoint
+} checkpoints_t;
+
+/**
+ * @brief Structure to store the memory
+ *
+ * @details This structure is used to store the memory, it stores the frame status, stack frame,
+ *       free list, stack pointer, heap size, the stack and the heap. The stack is the top
+ *       stack_size bytes of the simulated memory and grows down from mem_size, the heap size is the
+ *       number of bytes currently in use by buffers, including their block headers. The tables, the
+ *       stack and the heap are sized from the config of the instance by init. Every simulated
+ *       address space is one memory_t handle passed to the commands, nothing in it is shared
+ *       between instances.
+ *
+ */
+typedef struct __memory_t {
+    struct __frame_status_t *frame_status;
+    struct __frame_t        *stack_frame;
+    char                    *frame_arena;    // frame records, pointers and their free slot bitmaps
+    size_t                   frame_arena_mapped;
+    char                    *stack;          // bytes of the stack region, starting at stack_limit
+    size_t                   stack_mapped;   // bytes mapped for the stack region
+    char                    *tables;         // variable pools of all frames
+    size_t                   tables_mapped;
+    struct __var_pool_t     *var_pools;      // pool of the variable records of each type, in tables
+    struct __var_record_t   *var_records[NUM_VAR_TYPES];
+    size_t                   heap_mapped;    // bytes mapped for the heap
+    int                      pointer_words;  // words of the free pointer slot bitmap of a frame
+    uint64_t                *frames_free;    // bit i is set when frame slot i is used and has a free pointer slot
+    int                      num_frames_free;
+    int                      top_frame;      // slot of the topmost frame, -1 when the stack is empty
+    struct __heap_shard_t    shard;          // free list of a private heap
+    struct __shared_heap_t  *shared;         // heap shared with other instances, NULL if private
+    struct __tcache_t        tcache;         // freed blocks kept for reuse when the heap is shared
+    int                      home_shard;     // shard of the shared heap tried first
+    struct __buddy_t        *buddy;          // state of a buddy heap, NULL for the free list heaps
+    uint64_t                *buddy_free[NUM_SIZE_CLASSES];  // bit i of order k is set when block i is free
+    uint32_t                *buddy_needed;   // bytes CH needed, header included, by block address >> BUDDY_MIN_ORDER
+    int                      buddy_order;    // order of the whole heap
+    struct __quarantine_t   *quarantine;     // deleted blocks held back by a checked heap, NULL otherwise
+    uint8_t                 *shadow;         // shadow_t of every granule of a checked heap, NULL otherwise
+    struct __name_index_t   frame_index;   // function name -> frame slot
+    struct __name_index_t   var_index;     // (frame slot, variable name) -> type and slot
+    struct __name_index_t   buffer_index;  // buffer name -> block address
+    struct __name_index_t   buffer_owner;  // buffer name -> frame slot * max_pointers + pointer slot CH put it in
+    struct __name_index_t   dirty_buffers; // buffers created or deleted since the last SM
+    struct __name_table_t   names;         // names of the frames, variables and buffers by id
+    int                    *dirty_frames;  // slots of the frames changed since the last SM
+    int                     num_dirty_frames;
+    struct __output_t       output;        // buffer for SM output
+    FILE                   *error;         // stream command errors are reported on
+    config_t                config;        // geometry of this instance
+    compaction_t            compaction;    // totals of the compactions so far
+    gc_t                    gc;
+    prof_t                  prof;          // allocation profiler, used when config.profile is set
+    stats_t                 stats;
+    checkpoints_t           checkpoints;   // taken by CKPT, rolled back by UNDO
+    int                     stack_pointer; // lowest stack address in use, mem_size when the stack is empty
+    int                     stack_limit;   // lowest address the stack may grow down to
+    int                     heap_size;
+    char                    *heap;
+} memory_t;
+
+/**
+ * @brief Structure to store the bulk kernels FILL, COPY and SUM run on buffer bytes
+ *
+ * @details One set is picked for the whole process the first time a kernel is needed, from what
+ *      the processor supports.
+ *
+ */
+typedef struct __bulk_kernels_t {
+    const char *name;
+    void (*fill)(char *bytes, uint8_t value, size_t size);
+    void (*copy)(char *dest, const char *src, size_t size);
+    uint64_t (*sum)(const char *bytes, size_t size);
+} bulk_kernels_t;
+
+config_t sys_config = {
+    .mem_size     = MEM_SIZE,
+    .stack_size   = MAX_STACK_SIZE,
+    .heap_size    = MAX_HEAP_SIZE,
+    .max_frames   = MAX_FRAMES,
+    .frame_size   = MAX_FRAME_SIZE,
+    .max_ints     = MAX_INT,
+    .max_doubles  = MAX_DOUBLE,
+    .max_chars    = MAX_CHAR,
+    .max_pointers = MAX_POINTER,
+};  // Geometry from the command line, every instance copies it in init
+
+// Bytes a variable takes on the stack, each type is also aligned to its size
+static const int var_type_sizes[] = {[VAR_INT] = sizeof(int), [VAR_DOUBLE] = sizeof(double), [VAR_CHAR] = sizeof(char)};
+
+/**
+ * @brief Function to read the monotonic clock
+ *
+ * @return uint64_t nanoseconds
+ */
+static uint64_t clock_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Function to read the cycle counter
+ *
+ * @details Falls back to the monotonic clock where there is no time stamp counter.
+ *
+ * @return uint64_t cycles
+ */
+static uint64_t clock_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+/**
+ * @brief Function to hash a name for the index of a name table
+ *
+ * @details Every salt gives a different hash, so a name whose hash is taken by a different name of
+ *         the same length moves on to the next salt and no two names ever share a key.
+ *
+ * @param name
+ * @param length
+ * @param salt
+ * @return uint64_t a non zero key
+ */
+static uint64_t name_hash(const char *name, size_t length, uint32_t salt) {
+    uint64_t hash = 0xCBF29CE484222325ull ^ salt;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 0x100000001B3ull;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * @brief Function to get the key of a name id in a name index
+ *
+ * @param id
+ * @return uint64_t
+ */
+static uint64_t name_id_key(uint32_t id) {
+    return (uint64_t)id + 1;
+}
+
+/**
+ * @brief Function to get the home slot of a key
+ *
+ * @param index
+ * @param key
+ * @param scope
+ * @return uint32_t
+ */
+static uint32_t index_slot(name_index_t *index, uint64_t key, uint32_t scope) {
+    uint64_t hash = (key ^ ((uint64_t)scope << 32 | scope)) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash >> 32) & index->mask;
+}
+
+/**
+ * @brief Function to find the entry of a key
+ *
+ * @param index
+ * @param key
+ * @param scope
+ * @return index_entry_t* the entry or NULL if the key is not in the index
+ */
+static index_entry_t *index_find(name_index_t *index, uint64_t key, uint32_t scope) {
+    if (!index->entries) {
+        return NULL;
+    }
+
+    for (uint32_t i = index_slot(index, key, scope);; i = (i + 1) & index->mask) {
+        index_entry_t *entry = &index->entries[i];
+        if (entry->key == 0) {
+            return NULL;
+        } else if (entry->key == key && entry->scope == scope) {
+            return entry;
+        }
+    }
+}
+
+/**
+ * @brief Function to add a key that is not in the index yet
+ *
+ * @param index
+ * @param key
+ * @param scope
+ * @param value
+ */
+static void index_insert(name_index_t *index, uint64_t key, uint32_t scope, int value) {
+    if (2 * (index->count + 1) > index->mask + 1 || !index->entries) {
+        name_index_t grown = {.mask = index->entries ? 2 * index->mask + 1 : MIN_INDEX_CAPACITY - 1};
+        grown.entries      = (index_entry_t *)calloc(grown.mask + 1, sizeof(index_entry_t));
+        if (!grown.entries) {
+            fprintf(stderr, "Error: Could not allocate memory for the name index\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (uint32_t i = 0; index->entries && i <= index->mask; ++i) {
+            if (index->entries[i].key != 0) {
+                index_entry_t *entry = &index->entries[i];
+                index_insert(&grown, entry->key, entry->scope, entry->value);
+            }
+        }
+        free(index->entries);
+        *index = grown;
+    }
+
+    uint32_t i = index_slot(index, key, scope);
+    while (index->entries[i].key != 0) {
+        i = (i + 1) & index->mask;
+    }
+    index->entries[i] = (index_entry_t){.key = key, .scope = scope, .value = value};
+    ++index->count;
+}
+
+/**
+ * @brief Function to remove a key from the index
+ *
+ * @details The entries after the removed one are shifted back into the gap, so no tombstones are
+ *         needed and lookups never get slower after deletes.
+ *
+ * @param index
+ * @param key
+ * @param scope
+ */
+static void index_erase(name_index_t *index, uint64_t key, uint32_t scope) {
+    index_entry_t *entry = index_find(index, key, scope);
+    if (!entry) {
+        return;
+    }
+
+    uint32_t hole = (uint32_t)(entry - index->entries);
+    for (uint32_t i = (hole + 1) & index->mask; index->entries[i].key != 0; i = (i + 1) & index->mask) {
+        uint32_t home = index_slot(index, index->entries[i].key, index->entries[i].scope);
+        if (((i - home) & index->mask) >= ((i - hole) & index->mask)) {
+            index->entries[hole] = index->entries[i];
+            hole                 = i;
+        }
+    }
+    index->entries[hole].key = 0;
+    --index->count;
+}
+
+/**
+ * @brief Function to get the id of a name
+ *
+ * @param table
+ * @param name
+ * @param insert whether a name that is not in the table yet is added to it
+ * @return uint32_t the id or NO_NAME if the name is not in the table and insert is false
+ */
+static uint32_t name_lookup(name_table_t *table, const char *name, bool insert) {
+    uint32_t scope = (uint32_t)strlen(name);
+    uint64_t key;
+    for (uint32_t salt = 0;; ++salt) {
+        key                  = name_hash(name, scope, salt);
+        index_entry_t *entry = index_find(&table->index, key, scope);
+        if (!entry) {
+            break;
+        } else if (strcmp(table->text + table->offsets[entry->value], name) == 0) {
+            return (uint32_t)entry->value;
+        }
+    }
+    if (!insert) {
+        return NO_NAME;
+    }
+
+    if (table->count % 1024 == 0) {
+        table->offsets = (uint32_t *)realloc(table->offsets, (table->count + 1024) * sizeof(uint32_t));
+    }
+    if (table->size + scope + 1 > table->capacity) {
+        table->capacity = 2 * table->capacity + scope + 1;
+        table->text     = (char *)realloc(table->text, table->capacity);
+    }
+    if (!table->offsets || !table->text) {
+        fprintf(stderr, "Error: Could not allocate memory for the name table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t id         = table->count++;
+    table->offsets[id]  = table->size;
+    memcpy(table->text + table->size, name, scope + 1);
+    table->size += scope + 1;
+    index_insert(&table->index, key, scope, (int)id);
+    return id;
+}
+
+/**
+ * @brief Function to get the id of a name, adding it to the table if it is new
+ *
+ * @param table
+ * @param name
+ * @return uint32_t
+ */
+static uint32_t name_intern(name_table_t *table, const char *name) {
+    return name_lookup(table, name, true);
+}
+
+/**
+ * @brief Function to get the id of a name without adding it to the table
+ *
+ * @param table
+ * @param name
+ * @return uint32_t the id or NO_NAME
+ */
+static uint32_t name_find(name_table_t *table, const char *name) {
+    return name_lookup(table, name, false);
+}
+
+/**
+ * @brief Function to get the text of an interned name
+ *
+ * @param table
+ * @param id
+ * @return const char*
+ */
+static const char *name_text(const name_table_t *table, uint32_t id) {
+    return table->text + table->offsets[id];
+}
+
+/**
+ * @brief Function to release a name table
+ *
+ * @param table
+ */
+static void name_table_free(name_table_t *table) {
+    free(table->offsets);
+    free(table->text);
+    free(table->index.entries);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * @brief Function to convert a word between the host byte order and the heap byte order
+ *
+ * @param word
+ * @return uint32_t
+ */
+static uint32_t heap_le32(uint32_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(word);
+#else
+    return word;
+#endif
+}
+
+/**
+ * @brief Function to load a word of a block header
+ *
+ * @details Header words are accessed atomically, so on a shared heap the owner of a buffer can read
+ *      its header while the flags are updated by another instance that holds the shard lock.
+ *
+ * @param heap
+ * @param address HEAP_ALIGNMENT aligned offset
+ * @return uint32_t
+ */
+static uint32_t heap_load(const char *heap, int address) {
+    return heap_le32(__atomic_load_n((const uint32_t *)(heap + address), __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Function to store a word of a block header
+ *
+ * @param heap
+ * @param address HEAP_ALIGNMENT aligned offset
+ * @param word
+ */
+static void heap_store(char *heap, int address, uint32_t word) {
+    __atomic_store_n((uint32_t *)(heap + address), heap_le32(word), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Function to decode the header of a heap block
+ *
+ * @param heap
+ * @param address
+ * @return block_t
+ */
+static block_t heap_block(const char *heap, int address) {
+    uint32_t word = heap_load(heap, address);
+    return (block_t){
+        .address = address,
+        .size    = (int)(word & ~BLOCK_FLAGS),
+        .flags   = word & BLOCK_FLAGS,
+        .name    = heap_load(heap, address + sizeof(uint32_t)),
+    };
+}
+
+/**
+ * @brief Function to write the header of a heap block
+ *
+ * @param heap
+ * @param address
+ * @param size
+ * @param flags
+ * @param name
+ */
+static void heap_set_block(char *heap, int address, int size, uint32_t flags, uint32_t name) {
+    heap_store(heap, address, (uint32_t)size | flags);
+    heap_store(heap, address + sizeof(uint32_t), name);
+}
+
+/**
+ * @brief Function to record in the header of the block at address whether the block before it is free
+ *
+ * @details Blocks past the end of the shard belong to another shard and are left alone, the first
+ *      block of a shard never merges with the block before it.
+ *
+ * @param shard
+ * @param address
+ * @param prev_free
+ */
+static void heap_set_prev_free(heap_shard_t *shard, int address, bool prev_free) {
+    if (address < shard->end) {
+        uint32_t word = heap_load(shard->heap, address);
+        heap_store(shard->heap, address, prev_free ? word | BLOCK_PREV_FREE : word & ~BLOCK_PREV_FREE);
+    }
+}
+
+/**
+ * @brief Function to generate the priority of a new treap node
+ *
+ * @details A fixed seed xorshift generator per instance is used so that runs are reproducible.
+ *
+ * @param shard
+ * @return uint32_t
+ */
+static uint32_t freelist_priority(heap_shard_t *shard) {
+    uint32_t state = shard->priority_state;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return shard->priority_state = state;
+}
+
+/**
+ * @brief Function to allocate a new free list node
+ *
+ * @param shard
+ * @param start
+ * @param size
+ * @return freelist_t*
+ */
+static freelist_t *freelist_new(heap_shard_t *shard, int start, int size) {
+    freelist_t *node = (freelist_t *)malloc(sizeof(freelist_t));
+    if (!node) {
+        fprintf(stderr, "Error: Could not allocate memory for the heap free list\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (shard->num_spare == 0 && shard->num_slots == shard->slot_capacity) {
+        shard->slot_capacity = shard->slot_capacity ? 2 * shard->slot_capacity : MIN_INDEX_CAPACITY;
+        shard->nodes         = (freelist_t **)realloc(shard->nodes, shard->slot_capacity * sizeof(freelist_t *));
+        shard->spare_slots   = (uint32_t *)realloc(shard->spare_slots, shard->slot_capacity * sizeof(uint32_t));
+        if (!shard->nodes || !shard->spare_slots) {
+            fprintf(stderr, "Error: Could not allocate memory for the heap free list\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t slot      = shard->num_spare ? shard->spare_slots[--shard->num_spare] : shard->num_slots++;
+    *node              = (freelist_t){.start = start, .size = size, .priority = freelist_priority(shard), .slot = slot};
+    shard->nodes[slot] = node;
+    return node;
+}
+
+/**
+ * @brief Function to release every node of the free list of a shard
+ *
+ * @param shard
+ */
+static void freelist_clear(heap_shard_t *shard) {
+    for (freelist_t *curr = shard->freelist_head, *next; curr; curr = next) {
+        next = curr->next;
+        free(curr);
+    }
+    shard->freelist_head  = NULL;
+    shard->freelist_root  = NULL;
+    shard->freelist_rover = NULL;
+    shard->size_class_map = 0;
+    shard->num_slots      = 0;
+    shard->num_spare      = 0;
+    memset(shard->size_class, 0, sizeof(shard->size_class));
+}
+
+/**
+ * @brief Function to write the boundary tags of a free block
+ *
+ * @param shard
+ * @param node
+ */
+static void freelist_tag(heap_shard_t *shard, freelist_t *node) {
+    heap_set_block(shard->heap, node->start, node->size, BLOCK_FREE, node->slot);
+    heap_store(shard->heap, node->start + node->size - BLOCK_FOOTER_SIZE, (uint32_t)node->size);
+    heap_set_prev_free(shard, node->start + node->size, true);
+}
+
+/**
+ * @brief Function to split a treap into the nodes starting before key and the rest
+ *
+ * @param root
+ * @param key
+ * @param left
+ * @param right
+ */
+static void treap_split(freelist_t *root, int key, freelist_t **left, freelist_t **right) {
+    if (!root) {
+        *left = *right = NULL;
+    } else if (root->start < key) {
+        treap_split(root->right, key, &root->right, right);
+        *left = root;
+    } else {
+        treap_split(root->left, key, left, &root->left);
+        *right = root;
+    }
+}
+
+/**
+ * @brief Function to merge two treaps, every node of left must start before every node of right
+ *
+ * @param left
+ * @param right
+ * @return freelist_t*
+ */
+static freelist_t *treap_merge(freelist_t *left, freelist_t *right) {
+    if (!left || !right) {
+        return left ? left : right;
+    } else if (left->priority > right->priority) {
+        left->right = treap_merge(left->right, right);
+        return left;
+    } else {
+        right->left = treap_merge(left, right->left);
+        return right;
+    }
+}
+
+/**
+ * @brief Function to find the free block with the highest start address below address
+ *
+ * @param shard
+ * @param address
+ * @return freelist_t*
+ */
+static freelist_t *freelist_predecessor(heap_shard_t *shard, int address) {
+    freelist_t *curr = shard->freelist_root;
+    freelist_t *pred = NULL;
+    while (curr) {
+        if (curr->start < address) {
+            pred = curr;
+            curr = curr->right;
+        } else {
+            curr = curr->left;
+        }
+    }
+
+    return pred;
+}
+
+/**
+ * @brief Function to get the size class of a block size
+ *
+ * @param size
+ * @return int
+ */
+static int size_class_of(int size) {
+    return 31 - __builtin_clz((uint32_t)size);
+}
+
+/**
+ * @brief Function to add a node to the list of its size class
+ *
+ * @param shard
+ * @param node
+ */
+static void size_class_link(heap_shard_t *shard, freelist_t *node) {
+    int k            = size_class_of(node->size);
+    node->class_prev = NULL;
+    node->class_next = shard->size_class[k];
+    if (node->class_next) {
+        node->class_next->class_prev = node;
+    }
+    shard->size_class[k] = node;
+    shard->size_class_map |= 1u << k;
+}
+
+/**
+ * @brief Function to remove a node from the list of its size class
+ *
+ * @param shard
+ * @param node
+ */
+static void size_class_unlink(heap_shard_t *shard, freelist_t *node) {
+    int k = size_class_of(node->size);
+    if (node->class_prev) {
+        node->class_prev->class_next = node->class_next;
+    } else {
+        shard->size_class[k] = node->class_next;
+    }
+    if (node->class_next) {
+        node->class_next->class_prev = node->class_prev;
+    }
+    if (!shard->size_class[k]) {
+        shard->size_class_map &= ~(1u << k);
+    }
+}
+
+/**
+ * @brief Function to change the extent of a free block in place
+ *
+ * @details The caller must keep the block between the same neighbours so the address order of the
+ *         list and the treap are preserved. The block only moves between size class lists when its
+ *         class changes. The boundary tags are rewritten for the new extent.
+ *
+ * @param shard
+ * @param node
+ * @param start
+ * @param size
+ */
+static void freelist_resize(heap_shard_t *shard, freelist_t *node, int start, int size) {
+    bool moved = size_class_of(node->size) != size_class_of(size);
+    if (moved) {
+        size_class_unlink(shard, node);
+    }
+    node->start = start;
+    node->size  = size;
+    if (moved) {
+        size_class_link(shard, node);
+    }
+    freelist_tag(shard, node);
+}
+
+/**
+ * @brief Function to add a node to the free list
+ *
+ * @details The node is linked in address order after its predecessor and added to the treap.
+ *
+ * @param shard
+ * @param node
+ */
+static void freelist_insert(heap_shard_t *shard, freelist_t *node) {
+    freelist_t *pred = freelist_predecessor(shard, node->start);
+    node->prev       = pred;
+    node->next       = pred ? pred->next : shard->freelist_head;
+    if (node->next) {
+        node->next->prev = node;
+    }
+    if (pred) {
+        pred->next = node;
+    } else {
+        shard->freelist_head = node;
+    }
+
+    freelist_t *left, *right;
+    node->left = node->right = NULL;
+    treap_split(shard->freelist_root, node->start, &left, &right);
+    shard->freelist_root = treap_merge(treap_merge(left, node), right);
+
+    size_class_link(shard, node);
+    freelist_tag(shard, node);
+}
+
+/**
+ * @brief Function to remove a node from the free list and release it
+ *
+ * @param shard
+ * @param node
+ */
+static void freelist_remove(heap_shard_t *shard, freelist_t *node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        shard->freelist_head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    if (shard->freelist_rover == node) {
+        shard->freelist_rover = node->next;
+    }
+    size_class_unlink(shard, node);
+
+    freelist_t *left, *middle, *right;
+    treap_split(shard->freelist_root, node->start, &left, &middle);
+    treap_split(middle, node->start + 1, &middle, &right);
+    shard->freelist_root = treap_merge(left, right);
+
+    shard->spare_slots[shard->num_spare++] = node->slot;
+    free(node);
+}
+
+/**
+ * @brief Function to find a free block of at least size bytes using the selected fit policy
+ *
+ * @param shard
+ * @param size
+ * @return freelist_t*
+ */
+static freelist_t *freelist_find(heap_shard_t *shard, int size) {
+    if (shard->fit_policy == FIT_SEG) {
+        // Blocks in the request's own class may still be too small, every block of a higher
+        // class is large enough so its list head can be taken directly.
+        int k = size_class_of(size);
+        for (freelist_t *curr = shard->size_class[k]; curr; curr = curr->class_next) {
+            ++shard->fit_probes;
+            if (curr->size >= size) {
+                return curr;
+            }
+        }
+
+        uint32_t larger = k + 1 < NUM_SIZE_CLASSES ? shard->size_class_map & (~0u << (k + 1)) : 0;
+        return larger ? shard->size_class[__builtin_ctz(larger)] : NULL;
+    } else if (shard->fit_policy == FIT_BEST) {
+        freelist_t *best = NULL;
+        for (freelist_t *curr = shard->freelist_head; curr; curr = curr->next) {
+            ++shard->fit_probes;
+            if (curr->size >= size && (!best || curr->size < best->size)) {
+                best = curr;
+                if (best->size == size) {
+                    break;
+                }
+            }
+        }
+        return best;
+    }
+
+    freelist_t *start = shard->freelist_head;
+    if (shard->fit_policy == FIT_NEXT && shard->freelist_rover) {
+        start = shard->freelist_rover;
+    }
+
+    for (freelist_t *curr = start; curr; curr = curr->next) {
+        ++shard->fit_probes;
+        if (curr->size >= size) {
+            return curr;
+        }
+    }
+    for (freelist_t *curr = shard->freelist_head; curr != start; curr = curr->next) {
+        ++shard->fit_probes;
+        if (curr->size >= size) {
+            return curr;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Function to reserve a block of the heap
+ *
+ * @details The block is carved from the front of a free block. If the remainder would be too
+ *         small to hold another buffer the whole free block is handed out and size is updated.
+ *         The header of the block is written with its size and a name id of 0.
+ *
+ * @param shard
+ * @param size total bytes needed, including the block header
+ * @return int the address of the block or -1 if no free block is large enough
+ */
+static int heap_alloc(heap_shard_t *shard, int *size) {
+    freelist_t *node = freelist_find(shard, *size);
+    if (!node) {
+        return -1;
+    }
+
+    int address = node->start;
+    if (node->size - *size >= (int)MIN_BLOCK_SIZE) {
+        // Carving from the front keeps the node between the same neighbours, so the list and
+        // the treap stay ordered without relinking it.
+        freelist_resize(shard, node, node->start + *size, node->size - *size);
+        shard->freelist_rover = node;
+    } else {
+        *size = node->size;
+        shard->freelist_rover = node->next;
+        freelist_remove(shard, node);
+        heap_set_prev_free(shard, address + *size, false);
+    }
+
+    // The block before a free block is never free, so the new block has no flags
+    heap_set_block(shard->heap, address, *size, 0, 0);
+    ++shard->size_class_used[size_class_of(*size)];
+    return address;
+}
+
+/**
+ * @brief Function to return a block to the heap
+ *
+ * @details The block is merged with the free blocks directly before and after it. Both are found
+ *         in O(1) through the boundary tags: the flags of the block tell whether the block before
+ *         it is free, the footer of that block gives its size and the headers give the node slots.
+ *
+ * @param shard
+ * @param address
+ * @param size
+ */
+static void heap_release(heap_shard_t *shard, int address, int size) {
+    freelist_t *pred = NULL, *succ = NULL;
+    if (heap_block(shard->heap, address).flags & BLOCK_PREV_FREE) {
+        int pred_size = (int)heap_load(shard->heap, address - BLOCK_FOOTER_SIZE);
+        pred          = shard->nodes[heap_block(shard->heap, address - pred_size).name];
+    }
+    if (address + size < shard->end) {
+        block_t next = heap_block(shard->heap, address + size);
+        succ         = next.flags & BLOCK_FREE ? shard->nodes[next.name] : NULL;
+    }
+
+    --shard->size_class_used[size_class_of(size)];
+    if (pred) {
+        if (succ) {
+            size += succ->size;
+            freelist_remove(shard, succ);
+        }
+        freelist_resize(shard, pred, pred->start, pred->size + size);
+    } else if (succ) {
+        freelist_resize(shard, succ, address, succ->size + size);
+    } else {
+        freelist_insert(shard, freelist_new(shard, address, size));
+    }
+}
+
+/**
+ * @brief Function to take the lock of a shard of a shared heap
+ *
+ * @param shard
+ */
+static void shard_lock(heap_shard_t *shard) {
+    if (pthread_mutex_trylock(&shard->lock) != 0) {
+        pthread_mutex_lock(&shard->lock);
+        ++shard->contended;
+    }
+    ++shard->acquisitions;
+}
+
+/**
+ * @brief Function to return a block to the shard of a shared heap that covers it
+ *
+ * @param shared
+ * @param address
+ * @param size
+ */
+static void shared_free(shared_heap_t *shared, int address, int size) {
+    // Every shard but the last spans the same number of bytes
+    int           k     = address / shared->shards[0].end;
+    heap_shard_t *shard = &shared->shards[k < shared->num_shards ? k : shared->num_shards - 1];
+    shard_lock(shard);
+    heap_release(shard, address, size);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Function to give every block of the cache of an instance back to the shared heap
+ *
+ * @param mem
+ * @return int the number of blocks given back
+ */
+static int tcache_flush(memory_t *mem) {
+    int flushed = 0;
+    for (int bin = 0; bin < TCACHE_BINS; ++bin) {
+        while (mem->tcache.count[bin] > 0) {
+            shared_free(mem->shared, mem->tcache.blocks[bin][--mem->tcache.count[bin]], bin * HEAP_ALIGNMENT);
+            ++flushed;
+        }
+    }
+    return flushed;
+}
+
+/**
+ * @brief Function to reserve a block of a shared heap
+ *
+ * @details A cached block of exactly the right size is reused without taking any lock. Otherwise
+ *         the shards are tried starting from the home shard of the instance, and if none has room
+ *         the cache is flushed so its blocks can merge with their neighbours before trying again.
+ *
+ * @param mem
+ * @param size total bytes needed, including the block header
+ * @return int the address of the block or -1 if no free block is large enough
+ */
+static int shared_alloc(memory_t *mem, int *size) {
+    tcache_t *tcache = &mem->tcache;
+    int       bin    = *size / HEAP_ALIGNMENT;
+    if (bin < TCACHE_BINS && tcache->count[bin] > 0) {
+        ++tcache->hits;
+        return tcache->blocks[bin][--tcache->count[bin]];
+    }
+    ++tcache->misses;
+
+    shared_heap_t *shared = mem->shared;
+    do {
+        for (int k = 0; k < shared->num_shards; ++k) {
+            heap_shard_t *shard = &shared->shards[(mem->home_shard + k) % shared->num_shards];
+            shard_lock(shard);
+            int address = heap_alloc(shard, size);
+            pthread_mutex_unlock(&shard->lock);
+            if (address != -1) {
+                return address;
+            }
+        }
+    } while (tcache_flush(mem) > 0);
+
+    return -1;
+}
+
+/**
+ * @brief Function to return a block to a shared heap
+ *
+ * @details Small blocks go to the cache of the instance while their bin has room, everything else
+ *         goes back to its shard.
+ *
+ * @param mem
+ * @param address
+ * @param size
+ */
+static void shared_release(memory_t *mem, int address, int size) {
+    tcache_t *tcache = &mem->tcache;
+    int       bin    = size / HEAP_ALIGNMENT;
+    if (bin < TCACHE_BINS && tcache->count[bin] < TCACHE_COUNT) {
+        tcache->blocks[bin][tcache->count[bin]++] = address;
+    } else {
+        shared_free(mem->shared, address, size);
+    }
+}
+
+/**
+ * @brief Function to get the bytes the buddy allocator state takes after the heap
+ *
+ * @param config
+ * @return size_t 0 when the heap does not use the buddy allocator
+ */
+static size_t buddy_state_size(const config_t *config) {
+    if (!config->buddy) {
+        return 0;
+    }
+
+    size_t bytes = ALIGN_UP(sizeof(buddy_t), sizeof(uint64_t));
+    for (int k = BUDDY_MIN_ORDER; k <= size_class_of(config->heap_size); ++k) {
+        bytes += (((size_t)config->heap_size >> k) + 63) / 64 * sizeof(uint64_t);
+    }
+    return bytes + ((size_t)config->heap_size >> BUDDY_MIN_ORDER) * sizeof(uint32_t);
+}
+
+/**
+ * @brief Function to point the buddy allocator state of an instance into its heap mapping
+ *
+ * @param mem
+ */
+static void buddy_bind(memory_t *mem) {
+    char *state      = mem->heap + mem->config.heap_size;
+    mem->buddy       = (buddy_t *)state;
+    mem->buddy_order = size_class_of(mem->config.heap_size);
+    state += ALIGN_UP(sizeof(buddy_t), sizeof(uint64_t));
+    for (int k = BUDDY_MIN_ORDER; k <= mem->buddy_order; ++k) {
+        mem->buddy_free[k] = (uint64_t *)state;
+        state += (((size_t)mem->config.heap_size >> k) + 63) / 64 * sizeof(uint64_t);
+    }
+    mem->buddy_needed = (uint32_t *)state;
+}
+
+/**
+ * @brief Function to get the bytes the heap mapping of an instance takes
+ *
+ * @details The buddy allocator state follows the heap, the quarantine and shadow map of a checked
+ *      heap follow that.
+ *
+ * @param config
+ * @return size_t
+ */
+static size_t heap_mapping_size(const config_t *config) {
+    size_t bytes = (size_t)config->heap_size + buddy_state_size(config);
+    if (HEAP_CHECK) {
+        bytes = ALIGN_UP(bytes, sizeof(uint64_t)) + ALIGN_UP(sizeof(quarantine_t), sizeof(uint64_t)) +
+                ((size_t)config->heap_size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Function to point the quarantine and shadow map of a checked heap into its heap mapping
+ *
+ * @param mem
+ */
+static void check_bind(memory_t *mem) {
+    char *state     = mem->heap + ALIGN_UP(mem->config.heap_size + buddy_state_size(&mem->config), sizeof(uint64_t));
+    mem->quarantine = (quarantine_t *)state;
+    mem->shadow     = (uint8_t *)state + ALIGN_UP(sizeof(quarantine_t), sizeof(uint64_t));
+}
+
+/**
+ * @brief Function to set the shadow state of every granule a range of a checked heap touches
+ *
+ * @param mem
+ * @param address
+ * @param size
+ * @param state
+ */
+static void shadow_set(memory_t *mem, int address, int size, uint8_t state) {
+    int first = address / HEAP_ALIGNMENT, last = (address + size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT;
+    memset(mem->shadow + first, state, (size_t)(last - first));
+}
+
+/**
+ * @brief Function to check whether a block of a checked heap is in the quarantine
+ *
+ * @details Always false on a heap without a shadow map, so the walks of the heap can skip the
+ *      quarantine without knowing about it.
+ *
+ * @param mem
+ * @param address block address
+ * @return true if DH deleted the buffer of the block and the block was not reused yet
+ */
+static bool heap_quarantined(memory_t *mem, int address) {
+    return HEAP_CHECK && mem->shadow && mem->shadow[address / HEAP_ALIGNMENT] == SHADOW_FREED;
+}
+
+/**
+ * @brief Function to poison the header and red zone of a new buffer of a checked heap
+ *
+ * @details The bytes of the block after the payload, alignment padding included, are the red zone.
+ *
+ * @param mem
+ * @param address block address
+ * @param size block size
+ * @param payload bytes CH asked for
+ */
+static void check_poison(memory_t *mem, int address, int size, int payload) {
+    int start = address + BLOCK_HEADER_SIZE, end = start + payload;
+    shadow_set(mem, address, BLOCK_HEADER_SIZE, SHADOW_HEADER);
+    shadow_set(mem, start, payload, HEAP_ALIGNMENT);
+    if (payload % HEAP_ALIGNMENT) {
+        mem->shadow[end / HEAP_ALIGNMENT] = payload % HEAP_ALIGNMENT;
+    }
+    shadow_set(mem, ALIGN_UP(end, HEAP_ALIGNMENT), address + size - ALIGN_UP(end, HEAP_ALIGNMENT), SHADOW_REDZONE);
+    memset(mem->heap + end, REDZONE_BYTE, (size_t)(address + size - end));
+}
+
+/**
+ * @brief Function to check that every byte of a range still holds its poison
+ *
+ * @param bytes
+ * @param size
+ * @param fill
+ * @return true if nothing wrote to the range
+ */
+static bool check_intact(const char *bytes, int size, int fill) {
+    for (int k = 0; k < size; ++k) {
+        if ((unsigned char)bytes[k] != fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Function to add a block to or take it off the free bitmap of its order
+ *
+ * @details A block that becomes free also gets a free block header, so walks of the heap see it.
+ *
+ * @param mem
+ * @param k order of the block
+ * @param address
+ * @param is_free
+ */
+static void buddy_set_free(memory_t *mem, int k, int address, bool is_free) {
+    buddy_t  *buddy = mem->buddy;
+    uint32_t  w     = (uint32_t)(address >> k) / 64;
+    uint64_t  bit   = 1ull << ((address >> k) % 64);
+    if (is_free) {
+        mem->buddy_free[k][w] |= bit;
+        buddy->hints[k] = w < buddy->hints[k] ? w : buddy->hints[k];
+        ++buddy->counts[k];
+        buddy->order_map |= 1u << k;
+        heap_set_block(mem->heap, address, 1 << k, BLOCK_FREE, 0);
+    } else {
+        mem->buddy_free[k][w] &= ~bit;
+        if (--buddy->counts[k] == 0) {
+            buddy->order_map &= ~(1u << k);
+        }
+    }
+}
+
+/**
+ * @brief Function to reserve a block of a buddy heap
+ *
+ * @details The lowest free block of the smallest order that fits is taken and halved until it is
+ *         the smallest power of two that fits, every half split off goes on the free bitmap of
+ *         its order. The free block of an order is found from the hint of its bitmap, the split
+ *         takes at most one step per order, so O(log heap).
+ *
+ * @param mem
+ * @param size total bytes needed, including the block header, set to the size of the block
+ * @return int the address of the block or -1 if no free block is large enough
+ */
+static int buddy_alloc(memory_t *mem, int *size) {
+    buddy_t *buddy = mem->buddy;
+    int      need  = *size <= 1 << BUDDY_MIN_ORDER ? BUDDY_MIN_ORDER : 32 - __builtin_clz((uint32_t)*size - 1);
+    uint32_t fits  = need <= mem->buddy_order ? buddy->order_map >> need << need : 0;
+    if (!fits) {
+        return -1;
+    }
+
+    int       k      = __builtin_ctz(fits);
+    uint64_t *bitmap = mem->buddy_free[k];
+    uint32_t  w      = buddy->hints[k];
+    while (!bitmap[w]) {
+        ++w;
+    }
+    mem->shard.fit_probes += w - buddy->hints[k] + 1;
+    buddy->hints[k] = w;
+
+    int address = (int)((w * 64 + __builtin_ctzll(bitmap[w])) << k);
+    buddy_set_free(mem, k, address, false);
+    while (k > need) {
+        --k;
+        buddy_set_free(mem, k, address + (1 << k), true);
+    }
+
+    mem->buddy_needed[address >> BUDDY_MIN_ORDER] = (uint32_t)*size;
+    *size                                         = 1 << need;
+    heap_set_block(mem->heap, address, *size, 0, 0);
+    ++mem->shard.size_class_used[need];
+    return address;
+}
+
+/**
+ * @brief Function to return a block to a buddy heap
+ *
+ * @details The block is merged with its buddy for as long as the buddy is free, one step per
+ *         order, so O(log heap).
+ *
+ * @param mem
+ * @param address
+ * @param size bytes of the block, set to the size of the free block it ends up in
+ * @return int the address of the free block it ends up in
+ */
+static int buddy_release(memory_t *mem, int address, int *size) {
+    int k = size_class_of(*size);
+    --mem->shard.size_class_used[k];
+    while (k < mem->buddy_order) {
+        int buddy = address ^ (1 << k);
+        if (!(mem->buddy_free[k][(buddy >> k) / 64] >> ((buddy >> k) % 64) & 1)) {
+            break;
+        }
+        buddy_set_free(mem, k, buddy, false);
+        address &= ~(1 << k);
+        ++k;
+    }
+
+    buddy_set_free(mem, k, address, true);
+    *size = 1 << k;
+    return address;
+}
+
+/**
+ * @brief Function to walk the allocated buffers of the heap in address order
+ *
+ * @details Every block header holds the block size, so each step of the walk is O(1).
+ *
+ * @param mem
+ * @param address offset of a block to continue from, 0 to start the walk
+ * @param block set to the header of the next buffer
+ * @return true if a buffer was found, false when the end of the heap is reached
+ */
+static bool heap_next_buffer(memory_t *mem, int *address, block_t *block) {
+    while (*address < mem->config.heap_size) {
+        *block = heap_block(mem->heap, *address);
+        *address += block->size;
+        if (!(block->flags & BLOCK_FREE) && !heap_quarantined(mem, block->address)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Function to mark a frame as changed since the last SM
+ *
+ * @param mem
+ * @param i frame slot
+ */
+static void frame_touch(memory_t *mem, int i) {
+    if (!mem->stack_frame[i].dirty) {
+        mem->stack_frame[i].dirty                  = true;
+        mem->dirty_frames[mem->num_dirty_frames++] = i;
+    }
+}
+
+/**
+ * @brief Function to record whether a frame has a free pointer slot
+ *
+ * @param mem
+ * @param i frame slot
+ * @param has_free
+ */
+static void frame_set_free(memory_t *mem, int i, bool has_free) {
+    uint64_t *word = &mem->frames_free[i / 64], bit = 1ull << (i % 64);
+    if (has_free != ((*word & bit) != 0)) {
+        *word ^= bit;
+        mem->num_frames_free += has_free ? 1 : -1;
+    }
+}
+
+/**
+ * @brief Function to find the lowest free pointer slot of a frame
+ *
+ * @param mem
+ * @param i frame slot
+ * @return int the pointer slot or -1 if every slot is taken
+ */
+static int pointer_slot_find(memory_t *mem, int i) {
+    const uint64_t *free_slots = mem->stack_frame[i].pointer_free;
+    for (int w = 0; w < mem->pointer_words; ++w) {
+        if (free_slots[w]) {
+            return w * 64 + __builtin_ctzll(free_slots[w]);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Function to mark every pointer slot of a frame free
+ *
+ * @param mem
+ * @param i frame slot
+ */
+static void pointer_slots_reset(memory_t *mem, int i) {
+    uint64_t *free_slots = mem->stack_frame[i].pointer_free;
+    for (int w = 0; w < mem->pointer_words; ++w) {
+        int slots     = mem->config.max_pointers - w * 64;
+        free_slots[w] = slots >= 64 ? ~0ull : (1ull << slots) - 1;
+    }
+}
+
+/**
+ * @brief Function to record the pointer slot that refers to a buffer
+ *
+ * @param mem
+ * @param address address of the block of the buffer
+ * @param slot frame slot * max_pointers + pointer slot
+ */
+static void buffer_own(memory_t *mem, int address, int slot) {
+    uint64_t       key   = name_id_key(heap_load(mem->heap, address + sizeof(uint32_t)));
+    index_entry_t *entry = index_find(&mem->buffer_owner, key, 0);
+    if (entry) {
+        entry->value = slot;
+    } else {
+        index_insert(&mem->buffer_owner, key, 0, slot);
+    }
+}
+
+/**
+ * @brief Function to record the owners of all buffers again from the pointer slots of the frames
+ *
+ * @details Used when the frames were restored as a whole, by LOAD and UNDO. Pointers that do not
+ *      point at the payload of a buffer in the buffer index are left out.
+ *
+ * @param mem
+ */
+static void buffer_owners_rebuild(memory_t *mem) {
+    free(mem->buffer_owner.entries);
+    mem->buffer_owner = (name_index_t){0};
+    for (int i = 0; i <= mem->top_frame; ++i) {
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            long address = (char *)mem->stack_frame[i].pointers[j] - mem->heap - BLOCK_HEADER_SIZE;
+            if (!mem->stack_frame[i].pointers[j] || address < 0) {
+                continue;
+            }
+            index_entry_t *entry = index_find(&mem->buffer_index,
+                                              name_id_key(heap_load(mem->heap, (int)address + sizeof(uint32_t))), 0);
+            if (entry && entry->value == address) {
+                buffer_own(mem, (int)address, i * mem->config.max_pointers + j);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Function to store a pointer in a pointer slot of a frame
+ *
+ * @details Keeps the free slot bitmap of the frame and the set of frames with a free slot up to
+ *      date, NULL frees the slot. A pointer also becomes the owner of its buffer, the slot DH
+ *      clears.
+ *
+ * @param mem
+ * @param i frame slot
+ * @param j pointer slot
+ * @param pointer
+ */
+static void pointer_slot_set(memory_t *mem, int i, int j, void *pointer) {
+    frame_t *frame     = &mem->stack_frame[i];
+    uint64_t bit       = 1ull << (j % 64);
+    frame->pointers[j] = pointer;
+    if (pointer) {
+        buffer_own(mem, (int)((char *)pointer - mem->heap) - BLOCK_HEADER_SIZE, i * mem->config.max_pointers + j);
+        frame->pointer_free[j / 64] &= ~bit;
+        frame_set_free(mem, i, pointer_slot_find(mem, i) != -1);
+    } else {
+        frame->pointer_free[j / 64] |= bit;
+        frame_set_free(mem, i, true);
+    }
+    frame_touch(mem, i);
+}
+
+/**
+ * @brief Function to mark a buffer as created or deleted since the last SM
+ *
+ * @param mem
+ * @param key name id key of the buffer
+ * @param address start address of the buffer
+ */
+static void buffer_touch(memory_t *mem, uint64_t key, int address) {
+    index_erase(&mem->dirty_buffers, key, 0);
+    index_insert(&mem->dirty_buffers, key, 0, address);
+}
+
+/**
+ * @brief Function to find an allocated buffer by name
+ *
+ * @param mem
+ * @param buffer_name
+ * @return int the address of the block of the buffer or -1 if it does not exist
+ */
+static int heap_find_buffer(memory_t *mem, char *buffer_name) {
+    uint32_t       id    = name_find(&mem->names, buffer_name);
+    index_entry_t *entry = id == NO_NAME ? NULL : index_find(&mem->buffer_index, name_id_key(id), 0);
+    return entry ? entry->value : -1;
+}
+
+/**
+ * @brief Function to allocate zeroed memory for a simulator table
+ *
+ * @param count
+ * @param size
+ * @return void*
+ */
+static void *table_alloc(size_t count, size_t size) {
+    void *table = calloc(count ? count : 1, size);
+    if (!table) {
+        fprintf(stderr, "Error: Could not allocate memory for the simulator tables\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return table;
+}
+
+/**
+ * @brief Function to map a memory arena
+ *
+ * @details Every arena is one contiguous anonymous mapping, so pages are only backed once the
+ *      simulator touches them. Large arenas are mapped with huge pages when the system has them
+ *      reserved and otherwise ask for transparent huge pages.
+ *
+ * @param size
+ * @param mapped set to the number of bytes actually mapped
+ * @return char*
+ */
+static char *arena_map(size_t size, size_t *mapped) {
+    void *arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (size >= HUGE_PAGE_SIZE) {
+        *mapped = ALIGN_UP(size, HUGE_PAGE_SIZE);
+        arena   = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (arena == MAP_FAILED) {
+        *mapped = size;
+        arena   = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map %zu bytes of memory\n", size);
+            exit(EXIT_FAILURE);
+        }
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE) {
+            madvise(arena, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    return (char *)arena;
+}
+
+/**
+ * @brief Function to get the unit an arena can be protected or released in
+ *
+ * @details Huge page mappings can only be handled in whole huge pages.
+ *
+ * @param mapped bytes mapped for the arena
+ * @return size_t
+ */
+static size_t arena_granule(size_t mapped) {
+    return mapped >= HUGE_PAGE_SIZE && mapped % HUGE_PAGE_SIZE == 0 ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Function to create a heap that several instances can share
+ *
+ * @details The heap is split into num_shards ranges of equal size, the last one taking what is
+ *      left over. The number of shards is reduced when the ranges would be too small to hold a
+ *      buffer.
+ *
+ * @param config geometry of the instances that will share the heap
+ * @param num_shards
+ * @return shared_heap_t*
+ */
+static shared_heap_t *shared_heap_create(const config_t *config, int num_shards) {
+    shared_heap_t *shared = (shared_heap_t *)calloc(1, sizeof(shared_heap_t));
+    if (!shared) {
+        fprintf(stderr, "Error: Could not allocate memory for the shared heap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int min_span = (int)MIN_BLOCK_SIZE;
+    num_shards   = num_shards < MAX_SHARDS ? num_shards : MAX_SHARDS;
+    num_shards   = num_shards < config->heap_size / min_span ? num_shards : config->heap_size / min_span;
+    num_shards   = num_shards > 0 ? num_shards : 1;
+
+    int span           = config->heap_size / num_shards / HEAP_ALIGNMENT * HEAP_ALIGNMENT;
+    shared->heap       = arena_map(config->heap_size, &shared->heap_mapped);
+    shared->num_shards = num_shards;
+    for (int k = 0; k < num_shards; ++k) {
+        heap_shard_t *shard   = &shared->shards[k];
+        shard->fit_policy     = FIT_FIRST;
+        shard->priority_state = 2463534242u + k;
+        shard->heap           = shared->heap;
+        shard->start          = k * span;
+        shard->end            = k == num_shards - 1 ? config->heap_size : (k + 1) * span;
+        pthread_mutex_init(&shard->lock, NULL);
+        freelist_insert(shard, freelist_new(shard, shard->start, shard->end - shard->start));
+    }
+
+    return shared;
+}
+
+/**
+ * @brief Function to release a shared heap once no instance uses it any more
+ *
+ * @param shared
+ */
+static void shared_heap_destroy(shared_heap_t *shared) {
+    for (int k = 0; k < shared->num_shards; ++k) {
+        freelist_clear(&shared->shards[k]);
+        free(shared->shards[k].nodes);
+        free(shared->shards[k].spare_slots);
+        pthread_mutex_destroy(&shared->shards[k].lock);
+    }
+    munmap(shared->heap, shared->heap_mapped);
+    free(shared);
+}
+
+/**
+ * @brief Function to get the number of records of the variable pool of a type
+ *
+ * @details The config gives the variables of a type per frame, the pool holds that many for every
+ *      frame. No more variables of the type fit on the stack at once, and the index of every
+ *      record must fit in a variable reference.
+ *
+ * @param config
+ * @param type
+ * @return int
+ */
+static int var_pool_capacity(const config_t *config, var_type_t type) {
+    int  per_frame = type == VAR_INT ? config->max_ints : type == VAR_DOUBLE ? config->max_doubles : config->max_chars;
+    long records   = (long)config->max_frames * per_frame;
+    long on_stack  = config->stack_size / var_type_sizes[type];
+    records        = records < on_stack ? records : on_stack;
+    return (int)(records < INT_MAX / NUM_VAR_TYPES ? records : INT_MAX / NUM_VAR_TYPES);
+}
+
+/**
+ * @brief Function to get the bytes the variable pools of an instance take
+ *
+ * @param config
+ * @return size_t
+ */
+static size_t tables_size(const config_t *config) {
+    size_t bytes = ALIGN_UP(NUM_VAR_TYPES * sizeof(var_pool_t), sizeof(uint64_t));
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        bytes += (size_t)var_pool_capacity(config, (var_type_t)t) * sizeof(var_record_t);
+    }
+    return bytes;
+}
+
+/**
+ * @brief Function to point the variable pools of an instance into its tables
+ *
+ * @param mem
+ */
+static void tables_bind(memory_t *mem) {
+    char *records  = mem->tables + ALIGN_UP(NUM_VAR_TYPES * sizeof(var_pool_t), sizeof(uint64_t));
+    mem->var_pools = (var_pool_t *)mem->tables;
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        mem->var_records[t] = (var_record_t *)records;
+        records += (size_t)var_pool_capacity(&mem->config, (var_type_t)t) * sizeof(var_record_t);
+    }
+}
+
+static _Thread_local memory_t *checkpointed;         // instances of this thread with a checkpoint
+static struct sigaction        checkpoint_previous;  // handler of the faults that are not checkpoint writes
+static pthread_once_t          checkpoint_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Function to save a page of a tracked region to the top checkpoint on its first write
+ *
+ * @details A fault anywhere else is not a checkpoint write, the previous handler is put back and
+ *      the faulting access is retried under it.
+ *
+ * @param signal
+ * @param info
+ * @param context
+ */
+static void checkpoint_fault(int signal, siginfo_t *info, void *context) {
+    (void)signal;
+    (void)context;
+    char *address = (char *)info->si_addr;
+    for (memory_t *mem = checkpointed; mem; mem = mem->checkpoints.next) {
+        checkpoints_t *ckpt = &mem->checkpoints;
+        for (int r = 0; r < CHECKPOINT_REGIONS; ++r) {
+            checkpoint_region_t *region = &ckpt->regions[r];
+            if (address < region->base || address >= region->base + region->size) {
+                continue;
+            }
+
+            size_t        page  = (size_t)(address - region->base) / region->granule;
+            size_t        bit   = region->first_page + page;
+            char         *bytes = region->base + page * region->granule;
+            checkpoint_t *level = &ckpt->levels[ckpt->depth - 1];
+            memcpy(level->images + region->offset + page * region->granule, bytes, region->granule);
+            level->saved[bit / 64] |= 1ull << (bit % 64);
+            if (mprotect(bytes, region->granule, PROT_READ | PROT_WRITE) == 0) {
+                return;
+            }
+
+            static const char message[] = "Error: Could not make a page of a checkpoint writable\n";
+            ssize_t           written   = write(STDERR_FILENO, message, sizeof(message) - 1);
+            (void)written;
+            break;
+        }
+    }
+    sigaction(SIGSEGV, &checkpoint_previous, NULL);
+}
+
+/**
+ * @brief Function to install the checkpoint fault handler, once for the whole process
+ *
+ */
+static void checkpoint_install() {
+    struct sigaction action = {.sa_sigaction = checkpoint_fault, .sa_flags = SA_SIGINFO};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &checkpoint_previous);
+}
+
+/**
+ * @brief Function to make the tracked regions read only again, except the pages the top
+ *      checkpoint already saved
+ *
+ * @param mem
+ */
+static void checkpoint_arm(memory_t *mem) {
+    checkpoints_t *ckpt  = &mem->checkpoints;
+    checkpoint_t  *level = &ckpt->levels[ckpt->depth - 1];
+    for (int r = 0; r < CHECKPOINT_REGIONS; ++r) {
+        checkpoint_region_t *region = &ckpt->regions[r];
+        mprotect(region->base, region->size, PROT_READ);
+        for (size_t page = 0; page * region->granule < region->size; ++page) {
+            size_t bit = region->first_page + page;
+            if (level->saved[bit / 64] >> (bit % 64) & 1) {
+                mprotect(region->base + page * region->granule, region->granule, PROT_READ | PROT_WRITE);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Function to make the tracked regions writable
+ *
+ * @param mem
+ */
+static void checkpoint_disarm(memory_t *mem) {
+    for (int r = 0; r < CHECKPOINT_REGIONS; ++r) {
+        mprotect(mem->checkpoints.regions[r].base, mem->checkpoints.regions[r].size, PROT_READ | PROT_WRITE);
+    }
+}
+
+/**
+ * @brief Function to take an instance off the list of the instances of its thread with a checkpoint
+ *
+ * @param mem
+ */
+static void checkpoint_unlink(memory_t *mem) {
+    for (memory_t **link = &checkpointed; *link; link = &(*link)->checkpoints.next) {
+        if (*link == mem) {
+            *link = mem->checkpoints.next;
+            break;
+        }
+    }
+    mem->checkpoints.next = NULL;
+}
+
+/**
+ * @brief Function to release one checkpoint level
+ *
+ * @param level
+ */
+static void checkpoint_release(checkpoint_t *level) {
+    munmap(level->images, level->images_mapped);
+    free(level->saved);
+    free(level->gc_marks);
+    *level = (checkpoint_t){0};
+}
+
+/**
+ * @brief Function to drop every checkpoint of an instance, keeping its current state
+ *
+ * @param mem
+ */
+static void checkpoints_drop(memory_t *mem) {
+    checkpoints_t *ckpt = &mem->checkpoints;
+    if (ckpt->depth == 0) {
+        return;
+    }
+
+    checkpoint_disarm(mem);
+    checkpoint_unlink(mem);
+    while (ckpt->depth) {
+        checkpoint_release(&ckpt->levels[--ckpt->depth]);
+    }
+}
+
+/**
+ * @brief Function to initialize the memory
+ *
+ * @details This function is used to initialize the memory, it allocates and initializes the frame
+ *      status, stack frame, and variable tables, maps the heap and sets up the free list with a
+ *      single block covering the whole heap. Every instance owns all of its state, so separate
+ *      instances can be used from separate threads. An instance attached to a shared heap uses
+ *      it instead of mapping its own.
+ *
+ * @param mem
+ * @param config geometry of the instance
+ * @param shared heap to attach to, NULL for a private heap
+ */
+void init(memory_t *mem, const config_t *config, shared_heap_t *shared) {
+    *mem = (memory_t){.config = *config, .error = stderr, .shared = shared, .shard = {.priority_state = 2463534242u}};
+
+    mem->dirty_frames  = (int *)table_alloc(mem->config.max_frames, sizeof(int));
+    mem->output.fd     = STDOUT_FILENO;
+    mem->pointer_words = (mem->config.max_pointers + 63) / 64;
+
+    // The frame records, pointers and free slot bitmaps share one mapping, so a checkpoint can
+    // track their pages like those of the stack and the heap
+    size_t frames  = (size_t)mem->config.max_frames;
+    size_t sizes[] = {
+        ALIGN_UP(frames * sizeof(frame_status_t), sizeof(uint64_t)),
+        ALIGN_UP(frames * sizeof(frame_t), sizeof(uint64_t)),
+        frames * mem->config.max_pointers * sizeof(void *),
+        frames * mem->pointer_words * sizeof(uint64_t),
+        (frames + 63) / 64 * sizeof(uint64_t),
+    };
+    mem->frame_arena  = arena_map(sizes[0] + sizes[1] + sizes[2] + sizes[3] + sizes[4], &mem->frame_arena_mapped);
+    mem->frame_status = (frame_status_t *)mem->frame_arena;
+    mem->stack_frame  = (frame_t *)(mem->frame_arena + sizes[0]);
+
+    void    **pointers     = (void **)(mem->frame_arena + sizes[0] + sizes[1]);
+    uint64_t *pointer_free = (uint64_t *)((char *)pointers + sizes[2]);
+    mem->frames_free       = (uint64_t *)((char *)pointer_free + sizes[3]);
+
+    mem->tables = arena_map(tables_size(&mem->config), &mem->tables_mapped);
+    tables_bind(mem);
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        mem->var_pools[t] = (var_pool_t){.free = -1, .capacity = var_pool_capacity(&mem->config, (var_type_t)t)};
+    }
+
+    // The config check keeps the stack region above the heap, so the two can never overlap
+    mem->stack_pointer = mem->config.mem_size;
+    mem->top_frame     = -1;
+    mem->stack_limit   = mem->config.mem_size - mem->config.stack_size;
+    mem->stack         = arena_map(mem->config.stack_size ? mem->config.stack_size : 1, &mem->stack_mapped);
+
+    for (int i = 0; i < mem->config.max_frames; ++i) {
+        mem->frame_status[i] = (frame_status_t){
+            .number        = 0,
+            .name          = NO_NAME,
+            .func_address  = 0,
+            .frame_address = 0,
+            .used          = false,
+        };
+
+        mem->stack_frame[i] = (frame_t){
+            .frame_address = -1,
+            .base          = -1,
+            .size          = 0,
+            .var_first     = {-1, -1, -1},
+            .var_last      = {-1, -1, -1},
+            .pointers      = pointers + (size_t)i * mem->config.max_pointers,
+            .pointer_free  = pointer_free + (size_t)i * mem->pointer_words,
+        };
+        pointer_slots_reset(mem, i);
+    }
+
+    mem->stats.start_cycles = clock_cycles();
+    mem->stats.start_ns     = clock_ns();
+    if (mem->config.profile) {
+        uint32_t capacity = 1;
+        while (capacity < (uint32_t)mem->config.profile) {
+            capacity *= 2;
+        }
+        mem->prof.mask   = capacity - 1;
+        mem->prof.events = (prof_event_t *)table_alloc(capacity, sizeof(prof_event_t));
+    }
+
+    mem->heap_size = 0;
+    if (shared) {
+        mem->heap       = shared->heap;
+        mem->home_shard = atomic_fetch_add(&shared->next_home, 1) % shared->num_shards;
+        return;
+    }
+
+    mem->heap             = arena_map(heap_mapping_size(&mem->config), &mem->heap_mapped);
+    mem->shard.fit_policy = FIT_FIRST;
+    mem->shard.heap       = mem->heap;
+    mem->shard.end        = mem->config.heap_size;
+    if (HEAP_CHECK) {
+        check_bind(mem);
+    }
+    if (mem->config.buddy) {
+        buddy_bind(mem);
+        buddy_set_free(mem, mem->buddy_order, 0, true);
+        return;
+    }
+    freelist_insert(&mem->shard, freelist_new(&mem->shard, 0, mem->config.heap_size));
+}
+
+/**
+ * @brief Function to release the memory
+ *
+ * @details This function is used to release everything init allocated, after it init can be
+ *      called again, possibly with a different geometry. An instance attached to a shared heap
+ *      gives its remaining buffers and cached blocks back to it and leaves the heap mapped.
+ *
+ * @param mem
+ */
+void destroy(memory_t *mem) {
+    checkpoints_drop(mem);
+    if (mem->shared) {
+        for (uint32_t k = 0; mem->buffer_index.entries && k <= mem->buffer_index.mask; ++k) {
+            index_entry_t *entry = &mem->buffer_index.entries[k];
+            if (entry->key != 0) {
+                shared_release(mem, entry->value, heap_block(mem->heap, entry->value).size);
+            }
+        }
+        tcache_flush(mem);
+        atomic_fetch_add(&mem->shared->tcache_hits, (long long)mem->tcache.hits);
+        atomic_fetch_add(&mem->shared->tcache_misses, (long long)mem->tcache.misses);
+    }
+
+    freelist_clear(&mem->shard);
+    free(mem->shard.nodes);
+    free(mem->shard.spare_slots);
+    name_table_free(&mem->names);
+    free(mem->frame_index.entries);
+    free(mem->var_index.entries);
+    free(mem->buffer_index.entries);
+    free(mem->buffer_owner.entries);
+    free(mem->dirty_buffers.entries);
+    free(mem->dirty_frames);
+    free(mem->output.data);
+    free(mem->gc.marks);
+    free(mem->prof.events);
+    free(mem->prof.sites);
+    free(mem->prof.site_index.entries);
+    free(mem->prof.live);
+
+    munmap(mem->frame_arena, mem->frame_arena_mapped);
+    munmap(mem->tables, mem->tables_mapped);
+    munmap(mem->stack, mem->stack_mapped);
+    if (!mem->shared) {
+        munmap(mem->heap, mem->heap_mapped);
+    }
+
+    memset(mem, 0, sizeof(*mem));
+}
+
+/**
+ * @brief Function to write out everything buffered in an output buffer
+ *
+ * @details stdout is flushed first so output printed through stdio keeps its order.
+ *
+ * @param out
+ */
+static void output_flush(output_t *out) {
+    fflush(stdout);
+    for (size_t done = 0; done < out->size;) {
+        ssize_t bytes = write(out->fd, out->data + done, out->size - done);
+        if (bytes <= 0) {
+            break;
+        }
+        done += (size_t)bytes;
+    }
+    out->size = 0;
+}
+
+/**
+ * @brief Function to make sure an output buffer has been allocated
+ *
+ * @param out
+ */
+static void output_reserve(output_t *out) {
+    if (!out->data) {
+        out->data = (char *)malloc(OUTPUT_BUFFER_SIZE);
+        if (!out->data) {
+            fprintf(stderr, "Error: Could not allocate memory for the output buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Function to append formatted text to an output buffer
+ *
+ * @details The buffer is written out whenever it fills up, so the memory used stays bounded no
+ *      matter how much is printed.
+ *
+ * @param out
+ * @param format
+ * @param ...
+ */
+static void output_printf(output_t *out, const char *format, ...) {
+    output_reserve(out);
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(out->data + out->size, OUTPUT_BUFFER_SIZE - out->size, format, args);
+        va_end(args);
+
+        if (length >= 0 && out->size + (size_t)length < OUTPUT_BUFFER_SIZE) {
+            out->size += (size_t)length;
+            return;
+        }
+        output_flush(out);
+    }
+}
+
+/**
+ * @brief Function to get the bytes of a stack address
+ *
+ * @param mem
+ * @param address simulated address between stack_limit and mem_size
+ * @return char*
+ */
+static char *stack_bytes(memory_t *mem, int address) {
+    return mem->stack + (address - mem->stack_limit);
+}
+
+/**
+ * @brief Function to read the value of a variable from the stack
+ *
+ * @param mem
+ * @param var
+ * @param type
+ * @return var_value_t
+ */
+static var_value_t stack_value(memory_t *mem, const var_record_t *var, var_type_t type) {
+    var_value_t value = {0};
+    memcpy(&value, stack_bytes(mem, var->address), var_type_sizes[type]);
+    return value;
+}
+
+/**
+ * @brief Function to get the next variable of a frame in creation order
+ *
+ * @details The cursor holds the next record of every type list of the frame and starts at its
+ *      var_first. Variables are pushed down the stack, so the oldest of the heads is the one at
+ *      the highest address.
+ *
+ * @param mem
+ * @param cursor next record of each type, advanced past the returned one
+ * @param type set to the type of the returned variable
+ * @return var_record_t* NULL once every list is done
+ */
+static var_record_t *frame_next_var(memory_t *mem, int cursor[NUM_VAR_TYPES], var_type_t *type) {
+    var_record_t *next = NULL;
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        var_record_t *head = cursor[t] == -1 ? NULL : &mem->var_records[t][cursor[t]];
+        if (head && (!next || head->address > next->address)) {
+            next  = head;
+            *type = (var_type_t)t;
+        }
+    }
+    if (next) {
+        cursor[*type] = next->next;
+    }
+    return next;
+}
+
+/**
+ * @brief Function to create a new frame
+ *
+ * @details This function is used to create a new frame, it checks if the function name is valid,
+ *      if the frame record fits above the stack limit and if the function already exists. The
+ *      record is pushed at the next aligned address below the stack pointer and takes the slot
+ *      above the top frame.
+ *
+ * @param mem
+ * @param func_name
+ * @param func_address
+ */
+void CF(memory_t *mem, char *func_name, int func_address) {
+    if (strlen(func_name) > MAX_NAME_SIZE) {
+        fprintf(mem->error, "Error: Function name too long, name can be of at most %d characters.\n", MAX_NAME_SIZE);
+        return;
+    }
+
+    int frame_address = ALIGN_DOWN(mem->stack_pointer - (int)FRAME_METADATA_OFFSET, (int)_Alignof(frame_status_t));
+    if (frame_address < mem->stack_limit) {
+        fprintf(mem->error, "Error: Stack overflow, not enough memory available for new function\n");
+        return;
+    }
+
+    // A new name only goes into the table once the frame is created
+    uint32_t name = name_find(&mem->names, func_name);
+    if (name != NO_NAME && index_find(&mem->frame_index, name_id_key(name), 0)) {
+        fprintf(mem->error, "Error: Function already exists\n");
+        return;
+    }
+
+    // Frames are pushed and popped in stack order, so the used slots are always the lowest ones
+    int i = mem->top_frame + 1;
+    if (i == mem->config.max_frames) {
+        output_printf(&mem->output, "Error: Cannot create another frame, maximum number of frames have been reached\n");
+        return;
+    }
+
+    ++mem->stats.frame_scans;
+    name                 = name == NO_NAME ? name_intern(&mem->names, func_name) : name;
+    mem->frame_status[i] = (frame_status_t){
+        .used = true, .number = i + 1, .name = name, .func_address = func_address, .frame_address = frame_address};
+    index_insert(&mem->frame_index, name_id_key(name), 0, i);
+    frame_set_free(mem, i, true);
+    frame_touch(mem, i);
+
+    mem->stack_frame[i].frame_address = frame_address;
+    mem->stack_frame[i].base          = mem->stack_pointer;
+    mem->stack_pointer                = frame_address;
+    mem->top_frame                    = i;
+}
+
+/**
+ * @brief Function to delete a frame
+ *
+ * @details This function is used to delete a frame, it checks if the stack is empty, if the frame
+ *     exists and then deletes the frame. The frame and its variables are popped off the stack at
+ *     once by restoring the stack pointer from before the frame was pushed, and the slot below
+ *     becomes the top frame.
+ *
+ * @param mem
+ */
+void DF(memory_t *mem) {
+    if (mem->stack_pointer == mem->config.mem_size) {
+        fprintf(mem->error, "Error: Stack is empty, no functions to delete\n");
+        return;
+    }
+
+    int i = mem->top_frame;
+    ++mem->stats.frame_scans;
+    frame_t *frame = &mem->stack_frame[i];
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        if (frame->var_first[t] == -1) {
+            continue;
+        }
+        var_record_t *records = mem->var_records[t];
+        for (int r = frame->var_first[t]; r != -1; r = records[r].next) {
+            index_erase(&mem->var_index, name_id_key(records[r].name), i + 1);
+            records[r].frame = -1;
+        }
+        // The list of the frame becomes the head of the free list as a whole
+        records[frame->var_last[t]].next = mem->var_pools[t].free;
+        mem->var_pools[t].free           = frame->var_first[t];
+        frame->var_first[t]              = -1;
+        frame->var_last[t]               = -1;
+    }
+    index_erase(&mem->frame_index, name_id_key(mem->frame_status[i].name), 0);
+    frame_touch(mem, i);
+
+    mem->frame_status[i] = (frame_status_t){
+        .used = false, .number = 0, .name = NO_NAME, .func_address = -1, .frame_address = -1};
+
+    mem->stack_pointer = frame->base;
+    mem->top_frame     = i - 1;
+    mem->gc.pending    = true;
+
+    memset(frame->pointers, 0, mem->config.max_pointers * sizeof(void *));
+    pointer_slots_reset(mem, i);
+    frame_set_free(mem, i, false);
+    frame->frame_address = -1;
+    frame->base          = -1;
+    frame->size          = 0;
+}
+
+/**
+ * @brief Function to create a variable on the topmost frame
+ *
+ * @param mem
+ * @param name
+ * @param type
+ * @param value
+ */
+static void create_variable(memory_t *mem, char *name, var_type_t type, var_value_t value) {
+    static const char *type_names[] = {[VAR_INT] = "integer", [VAR_DOUBLE] = "double", [VAR_CHAR] = "char"};
+
+    int curr_frame = mem->top_frame;
+    ++mem->stats.frame_scans;
+
+    if (strlen(name) > MAX_NAME_SIZE) {
+        fprintf(mem->error, "Error: Variable name too long, name can be of at most %d characters.\n", MAX_NAME_SIZE);
+        return;
+    } else if (curr_frame == -1) {
+        fprintf(mem->error, "Error: No frames exist, cannot create %s\n", type_names[type]);
+        return;
+    }
+
+    frame_t    *frame = &mem->stack_frame[curr_frame];
+    var_pool_t *pool  = &mem->var_pools[type];
+    uint32_t    id    = name_find(&mem->names, name);
+
+    // Variables are created on the topmost frame, so the stack pointer is the bottom of its frame
+    int address = ALIGN_DOWN(mem->stack_pointer - var_type_sizes[type], var_type_sizes[type]);
+    int used    = mem->stack_pointer - address;
+    if (frame->size + used > mem->config.frame_size) {
+        fprintf(mem->error, "Error: The frame is full, cannot create more data on it\n");
+        return;
+    } else if (address < mem->stack_limit) {
+        fprintf(mem->error, "Error: Stack overflow, not enough memory available for new data\n");
+        return;
+    } else if (pool->free == -1 && pool->fresh == pool->capacity) {
+        fprintf(mem->error, "Error: All %s variables are in use, cannot create another one\n", type_names[type]);
+        return;
+    } else if (id != NO_NAME && index_find(&mem->var_index, name_id_key(id), curr_frame + 1)) {
+        fprintf(mem->error, "Error: Variable already exists\n");
+        return;
+    }
+
+    id = id == NO_NAME ? name_intern(&mem->names, name) : id;
+    memcpy(stack_bytes(mem, address), &value, var_type_sizes[type]);
+    int record = pool->free;
+    if (record != -1) {
+        pool->free = mem->var_records[type][record].next;
+    } else {
+        record = pool->fresh++;
+    }
+    mem->var_records[type][record] = (var_record_t){.name = id, .address = address, .next = -1, .frame = curr_frame};
+    if (frame->var_last[type] == -1) {
+        frame->var_first[type] = record;
+    } else {
+        mem->var_records[type][frame->var_last[type]].next = record;
+    }
+    frame->var_last[type] = record;
+    index_insert(&mem->var_index, name_id_key(id), curr_frame + 1, record * NUM_VAR_TYPES + type);
+    frame_touch(mem, curr_frame);
+
+    frame->size += used;
+    mem->stack_pointer = address;
+}
+
+/**
+ * @brief Function to create an integer
+ *
+ * @param mem
+ * @param name
+ * @param value
+ */
+void CI(memory_t *mem, char *name, int value) {
+    create_variable(mem, name, VAR_INT, (var_value_t){.int_value = value});
+}
+
+/**
+ * @brief Function to create a double
+ *
+ * @param mem
+ * @param name
+ * @param value
+ */
+void CD(memory_t *mem, char *name, double value) {
+    create_variable(mem, name, VAR_DOUBLE, (var_value_t){.double_value = value});
+}
+
+/**
+ * @brief Function to create a char
+ *
+ * @param mem
+ * @param name
+ * @param value
+ */
+void CC(memory_t *mem, char *name, char value) {
+    create_variable(mem, name, VAR_CHAR, (var_value_t){.char_value = value});
+}
+
+/**
+ * @brief Function to fold the recorded events of the allocation profiler into its totals
+ *
+ * @param mem
+ */
+static void prof_fold(memory_t *mem) {
+    prof_t *prof = &mem->prof;
+    if (prof->num_live < mem->names.count) {
+        uint32_t count = mem->names.count + mem->names.count / 2;
+        prof->live     = (prof_live_t *)realloc(prof->live, count * sizeof(prof_live_t));
+        if (!prof->live) {
+            fprintf(stderr, "Error: Could not allocate memory for the allocation profiler\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = prof->num_live; i < count; ++i) {
+            prof->live[i].site = -1;
+        }
+        prof->num_live = count;
+    }
+
+    for (; prof->tail != prof->head; ++prof->tail) {
+        prof_event_t *event = &prof->events[prof->tail & prof->mask];
+        prof_live_t  *live  = &prof->live[event->name];
+        if (event->kind == PROF_FREE && live->site == -1) {
+            continue;  // created before the profiler saw it
+        } else if (event->kind == PROF_ALLOC) {
+            uint32_t       scope = (uint32_t)event->func_address;
+            index_entry_t *entry = index_find(&prof->site_index, name_id_key(event->frame), scope);
+            if (!entry) {
+                if (prof->num_sites % 64 == 0) {
+                    prof->sites = (prof_site_t *)realloc(prof->sites, (prof->num_sites + 64) * sizeof(prof_site_t));
+                    if (!prof->sites) {
+                        fprintf(stderr, "Error: Could not allocate memory for the allocation profiler\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                prof->sites[prof->num_sites] = (prof_site_t){.name = event->frame, .func_address = event->func_address};
+                index_insert(&prof->site_index, name_id_key(event->frame), scope, prof->num_sites++);
+                entry = index_find(&prof->site_index, name_id_key(event->frame), scope);
+            }
+            *live = (prof_live_t){.birth = event->command, .site = entry->value, .size = event->size};
+        }
+
+        prof_totals_t *groups[] = {&prof->totals, &prof->classes[size_class_of(live->size)],
+                                   &prof->sites[live->site].totals};
+        for (size_t k = 0; k < sizeof(groups) / sizeof(groups[0]); ++k) {
+            if (event->kind == PROF_ALLOC) {
+                ++groups[k]->allocs;
+                groups[k]->bytes += live->size;
+            } else {
+                ++groups[k]->frees;
+                groups[k]->lifetime += (long long)(event->command - live->birth);
+            }
+        }
+        if (event->kind == PROF_FREE) {
+            live->site = -1;
+        }
+    }
+}
+
+/**
+ * @brief Function to record an event of the allocation profiler
+ *
+ * @details A full ring is folded first, so no event is ever dropped.
+ *
+ * @param mem
+ * @param event
+ */
+static void prof_record(memory_t *mem, prof_event_t event) {
+    prof_t *prof = &mem->prof;
+    if (prof->head - prof->tail > prof->mask) {
+        prof_fold(mem);
+    }
+    event.command                           = prof->commands;
+    prof->events[prof->head++ & prof->mask] = event;
+}
+
+/**
+ * @brief Function to give the pages of a free range of a private heap back to the system
+ *
+ * @details The heap is mapped without reserving memory, so its pages are only backed once CH
+ *      touches them, and they are discarded again here once a whole page is free. Only the pages
+ *      within a granule of the bytes that were just freed are looked at, the rest of the range was
+ *      free and released before. The pages with the header and footer of the free block stay, and
+ *      so do all pages while a checkpoint is taken, it would not have saved them.
+ *
+ * @param mem
+ * @param start first byte of the free block the range belongs to
+ * @param end end of that free block
+ * @param freed_start first byte that was just freed
+ * @param freed_end end of the bytes that were just freed
+ */
+static void heap_release_pages(memory_t *mem, int start, int end, int freed_start, int freed_end) {
+    if (mem->checkpoints.depth) {
+        return;
+    }
+
+    size_t granule = arena_granule(mem->heap_mapped);
+    size_t low     = ALIGN_UP((size_t)start + BLOCK_HEADER_SIZE, granule);
+    size_t high    = ALIGN_DOWN((size_t)end - BLOCK_FOOTER_SIZE, granule);
+    size_t near    = ALIGN_DOWN((size_t)freed_start, granule);
+    low            = near > granule && near - granule > low ? near - granule : low;
+    near           = ALIGN_UP((size_t)freed_end, granule) + granule;
+    high           = near < high ? near : high;
+    if (low < high && madvise(mem->heap + low, high - low, MADV_DONTNEED) == 0) {
+        mem->stats.released_bytes += high - low;
+    }
+}
+
+/**
+ * @brief Function to count the heap bytes backed by memory
+ *
+ * @param mem
+ * @return size_t 0 if the kernel could not tell
+ */
+static size_t heap_resident(memory_t *mem) {
+    size_t         page     = (size_t)sysconf(_SC_PAGESIZE), pages = ALIGN_UP(mem->heap_mapped, page) / page;
+    size_t         resident = 0;
+    unsigned char *present  = (unsigned char *)malloc(pages);
+    if (present && mincore(mem->heap, pages * page, present) == 0) {
+        for (size_t k = 0; k < pages; ++k) {
+            resident += present[k] & 1;
+        }
+    }
+    free(present);
+    return resident * page;
+}
+
+/**
+ * @brief Function to forget the name of a buffer that is being deleted
+ *
+ * @param mem
+ * @param block
+ */
+static void heap_forget_buffer(memory_t *mem, block_t block) {
+    uint64_t key = name_id_key(block.name);
+    if (mem->prof.events) {
+        prof_record(mem, (prof_event_t){.name = block.name, .kind = PROF_FREE});
+    }
+    index_erase(&mem->buffer_index, key, 0);
+    index_erase(&mem->buffer_owner, key, 0);
+    buffer_touch(mem, key, block.address + BLOCK_HEADER_SIZE);
+}
+
+/**
+ * @brief Function to give a block back to the heap
+ *
+ * @details A collector sweep in progress must resume from a block header, so when the block it
+ *      would continue from is merged away it restarts from the merged free block instead.
+ *
+ * @param mem
+ * @param block
+ */
+static void heap_release_block(memory_t *mem, block_t block) {
+    if (HEAP_CHECK && mem->shadow) {
+        shadow_set(mem, block.address, block.size, SHADOW_FREE);
+    }
+    if (mem->shared) {
+        shared_release(mem, block.address, block.size);
+    } else if (mem->buddy) {
+        int merged_size = block.size, merged_start = buddy_release(mem, block.address, &merged_size);
+        if (mem->gc.active && merged_start <= mem->gc.cursor && mem->gc.cursor <= merged_start + merged_size) {
+            mem->gc.cursor = merged_start;
+        }
+        heap_release_pages(mem, merged_start, merged_start + merged_size, block.address, block.address + block.size);
+    } else {
+        int merged_start = block.address;
+        if (block.flags & BLOCK_PREV_FREE) {
+            merged_start -= (int)heap_load(mem->heap, block.address - BLOCK_FOOTER_SIZE);
+        }
+        heap_release(&mem->shard, block.address, block.size);
+        if (mem->gc.active && block.address <= mem->gc.cursor && mem->gc.cursor <= block.address + block.size) {
+            mem->gc.cursor = merged_start;
+        }
+        heap_release_pages(mem, merged_start, merged_start + heap_block(mem->heap, merged_start).size, block.address,
+                           block.address + block.size);
+    }
+    mem->heap_size -= block.size;
+}
+
+/**
+ * @brief Function to give the block of a buffer back to the heap and forget its name
+ *
+ * @details The frame pointers to the buffer are left alone, the caller clears them if there can
+ *      be any.
+ *
+ * @param mem
+ * @param block
+ */
+static void heap_free_buffer(memory_t *mem, block_t block) {
+    heap_forget_buffer(mem, block);
+    heap_release_block(mem, block);
+}
+
+/**
+ * @brief Function to give the oldest block of the quarantine of a checked heap back to the heap
+ *
+ * @details The block was filled when it entered the quarantine, any other byte in it now is a
+ *      write to a deleted buffer.
+ *
+ * @param mem
+ */
+static void quarantine_pop(memory_t *mem) {
+    quarantine_t *quarantine = mem->quarantine;
+    block_t       block      = heap_block(mem->heap, quarantine->blocks[quarantine->head]);
+    quarantine->head         = (quarantine->head + 1) % HEAP_QUARANTINE;
+    --quarantine->count;
+    quarantine->bytes -= block.size;
+    if (!check_intact(mem->heap + block.address + BLOCK_HEADER_SIZE, block.size - BLOCK_HEADER_SIZE, FREED_BYTE)) {
+        fprintf(mem->error, "Error: Buffer %s was written after it was deleted\n", name_text(&mem->names, block.name));
+    }
+    heap_release_block(mem, block);
+}
+
+/**
+ * @brief Function to give every block of the quarantine of a checked heap back to the heap
+ *
+ * @param mem
+ */
+static void quarantine_drain(memory_t *mem) {
+    while (mem->quarantine->count) {
+        quarantine_pop(mem);
+    }
+}
+
+/**
+ * @brief Function to find where the payload of a buffer of a checked heap ends
+ *
+ * @param mem
+ * @param block
+ * @return int the address of the first red zone byte of the block
+ */
+static int check_payload_end(memory_t *mem, block_t block) {
+    int end = block.address + BLOCK_HEADER_SIZE, block_end = block.address + block.size;
+    while (end < block_end && mem->shadow[end / HEAP_ALIGNMENT] == HEAP_ALIGNMENT) {
+        end += HEAP_ALIGNMENT;
+    }
+    if (end < block_end && mem->shadow[end / HEAP_ALIGNMENT] != SHADOW_REDZONE) {
+        // The last granule of the payload is only partly addressable
+        end += mem->shadow[end / HEAP_ALIGNMENT];
+    }
+    return end;
+}
+
+/**
+ * @brief Function to delete a buffer of a checked heap into the quarantine
+ *
+ * @details The red zone is checked and the whole block after its header is filled, then the block
+ *      waits in the quarantine. The oldest blocks leave it once it holds HEAP_QUARANTINE blocks or
+ *      a quarter of the heap.
+ *
+ * @param mem
+ * @param block
+ */
+static void quarantine_push(memory_t *mem, block_t block) {
+    quarantine_t *quarantine = mem->quarantine;
+    int           end        = check_payload_end(mem, block), block_end = block.address + block.size;
+    if (!check_intact(mem->heap + end, block_end - end, REDZONE_BYTE)) {
+        fprintf(mem->error, "Error: Buffer %s was written past its end\n", name_text(&mem->names, block.name));
+    }
+
+    heap_forget_buffer(mem, block);
+    memset(mem->heap + block.address + BLOCK_HEADER_SIZE, FREED_BYTE, (size_t)(block.size - BLOCK_HEADER_SIZE));
+    shadow_set(mem, block.address, block.size, SHADOW_FREED);
+    if (quarantine->count == HEAP_QUARANTINE) {
+        quarantine_pop(mem);
+    }
+    quarantine->blocks[(quarantine->head + quarantine->count++) % HEAP_QUARANTINE] = block.address;
+    quarantine->bytes += block.size;
+    while (quarantine->bytes > mem->config.heap_size / 4) {
+        quarantine_pop(mem);
+    }
+}
+
+/**
+ * @brief Function to check whether a buffer name belongs to a block in the quarantine
+ *
+ * @param mem
+ * @param buffer_name
+ * @return true if DH already deleted a buffer of that name and its block was not reused yet
+ */
+static bool quarantine_holds(memory_t *mem, const char *buffer_name) {
+    uint32_t id = name_find(&mem->names, buffer_name);
+    for (int k = 0; id != NO_NAME && k < mem->quarantine->count; ++k) {
+        int address = mem->quarantine->blocks[(mem->quarantine->head + k) % HEAP_QUARANTINE];
+        if (heap_block(mem->heap, address).name == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Function to check that every frame pointer of a checked heap points at a live buffer
+ *
+ * @details A pointer must be the payload start of a buffer, so the granules before it are the two
+ *      header granules of its block and the granule before those is not a header.
+ *
+ * @param mem
+ */
+static void check_pointers(memory_t *mem) {
+    for (int i = 0; i <= mem->top_frame; ++i) {
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            if (!mem->stack_frame[i].pointers[j]) {
+                continue;
+            }
+
+            long    address = (char *)mem->stack_frame[i].pointers[j] - mem->heap - BLOCK_HEADER_SIZE;
+            long    g       = address / HEAP_ALIGNMENT;
+            uint8_t state   = address >= 0 && address < mem->config.heap_size ? mem->shadow[g] : SHADOW_FREE;
+            if (state == SHADOW_FREED) {
+                fprintf(mem->error, "Error: Pointer %d of frame %d points to a deleted buffer\n", j,
+                        mem->frame_status[i].number);
+            } else if (state != SHADOW_HEADER || mem->shadow[g + 1] != SHADOW_HEADER ||
+                       (g > 0 && mem->shadow[g - 1] == SHADOW_HEADER)) {
+                fprintf(mem->error, "Error: Pointer %d of frame %d does not point to a buffer\n", j,
+                        mem->frame_status[i].number);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Function to get the share of free heap bytes outside the largest free block
+ *
+ * @details The largest free block is in the highest non-empty size class, so only that class is
+ *      scanned. On a buddy heap it is a whole block of the highest order with a free block.
+ *
+ * @param mem
+ * @return double the external fragmentation in percent
+ */
+static double heap_fragmentation(memory_t *mem) {
+    heap_shard_t *shard      = &mem->shard;
+    int           free_bytes = mem->config.heap_size - mem->heap_size, largest = 0;
+    if (mem->buddy) {
+        largest = mem->buddy->order_map ? 1 << (31 - __builtin_clz(mem->buddy->order_map)) : 0;
+        return free_bytes > 0 ? 100.0 * (free_bytes - largest) / free_bytes : 0.0;
+    } else if (!shard->size_class_map || free_bytes <= 0) {
+        return 0.0;
+    }
+
+    int top = 31 - __builtin_clz(shard->size_class_map);
+    for (freelist_t *curr = shard->size_class[top]; curr; curr = curr->class_next) {
+        largest = curr->size > largest ? curr->size : largest;
+    }
+    return 100.0 * (free_bytes - largest) / free_bytes;
+}
+
+/**
+ * @brief Function to slide every buffer of a private heap down to the start of the heap
+ *
+ * @details Buffers are moved in address order, so each one only moves down over free space or
+ *      over the old copy of itself. The address changes are recorded in a table sorted by old
+ *      address, then every frame pointer is rewritten with one binary search. Afterwards all free
+ *      space is a single block at the end of the heap.
+ *
+ * @param mem
+ * @param automatic whether the compaction was started by the fragmentation threshold
+ */
+static void heap_compact(memory_t *mem, bool automatic) {
+    if (HEAP_CHECK && mem->shadow) {
+        // Moved blocks would leave the addresses in the quarantine behind
+        quarantine_drain(mem);
+    }
+    if (mem->gc.active) {
+        // The mark bits are by address, so the cycle in progress is started over later
+        mem->gc.active  = false;
+        mem->gc.pending = true;
+    }
+
+    uint64_t start   = clock_ns();
+    int     *moves   = (int *)malloc((2 * (size_t)mem->buffer_index.count + 2) * sizeof(int));
+    int      address = 0, dest = 0, moved = 0, end = 0;
+    block_t  block;
+    if (!moves) {
+        fprintf(stderr, "Error: Could not allocate memory for the compaction\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (heap_next_buffer(mem, &address, &block)) {
+        if (block.address != dest) {
+            memmove(mem->heap + dest, mem->heap + block.address, block.size);
+            heap_set_block(mem->heap, dest, block.size, 0, block.name);
+            if (HEAP_CHECK && mem->shadow) {
+                memmove(mem->shadow + dest / HEAP_ALIGNMENT, mem->shadow + block.address / HEAP_ALIGNMENT,
+                        (size_t)block.size / HEAP_ALIGNMENT);
+            }
+
+            uint64_t key = name_id_key(block.name);
+            index_find(&mem->buffer_index, key, 0)->value = dest;
+            buffer_touch(mem, key, dest + BLOCK_HEADER_SIZE);
+
+            moves[2 * moved]     = block.address + BLOCK_HEADER_SIZE;
+            moves[2 * moved + 1] = dest + BLOCK_HEADER_SIZE;
+            ++moved;
+            mem->compaction.bytes += block.size;
+        }
+        dest += block.size;
+        end = block.address + block.size;
+    }
+
+    for (int i = 0; moved && i <= mem->top_frame; ++i) {
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            if (!mem->stack_frame[i].pointers[j]) {
+                continue;
+            }
+
+            int offset = (int)((char *)mem->stack_frame[i].pointers[j] - mem->heap);
+            int low = 0, high = moved;
+            while (low < high) {
+                int mid = (low + high) / 2;
+                if (moves[2 * mid] < offset) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            if (low < moved && moves[2 * low] == offset) {
+                mem->stack_frame[i].pointers[j] = mem->heap + moves[2 * low + 1];
+                frame_touch(mem, i);
+            }
+        }
+    }
+    free(moves);
+
+    freelist_clear(&mem->shard);
+    if (dest < mem->config.heap_size) {
+        freelist_insert(&mem->shard, freelist_new(&mem->shard, dest, mem->config.heap_size - dest));
+        // Past the old end of the last buffer the heap was free and released already
+        heap_release_pages(mem, dest, mem->config.heap_size, dest, end);
+    }
+    if (HEAP_CHECK && mem->shadow) {
+        shadow_set(mem, dest, mem->config.heap_size - dest, SHADOW_FREE);
+    }
+
+    ++mem->compaction.runs;
+    mem->compaction.automatic += automatic;
+    mem->compaction.buffers += moved;
+    mem->compaction.ns += clock_ns() - start;
+}
+
+/**
+ * @brief Function to set the mark bit of a heap block
+ *
+ * @param mem
+ * @param address block address
+ */
+static void gc_set_mark(memory_t *mem, int address) {
+    int bit = address / HEAP_ALIGNMENT;
+    mem->gc.marks[bit / 64] |= 1ull << (bit % 64);
+}
+
+/**
+ * @brief Function to start a garbage collection cycle by marking every block a frame points to
+ *
+ * @details Buffers hold no pointers of their own, so the frame pointers are the whole object
+ *      graph and marking is a single pass over them.
+ *
+ * @param mem
+ */
+static void gc_mark(memory_t *mem) {
+    size_t words = (size_t)mem->config.heap_size / HEAP_ALIGNMENT / 64 + 1;
+    if (!mem->gc.marks) {
+        mem->gc.marks = (uint64_t *)table_alloc(words, sizeof(uint64_t));
+    } else {
+        memset(mem->gc.marks, 0, words * sizeof(uint64_t));
+    }
+
+    for (int i = 0; i <= mem->top_frame; ++i) {
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            if (mem->stack_frame[i].pointers[j]) {
+                gc_set_mark(mem, (int)((char *)mem->stack_frame[i].pointers[j] - mem->heap) - BLOCK_HEADER_SIZE);
+            }
+        }
+    }
+
+    mem->gc.active  = true;
+    mem->gc.pending = false;
+    mem->gc.cursor  = 0;
+    ++mem->gc.cycles;
+}
+
+/**
+ * @brief Function to sweep the unmarked buffers of the current cycle back onto the free list
+ *
+ * @details The sweep resumes where the previous slice stopped. Buffers created since the cycle
+ *      started are marked when they are created, so they are never swept by it.
+ *
+ * @param mem
+ * @param budget most buffers to visit, 0 to finish the cycle
+ */
+static void gc_sweep(memory_t *mem, int budget) {
+    block_t block;
+    bool    found = false;
+    for (int visited = 0; (!budget || visited < budget) && (found = heap_next_buffer(mem, &mem->gc.cursor, &block));
+         ++visited) {
+        int bit = block.address / HEAP_ALIGNMENT;
+        if (!(mem->gc.marks[bit / 64] >> (bit % 64) & 1)) {
+            ++mem->gc.freed_buffers;
+            mem->gc.freed_bytes += block.size;
+            heap_free_buffer(mem, block);
+        }
+    }
+
+    mem->gc.active = found;
+}
+
+/**
+ * @brief Function to record the length of a collector pause
+ *
+ * @param mem
+ * @param start clock_ns when the pause began
+ */
+static void gc_pause(memory_t *mem, uint64_t start) {
+    uint64_t pause = clock_ns() - start;
+    ++mem->gc.pauses;
+    mem->gc.pause_ns += pause;
+    mem->gc.max_pause_ns = pause > mem->gc.max_pause_ns ? pause : mem->gc.max_pause_ns;
+}
+
+/**
+ * @brief Function to do one bounded slice of incremental collection after a command
+ *
+ * @details Only DF makes buffers unreachable, so a cycle is only started once a frame has been
+ *      deleted. The marking of a cycle is one pause, every sweep slice of gc_slice buffers after it
+ *      is another.
+ *
+ * @param mem
+ */
+static void gc_step(memory_t *mem) {
+    if (!mem->gc.active && !mem->gc.pending) {
+        return;
+    }
+
+    uint64_t start = clock_ns();
+    if (!mem->gc.active) {
+        gc_mark(mem);
+    } else {
+        gc_sweep(mem, mem->config.gc_slice);
+    }
+    gc_pause(mem, start);
+}
+
+/**
+ * @brief Function to create a heap buffer
+ *
+ * @details This function is used to create a heap buffer, it reserves a free block of the heap
+ *      using the selected fit policy and stores a pointer to it in the lowest free pointer slot of
+ *      the topmost frame. With spill set a full top frame hands the pointer down to the highest
+ *      frame below it that has a free slot, otherwise CH fails.
+ *
+ * @param mem
+ * @param buffer_name
+ * @param size
+ */
+void CH(memory_t *mem, char *buffer_name, int size) {
+    if (strlen(buffer_name) > MAX_NAME_SIZE) {
+        fprintf(mem->error, "Error: Buffer name too long, name can be of at most %d characters.\n", MAX_NAME_SIZE);
+        return;
+    } else if (size <= 0 || size > mem->config.heap_size) {
+        fprintf(mem->error, "Error: Invalid buffer size\n");
+        return;
+    } else if (heap_find_buffer(mem, buffer_name) != -1) {
+        fprintf(mem->error, "Error: Buffer already exists\n");
+        return;
+    }
+
+    int frame_idx = mem->top_frame;
+    ++mem->stats.frame_scans;
+
+    if (frame_idx == -1) {
+        fprintf(mem->error, "Error: No frames exist, cannot create buffer\n");
+        return;
+    } else if (!(mem->frames_free[frame_idx / 64] & 1ull << (frame_idx % 64))) {
+        if (!mem->config.spill || mem->num_frames_free == 0) {
+            fprintf(mem->error, "Error: No pointers available in frame, cannot create buffer\n");
+            return;
+        }
+        // The top frame has no free slot, so the highest frame that has one is below it
+        int w = (frame_idx - 1) / 64;
+        while (!mem->frames_free[w]) {
+            --w;
+        }
+        frame_idx = w * 64 + 63 - __builtin_clzll(mem->frames_free[w]);
+        mem->stats.frame_scans += (mem->config.max_frames + 63) / 64 - w;
+    }
+    int pointer_idx = pointer_slot_find(mem, frame_idx);
+    mem->stats.pointer_scans += pointer_idx / 64 + 1;
+
+    int redzone    = HEAP_CHECK && mem->shadow ? HEAP_REDZONE : 0;
+    int block_size = ALIGN_UP(BLOCK_HEADER_SIZE + size + redzone, HEAP_ALIGNMENT);
+    int address    = mem->shared  ? shared_alloc(mem, &block_size)
+                     : mem->buddy ? buddy_alloc(mem, &block_size)
+                                  : heap_alloc(&mem->shard, &block_size);
+    if (address == -1 && HEAP_CHECK && mem->shadow && mem->quarantine->count) {
+        // Deleted buffers are only held back while their bytes are not needed
+        quarantine_drain(mem);
+        address = mem->buddy ? buddy_alloc(mem, &block_size) : heap_alloc(&mem->shard, &block_size);
+    }
+    if (address == -1 && !mem->shared && !mem->buddy && mem->config.compact_threshold &&
+        mem->config.heap_size - mem->heap_size >= block_size) {
+        // There are enough free bytes, they are just not in one place
+        heap_compact(mem, true);
+        address = heap_alloc(&mem->shard, &block_size);
+    }
+    if (address == -1) {
+        fprintf(mem->error, "Error: The heap is full, cannot create more data\n");
+        return;
+    }
+
+    if (mem->gc.active) {
+        gc_set_mark(mem, address);
+    }
+    if (HEAP_CHECK && mem->shadow) {
+        check_poison(mem, address, block_size, size);
+    }
+
+    // The size word is left alone, on a shared heap its flags belong to the lock holder
+    uint32_t name = name_intern(&mem->names, buffer_name);
+    uint64_t key  = name_id_key(name);
+    heap_store(mem->heap, address + sizeof(uint32_t), name);
+    index_insert(&mem->buffer_index, key, 0, address);
+    buffer_touch(mem, key, address + BLOCK_HEADER_SIZE);
+
+    mem->heap_size += block_size;
+    pointer_slot_set(mem, frame_idx, pointer_idx, &mem->heap[address + BLOCK_HEADER_SIZE]);
+    if (mem->prof.events) {
+        prof_record(mem, (prof_event_t){
+                             .name         = name,
+                             .frame        = mem->frame_status[frame_idx].name,
+                             .func_address = mem->frame_status[frame_idx].func_address,
+                             .size         = size,
+                             .kind         = PROF_ALLOC,
+                         });
+    }
+
+    return;
+}
+
+/**
+ * @brief Function to delete a heap buffer
+ *
+ * @details This function is used to delete a heap buffer, it clears the pointer that refers to the
+ *      buffer and returns its block to the free list, merging it with the free blocks around it.
+ *
+ * @param mem
+ * @param buffer_name
+ */
+void DH(memory_t *mem, char *buffer_name) {
+    int address = heap_find_buffer(mem, buffer_name);
+    if (address == -1 && HEAP_CHECK && mem->shadow && quarantine_holds(mem, buffer_name)) {
+        fprintf(mem->error, "Error: Double free of buffer %s\n", buffer_name);
+        return;
+    } else if (address == -1) {
+        fprintf(mem->error, "Error: Buffer does not exist\n");
+        return;
+    }
+
+    // The owner slot is stale when its frame was deleted, the slot may belong to another buffer by now
+    void          *buffer = (void *)&mem->heap[address + BLOCK_HEADER_SIZE];
+    index_entry_t *owner  = index_find(&mem->buffer_owner, name_id_key(heap_block(mem->heap, address).name), 0);
+    int            i      = owner ? owner->value / mem->config.max_pointers : 0;
+    int            j      = owner ? owner->value % mem->config.max_pointers : 0;
+    ++mem->stats.pointer_scans;
+    if (owner && i <= mem->top_frame && mem->stack_frame[i].pointers[j] == buffer) {
+        pointer_slot_set(mem, i, j, NULL);
+    }
+
+    if (HEAP_CHECK && mem->shadow) {
+        quarantine_push(mem, heap_block(mem->heap, address));
+    } else {
+        heap_free_buffer(mem, heap_block(mem->heap, address));
+    }
+    if (!mem->shared && !mem->buddy && mem->config.compact_threshold &&
+        heap_fragmentation(mem) >= mem->config.compact_threshold) {
+        heap_compact(mem, true);
+    }
+
+    return;
+}
+
+/**
+ * @brief Function to select the fit policy used by CH
+ *
+ * @details On a shared heap the policy applies to every shard, so to every attached instance.
+ *
+ * @param mem
+ * @param policy_name one of first, best, next or seg
+ */
+void AP(memory_t *mem, char *policy_name) {
+    fit_policy_t policy;
+    if (strcmp(policy_name, "first") == 0) {
+        policy = FIT_FIRST;
+    } else if (strcmp(policy_name, "best") == 0) {
+        policy = FIT_BEST;
+    } else if (strcmp(policy_name, "next") == 0) {
+        policy = FIT_NEXT;
+    } else if (strcmp(policy_name, "seg") == 0) {
+        policy = FIT_SEG;
+    } else {
+        fprintf(mem->error, "Error: Unknown fit policy, use first, best, next or seg\n");
+        return;
+    }
+
+    if (mem->buddy) {
+        fprintf(mem->error, "Error: A buddy heap has no fit policy\n");
+        return;
+    } else if (!mem->shared) {
+        mem->shard.fit_policy = policy;
+        return;
+    }
+    for (int k = 0; k < mem->shared->num_shards; ++k) {
+        shard_lock(&mem->shared->shards[k]);
+        mem->shared->shards[k].fit_policy = policy;
+        pthread_mutex_unlock(&mem->shared->shards[k].lock);
+    }
+}
+
+/**
+ * @brief Function to check that a command which walks the whole heap can run
+ *
+ * @details The free lists of a shared heap change under the feet of every attached instance, so
+ *      the heap wide reports are only available on a private heap.
+ *
+ * @param mem
+ * @param command
+ * @return true if the heap of the instance is private
+ */
+static bool heap_private(memory_t *mem, const char *command) {
+    if (mem->shared) {
+        fprintf(mem->error, "Error: %s is not available on a shared heap\n", command);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Function to compact the heap on request
+ *
+ * @details Reports what this compaction moved and the totals of all compactions so far, the
+ *      automatic ones included.
+ *
+ * @param mem
+ */
+void COMPACT(memory_t *mem) {
+    if (!heap_private(mem, "COMPACT")) {
+        return;
+    } else if (mem->buddy) {
+        // Blocks of a buddy heap must stay aligned to their size, so they cannot slide down
+        fprintf(mem->error, "Error: COMPACT is not available on a buddy heap\n");
+        return;
+    }
+
+    output_t     *out    = &mem->output;
+    compaction_t  before = mem->compaction;
+    heap_compact(mem, false);
+
+    output_printf(out, "Compaction moved %lld buffers, %lld bytes in %.3fus, largest free block %d\n",
+                  mem->compaction.buffers - before.buffers, mem->compaction.bytes - before.bytes,
+                  (mem->compaction.ns - before.ns) / 1e3,
+                  mem->shard.freelist_head ? mem->shard.freelist_head->size : 0);
+    output_printf(out, "Compactions: %d (%d automatic), %lld buffers, %lld bytes moved in %.3fus\n\n",
+                  mem->compaction.runs, mem->compaction.automatic, mem->compaction.buffers, mem->compaction.bytes,
+                  mem->compaction.ns / 1e3);
+    output_flush(out);
+}
+
+/**
+ * @brief Function to collect the garbage of the heap on request
+ *
+ * @details Runs a whole cycle in one pause, finishing the cycle in progress if there is one, and
+ *      reports it together with the totals of all cycles and pauses so far.
+ *
+ * @param mem
+ */
+void GC(memory_t *mem) {
+    if (!heap_private(mem, "GC")) {
+        return;
+    }
+
+    output_t *out    = &mem->output;
+    gc_t      before = mem->gc;
+    uint64_t  start  = clock_ns();
+    gc_mark(mem);
+    gc_sweep(mem, 0);
+    gc_pause(mem, start);
+
+    output_printf(out, "GC freed %lld buffers, %lld bytes in %.3fus\n", mem->gc.freed_buffers - before.freed_buffers,
+                  mem->gc.freed_bytes - before.freed_bytes, (mem->gc.pause_ns - before.pause_ns) / 1e3);
+    output_printf(out, "GC: %d cycles, %lld buffers and %lld bytes freed, %d pauses, max %.3fus, mean %.3fus\n\n",
+                  mem->gc.cycles, mem->gc.freed_buffers, mem->gc.freed_bytes, mem->gc.pauses,
+                  mem->gc.max_pause_ns / 1e3, mem->gc.pause_ns / 1e3 / mem->gc.pauses);
+    output_flush(out);
+}
+
+/**
+ * @brief Function to fill bytes with one value, the portable bulk kernel
+ *
+ * @param bytes
+ * @param value
+ * @param size
+ */
+static void bulk_fill_scalar(char *bytes, uint8_t value, size_t size) {
+    memset(bytes, value, size);
+}
+
+/**
+ * @brief Function to copy bytes between two buffers, the portable bulk kernel
+ *
+ * @param dest
+ * @param src
+ * @param size
+ */
+static void bulk_copy_scalar(char *dest, const char *src, size_t size) {
+    memcpy(dest, src, size);
+}
+
+/**
+ * @brief Function to checksum bytes, the portable bulk kernel
+ *
+ * @details The checksum is the sum modulo 2^64 of the bytes read as little endian 8 byte words,
+ *      the last word padded with zero bytes. The vector kernels add the same words lane by lane
+ *      and finish their tail here.
+ *
+ * @param bytes
+ * @param size
+ * @return uint64_t
+ */
+static uint64_t bulk_sum_scalar(const char *bytes, size_t size) {
+    uint64_t sum = 0, word;
+    size_t   i   = 0;
+    for (; i < size; i += sizeof(word)) {
+        word = 0;
+        memcpy(&word, bytes + i, size - i < sizeof(word) ? size - i : sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        sum += word;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void bulk_fill_sse2(char *bytes, uint8_t value, size_t size) {
+    __m128i vector = _mm_set1_epi8((char)value);
+    size_t  i      = 0;
+    for (; i + sizeof(vector) <= size; i += sizeof(vector)) {
+        _mm_storeu_si128((__m128i *)(bytes + i), vector);
+    }
+    memset(bytes + i, value, size - i);
+}
+
+__attribute__((target("sse2"))) static void bulk_copy_sse2(char *dest, const char *src, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(__m128i) <= size; i += sizeof(__m128i)) {
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    memcpy(dest + i, src + i, size - i);
+}
+
+__attribute__((target("sse2"))) static uint64_t bulk_sum_sse2(const char *bytes, size_t size) {
+    __m128i  sum = _mm_setzero_si128();
+    uint64_t lanes[2];
+    size_t   i   = 0;
+    for (; i + sizeof(sum) <= size; i += sizeof(sum)) {
+        sum = _mm_add_epi64(sum, _mm_loadu_si128((const __m128i *)(bytes + i)));
+    }
+    _mm_storeu_si128((__m128i *)lanes, sum);
+    return lanes[0] + lanes[1] + bulk_sum_scalar(bytes + i, size - i);
+}
+
+__attribute__((target("avx2"))) static void bulk_fill_avx2(char *bytes, uint8_t value, size_t size) {
+    __m256i vector = _mm256_set1_epi8((char)value);
+    size_t  i      = 0;
+    for (; i + sizeof(vector) <= size; i += sizeof(vector)) {
+        _mm256_storeu_si256((__m256i *)(bytes + i), vector);
+    }
+    memset(bytes + i, value, size - i);
+}
+
+__attribute__((target("avx2"))) static void bulk_copy_avx2(char *dest, const char *src, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(__m256i) <= size; i += sizeof(__m256i)) {
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    memcpy(dest + i, src + i, size - i);
+}
+
+__attribute__((target("avx2"))) static uint64_t bulk_sum_avx2(const char *bytes, size_t size) {
+    __m256i  sum = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t   i   = 0;
+    for (; i + sizeof(sum) <= size; i += sizeof(sum)) {
+        sum = _mm256_add_epi64(sum, _mm256_loadu_si256((const __m256i *)(bytes + i)));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + bulk_sum_scalar(bytes + i, size - i);
+}
+#elif defined(__aarch64__)
+static void bulk_fill_neon(char *bytes, uint8_t value, size_t size) {
+    uint8x16_t vector = vdupq_n_u8(value);
+    size_t     i      = 0;
+    for (; i + sizeof(vector) <= size; i += sizeof(vector)) {
+        vst1q_u8((uint8_t *)(bytes + i), vector);
+    }
+    memset(bytes + i, value, size - i);
+}
+
+static void bulk_copy_neon(char *dest, const char *src, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint8x16_t) <= size; i += sizeof(uint8x16_t)) {
+        vst1q_u8((uint8_t *)(dest + i), vld1q_u8((const uint8_t *)(src + i)));
+    }
+    memcpy(dest + i, src + i, size - i);
+}
+
+static uint64_t bulk_sum_neon(const char *bytes, size_t size) {
+    uint64x2_t sum = vdupq_n_u64(0);
+    size_t     i   = 0;
+    for (; i + sizeof(sum) <= size; i += sizeof(sum)) {
+        sum = vaddq_u64(sum, vreinterpretq_u64_u8(vld1q_u8((const uint8_t *)(bytes + i))));
+    }
+    return vaddvq_u64(sum) + bulk_sum_scalar(bytes + i, size - i);
+}
+#endif
+
+static bulk_kernels_t bulk_kernels;
+static pthread_once_t bulk_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Function to pick the widest bulk kernels the processor runs, once for the whole process
+ *
+ */
+static void bulk_select() {
+    bulk_kernels = (bulk_kernels_t){"scalar", bulk_fill_scalar, bulk_copy_scalar, bulk_sum_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        bulk_kernels = (bulk_kernels_t){"avx2", bulk_fill_avx2, bulk_copy_avx2, bulk_sum_avx2};
+    } else if (__builtin_cpu_supports("sse2")) {
+        bulk_kernels = (bulk_kernels_t){"sse2", bulk_fill_sse2, bulk_copy_sse2, bulk_sum_sse2};
+    }
+#elif defined(__aarch64__)
+    bulk_kernels = (bulk_kernels_t){"neon", bulk_fill_neon, bulk_copy_neon, bulk_sum_neon};
+#endif
+}
+
+/**
+ * @brief Function to get the bulk kernels of the process
+ *
+ * @return const bulk_kernels_t*
+ */
+static const bulk_kernels_t *bulk_get() {
+    pthread_once(&bulk_once, bulk_select);
+    return &bulk_kernels;
+}
+
+/**
+ * @brief Function to find a buffer for the commands that work on its bytes
+ *
+ * @param mem
+ * @param buffer_name
+ * @param block set to the block of the buffer
+ * @return true if the buffer exists, otherwise the error is reported
+ */
+static bool buffer_lookup(memory_t *mem, char *buffer_name, block_t *block) {
+    int address = heap_find_buffer(mem, buffer_name);
+    if (address == -1 && HEAP_CHECK && mem->shadow && quarantine_holds(mem, buffer_name)) {
+        fprintf(mem->error, "Error: Use after free of buffer %s\n", buffer_name);
+        return false;
+    } else if (address == -1) {
+        fprintf(mem->error, "Error: Buffer does not exist\n");
+        return false;
+    }
+    *block = heap_block(mem->heap, address);
+    return true;
+}
+
+/**
+ * @brief Function to get the number of bytes of a buffer the commands on its bytes may touch
+ *
+ * @details A checked heap knows the size CH asked for from its shadow map and a buddy heap keeps
+ *      it rounded up to the heap alignment. Otherwise it is the whole block after its header, which
+ *      can be a little more when the fit search handed out a free block too small to split.
+ *
+ * @param mem
+ * @param block
+ * @return size_t
+ */
+static size_t buffer_bytes(memory_t *mem, block_t block) {
+    if (HEAP_CHECK && mem->shadow) {
+        return (size_t)(check_payload_end(mem, block) - block.address - BLOCK_HEADER_SIZE);
+    } else if (mem->buddy) {
+        return mem->buddy_needed[block.address >> BUDDY_MIN_ORDER] - BLOCK_HEADER_SIZE;
+    }
+    return (size_t)(block.size - BLOCK_HEADER_SIZE);
+}
+
+/**
+ * @brief Function to count the bytes a bulk kernel went through and the time it took
+ *
+ * @param mem
+ * @param size
+ * @param start the clock when the kernel started
+ * @return uint64_t the nanoseconds the kernel took
+ */
+static uint64_t bulk_account(memory_t *mem, size_t size, uint64_t start) {
+    uint64_t ns = clock_ns() - start;
+    mem->stats.traffic_bytes += size;
+    mem->stats.traffic_ns += ns;
+    return ns;
+}
+
+/**
+ * @brief Function to set every byte of a heap buffer to one value
+ *
+ * @param mem
+ * @param buffer_name
+ * @param value 0 to 255
+ */
+void FILL(memory_t *mem, char *buffer_name, int value) {
+    block_t block;
+    if (value < 0 || value > UINT8_MAX) {
+        fprintf(mem->error, "Error: Invalid fill byte, use 0 to 255\n");
+        return;
+    } else if (!buffer_lookup(mem, buffer_name, &block)) {
+        return;
+    }
+
+    const bulk_kernels_t *kernels = bulk_get();
+    size_t                size    = buffer_bytes(mem, block);
+    uint64_t              start   = clock_ns();
+    kernels->fill(mem->heap + block.address + BLOCK_HEADER_SIZE, (uint8_t)value, size);
+    uint64_t ns = bulk_account(mem, size, start);
+
+    output_printf(&mem->output, "Filled %zu bytes of %s with 0x%02x in %.3fus, %.2f GB/s (%s)\n\n", size,
+                  buffer_name, value, ns / 1e3, ns ? (double)size / ns : 0.0, kernels->name);
+    output_flush(&mem->output);
+}
+
+/**
+ * @brief Function to copy the bytes of one heap buffer to the start of another
+ *
+ * @param mem
+ * @param dest_name
+ * @param src_name
+ */
+void COPY(memory_t *mem, char *dest_name, char *src_name) {
+    block_t dest, src;
+    if (!buffer_lookup(mem, dest_name, &dest) || !buffer_lookup(mem, src_name, &src)) {
+        return;
+    } else if (dest.address == src.address) {
+        fprintf(mem->error, "Error: Cannot copy a buffer onto itself\n");
+        return;
+    }
+    size_t size = buffer_bytes(mem, src);
+    if (size > buffer_bytes(mem, dest)) {
+        fprintf(mem->error, "Error: Buffer %s is smaller than buffer %s\n", dest_name, src_name);
+        return;
+    }
+
+    const bulk_kernels_t *kernels = bulk_get();
+    uint64_t              start   = clock_ns();
+    kernels->copy(mem->heap + dest.address + BLOCK_HEADER_SIZE, mem->heap + src.address + BLOCK_HEADER_SIZE, size);
+    uint64_t ns = bulk_account(mem, size, start);
+
+    output_printf(&mem->output, "Copied %zu bytes from %s to %s in %.3fus, %.2f GB/s (%s)\n\n", size, src_name,
+                  dest_name, ns / 1e3, ns ? (double)size / ns : 0.0, kernels->name);
+    output_flush(&mem->output);
+}
+
+/**
+ * @brief Function to print the checksum of the bytes of a heap buffer
+ *
+ * @details See bulk_sum_scalar for the checksum, it does not depend on the kernels or the host.
+ *
+ * @param mem
+ * @param buffer_name
+ */
+void SUM(memory_t *mem, char *buffer_name) {
+    block_t block;
+    if (!buffer_lookup(mem, buffer_name, &block)) {
+        return;
+    }
+
+    const bulk_kernels_t *kernels  = bulk_get();
+    size_t                size     = buffer_bytes(mem, block);
+    uint64_t              start    = clock_ns();
+    uint64_t              checksum = kernels->sum(mem->heap + block.address + BLOCK_HEADER_SIZE, size);
+    uint64_t              ns       = bulk_account(mem, size, start);
+
+    output_printf(&mem->output, "Checksum of %s: 0x%016llx, %zu bytes in %.3fus, %.2f GB/s (%s)\n\n", buffer_name,
+                  (unsigned long long)checksum, size, ns / 1e3, ns ? (double)size / ns : 0.0, kernels->name);
+    output_flush(&mem->output);
+}
+
+/**
+ * @brief Function to order call sites of the allocation profiler by the bytes they asked for
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+static int compare_prof_site(const void *a, const void *b) {
+    long long x = ((const prof_site_t *)a)->totals.bytes, y = ((const prof_site_t *)b)->totals.bytes;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Function to print a row of totals of the allocation profiler
+ *
+ * @param out
+ * @param totals
+ */
+static void print_prof_totals(output_t *out, const prof_totals_t *totals) {
+    output_printf(out, " %-10lld | %-12lld | %-10lld | %-12.2f |\n", totals->allocs, totals->bytes,
+                  totals->allocs - totals->frees, totals->frees ? (double)totals->lifetime / totals->frees : 0.0);
+}
+
+/**
+ * @brief Function to print the allocation profile of the instance
+ *
+ * @details Lists the buffers created in every size class of the sizes CH was asked for and by the
+ *      functions that created the most bytes. The lifetime of a buffer is the number of commands
+ *      from the CH that created it to the DH or collection that freed it, buffers still alive are
+ *      left out of the average.
+ *
+ * @param mem
+ */
+void PROF(memory_t *mem) {
+    output_t *out  = &mem->output;
+    prof_t   *prof = &mem->prof;
+    if (!prof->events) {
+        fprintf(mem->error, "Error: The allocation profiler is off, enable it with -P\n");
+        return;
+    }
+    prof_fold(mem);
+
+    output_printf(out, "                           ALLOCATION PROFILE\n");
+    output_printf(out, "|-------|-----------------------|------------|--------------|------------|--------------|\n");
+    output_printf(out, "| Class |      Size Range       |   Allocs   |    Bytes     |    Live    | Avg Lifetime |\n");
+    output_printf(out, "|-------|-----------------------|------------|--------------|------------|--------------|\n");
+    for (int k = 0; k < NUM_SIZE_CLASSES; ++k) {
+        if (prof->classes[k].allocs) {
+            output_printf(out, "| %-5d | %10u-%-10u |", k, 1u << k, (2u << k) - 1);
+            print_prof_totals(out, &prof->classes[k]);
+        }
+    }
+    output_printf(out, "|-------|-----------------------|------------|--------------|------------|--------------|\n");
+
+    prof_site_t *sites = (prof_site_t *)table_alloc(prof->num_sites, sizeof(prof_site_t));
+    memcpy(sites, prof->sites, prof->num_sites * sizeof(prof_site_t));
+    qsort(sites, prof->num_sites, sizeof(prof_site_t), compare_prof_site);
+    output_printf(out, "|---------------|------------------|------------|--------------|------------|--------------|\n");
+    output_printf(out, "| Function      | Function Address |   Allocs   |    Bytes     |    Live    | Avg Lifetime |\n");
+    output_printf(out, "|---------------|------------------|------------|--------------|------------|--------------|\n");
+    for (int i = 0; i < prof->num_sites && i < PROF_TOP_SITES; ++i) {
+        output_printf(out, "| %-13s | 0x%-14X |", name_text(&mem->names, sites[i].name), sites[i].func_address);
+        print_prof_totals(out, &sites[i].totals);
+    }
+    output_printf(out, "|---------------|------------------|------------|--------------|------------|--------------|\n");
+    free(sites);
+
+    output_printf(out, "Allocs: %lld, Bytes: %lld, Live: %lld, Average Lifetime: %.2f commands, Functions: %d\n\n",
+                  prof->totals.allocs, prof->totals.bytes, prof->totals.allocs - prof->totals.frees,
+                  prof->totals.frees ? (double)prof->totals.lifetime / prof->totals.frees : 0.0, prof->num_sites);
+    output_flush(out);
+}
+
+// Command words of the STATS keys, by stat_command_t
+static const char *stat_command_words[] = {
+    [STAT_CF] = "CF", [STAT_DF] = "DF", [STAT_CI] = "CI", [STAT_CD] = "CD", [STAT_CC] = "CC",
+    [STAT_CH] = "CH", [STAT_DH] = "DH", [STAT_SM] = "SM", [STAT_SB] = "SB", [STAT_SC] = "SC",
+    [STAT_AP] = "AP", [STAT_GC] = "GC", [STAT_COMPACT] = "COMPACT", [STAT_PROF] = "PROF", [STAT_STATS] = "STATS",
+    [STAT_SAVE] = "SAVE", [STAT_LOAD] = "LOAD", [STAT_CKPT] = "CKPT", [STAT_UNDO] = "UNDO",
+    [STAT_HM] = "HM", [STAT_FILL] = "FILL", [STAT_COPY] = "COPY", [STAT_SUM] = "SUM",
+};
+
+/**
+ * @brief Function to get the counters of an instance
+ *
+ * @details The fit searches of a private heap count in its shard, they are folded in here. The
+ *      shards of a shared heap are counted for every instance together, so they are left out.
+ *
+ * @param mem
+ * @return stats_t
+ */
+static stats_t stats_read(memory_t *mem) {
+    stats_t stats    = mem->stats;
+    stats.fit_probes = mem->shared ? 0 : mem->shard.fit_probes;
+    return stats;
+}
+
+/**
+ * @brief Function to add the counters of one instance to a total
+ *
+ * @details The start of the total is kept, so its cycle rate spans all of the instances.
+ *
+ * @param total
+ * @param stats
+ */
+static void stats_add(stats_t *total, const stats_t *stats) {
+    for (int c = 0; c < NUM_STAT_COMMANDS; ++c) {
+        latency_t       *sum     = &total->latency[c];
+        const latency_t *latency = &stats->latency[c];
+        total->commands[c] += stats->commands[c];
+        sum->count += latency->count;
+        sum->cycles += latency->cycles;
+        sum->max = latency->max > sum->max ? latency->max : sum->max;
+        for (int k = 0; k < STATS_BUCKETS; ++k) {
+            sum->buckets[k] += latency->buckets[k];
+        }
+    }
+    total->invalid += stats->invalid;
+    total->frame_scans += stats->frame_scans;
+    total->pointer_scans += stats->pointer_scans;
+    total->fit_probes += stats->fit_probes;
+    total->traffic_bytes += stats->traffic_bytes;
+    total->traffic_ns += stats->traffic_ns;
+    total->released_bytes += stats->released_bytes;
+}
+
+/**
+ * @brief Function to get a percentile of a latency histogram
+ *
+ * @param latency
+ * @param percent
+ * @return uint64_t the upper end of the bucket the percentile falls in, at most the maximum, in cycles
+ */
+static uint64_t latency_percentile(const latency_t *latency, double percent) {
+    uint64_t rank = (uint64_t)ceil(latency->count * percent / 100), seen = 0;
+    for (int k = 0; k < STATS_BUCKETS - 1; ++k) {
+        seen += latency->buckets[k];
+        if (seen >= rank) {
+            return (2ull << k) - 1 < latency->max ? (2ull << k) - 1 : latency->max;
+        }
+    }
+    return latency->max;
+}
+
+/**
+ * @brief Function to print counters as key value lines
+ *
+ * @details Every line is a dotted key and a number, so the output can be read back with a line
+ *      split. The latency keys are only printed for commands that were timed, in cycles of the
+ *      cycle counter, and cycles_per_ns converts them to time.
+ *
+ * @param out
+ * @param stats
+ */
+static void stats_print(output_t *out, const stats_t *stats) {
+    uint64_t total = 0;
+    for (int c = 0; c < NUM_STAT_COMMANDS; ++c) {
+        total += stats->commands[c];
+    }
+    output_printf(out, "commands %llu\n", (unsigned long long)total);
+    for (int c = 0; c < NUM_STAT_COMMANDS; ++c) {
+        output_printf(out, "commands.%s %llu\n", stat_command_words[c], (unsigned long long)stats->commands[c]);
+    }
+    output_printf(out, "invalid %llu\n", (unsigned long long)stats->invalid);
+    output_printf(out, "frame_scans %llu\n", (unsigned long long)stats->frame_scans);
+    output_printf(out, "pointer_scans %llu\n", (unsigned long long)stats->pointer_scans);
+    output_printf(out, "fit_probes %llu\n", (unsigned long long)stats->fit_probes);
+    output_printf(out, "traffic_bytes %llu\n", (unsigned long long)stats->traffic_bytes);
+    output_printf(out, "traffic_ns %llu\n", (unsigned long long)stats->traffic_ns);
+    output_printf(out, "released_bytes %llu\n", (unsigned long long)stats->released_bytes);
+
+    uint64_t ns = clock_ns() - stats->start_ns;
+    output_printf(out, "cycles_per_ns %.3f\n", ns ? (double)(clock_cycles() - stats->start_cycles) / ns : 0.0);
+
+    // Peak resident memory of the whole process, so the same for every instance of a -R run
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    output_printf(out, "max_rss_kb %ld\n", usage.ru_maxrss);
+    for (int c = 0; c < NUM_STAT_COMMANDS; ++c) {
+        const latency_t *latency = &stats->latency[c];
+        const char      *word    = stat_command_words[c];
+        if (!latency->count) {
+            continue;
+        }
+        output_printf(out, "latency.%s.count %llu\n", word, (unsigned long long)latency->count);
+        output_printf(out, "latency.%s.mean %.1f\n", word, (double)latency->cycles / latency->count);
+        output_printf(out, "latency.%s.p50 %llu\n", word, (unsigned long long)latency_percentile(latency, 50));
+        output_printf(out, "latency.%s.p99 %llu\n", word, (unsigned long long)latency_percentile(latency, 99));
+        output_printf(out, "latency.%s.max %llu\n", word, (unsigned long long)latency->max);
+        for (int k = 0; k < STATS_BUCKETS; ++k) {
+            if (latency->buckets[k]) {
+                output_printf(out, "latency.%s.bucket.%d %llu\n", word, k, (unsigned long long)latency->buckets[k]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Function to write counters to a file as key value lines
+ *
+ * @param path file to write, - for stderr
+ * @param stats
+ * @return true if the file was written
+ */
+static bool stats_dump(const char *path, const stats_t *stats) {
+    output_t out = {.fd = strcmp(path, "-") == 0 ? STDERR_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+    if (out.fd == -1) {
+        fprintf(stderr, "Error: Could not create %s\n", path);
+        return false;
+    }
+
+    stats_print(&out, stats);
+    output_flush(&out);
+    free(out.data);
+    if (out.fd != STDERR_FILENO) {
+        close(out.fd);
+    }
+    return true;
+}
+
+/**
+ * @brief Function to print the hot path counters of the instance
+ *
+ * @details Prints the same key value lines that -t writes at exit, followed by an empty line.
+ *
+ * @param mem
+ */
+void STATS(memory_t *mem) {
+    stats_t stats = stats_read(mem);
+    stats_print(&mem->output, &stats);
+    output_printf(&mem->output, "\n");
+    output_flush(&mem->output);
+}
+
+/**
+ * @brief Function to print the occupancy of every non-empty size class
+ *
+ * @details Also reports the external fragmentation of the heap, which is the share of free bytes
+ *      that are outside the largest free block.
+ *
+ * @param mem
+ */
+void SC(memory_t *mem) {
+    output_t *out        = &mem->output;
+    int       free_bytes = 0, largest = 0;
+    if (!heap_private(mem, "SC")) {
+        return;
+    }
+
+    output_printf(out, "                     SIZE CLASSES\n");
+    output_printf(out, "|-------|-----------------------|-------------|------------|-------------|\n");
+    output_printf(out, "| Class |      Size Range       | Free Blocks | Free Bytes | Used Blocks |\n");
+    output_printf(out, "|-------|-----------------------|-------------|------------|-------------|\n");
+    for (int k = 0; k < NUM_SIZE_CLASSES; ++k) {
+        int blocks = 0, bytes = 0;
+        for (freelist_t *curr = mem->shard.size_class[k]; curr; curr = curr->class_next) {
+            ++blocks;
+            bytes += curr->size;
+            largest = curr->size > largest ? curr->size : largest;
+        }
+        if (mem->buddy && mem->buddy->counts[k]) {
+            // The blocks of an order are the whole of its size class
+            blocks  = (int)mem->buddy->counts[k];
+            bytes   = blocks << k;
+            largest = 1 << k;
+        }
+        free_bytes += bytes;
+
+        if (blocks || mem->shard.size_class_used[k]) {
+            output_printf(out, "| %-5d | %10u-%-10u | %-11d | %-10d | %-11d |\n", k, 1u << k, (2u << k) - 1, blocks,
+                          bytes, mem->shard.size_class_used[k]);
+        }
+    }
+    output_printf(out, "|-------|-----------------------|-------------|------------|-------------|\n");
+    output_printf(out, "Free Bytes: %d, Largest Free Block: %d, External Fragmentation: %.2f%%\n\n", free_bytes, largest,
+                  free_bytes ? 100.0 * (free_bytes - largest) / free_bytes : 0.0);
+    output_flush(out);
+}
+
+/**
+ * @brief Function to take a free range off the used bytes of the cells of a heap map
+ *
+ * @param used used bytes of every cell
+ * @param cell bytes per cell
+ * @param start
+ * @param size
+ */
+static void heap_map_free(int *used, int cell, int start, int size) {
+    for (int address = start, end = start + size; address < end;) {
+        int next = (address / cell + 1) * cell;
+        next     = next < end ? next : end;
+        used[address / cell] -= next - address;
+        address = next;
+    }
+}
+
+/**
+ * @brief Function to print an occupancy map of the heap
+ *
+ * @details Every character of the map stands for cell bytes of the heap, '#' for a used cell, '.'
+ *      for a free one and '+' or '-' for a cell that is at least or less than half used. The map
+ *      starts out fully used and the free blocks the allocator keeps are taken off it, so the cost
+ *      grows with the free blocks and the cells but not with the buffers. The headers of the
+ *      buffers are the metadata in the heap, the free list nodes or the buddy bitmaps the metadata
+ *      outside it.
+ *
+ * @param mem
+ * @param cell bytes per character, 0 to fit the heap in HEAP_MAP_CELLS characters
+ */
+void HM(memory_t *mem, int cell) {
+    output_t *out      = &mem->output;
+    int       capacity = mem->config.heap_size;
+    if (!heap_private(mem, "HM")) {
+        return;
+    }
+
+    cell      = cell ? cell : ALIGN_UP((capacity + HEAP_MAP_CELLS - 1) / HEAP_MAP_CELLS, HEAP_ALIGNMENT);
+    int cells = (int)(((long)capacity + cell - 1) / cell);
+    int *used = (int *)table_alloc((size_t)cells, sizeof(int));
+    for (int c = 0; c < cells; ++c) {
+        used[c] = c == cells - 1 ? capacity - c * cell : cell;
+    }
+
+    int    free_blocks = 0, free_bytes = 0, largest = 0;
+    size_t outside     = 0;
+    if (mem->buddy) {
+        for (int k = BUDDY_MIN_ORDER; k <= mem->buddy_order; ++k) {
+            for (int w = 0; mem->buddy->counts[k] && w < ((capacity >> k) + 63) / 64; ++w) {
+                for (uint64_t bits = mem->buddy_free[k][w]; bits; bits &= bits - 1) {
+                    heap_map_free(used, cell, (w * 64 + __builtin_ctzll(bits)) << k, 1 << k);
+                    largest = 1 << k;
+                }
+            }
+            free_blocks += (int)mem->buddy->counts[k];
+            free_bytes += (int)mem->buddy->counts[k] << k;
+        }
+        outside = buddy_state_size(&mem->config);
+    } else {
+        for (freelist_t *curr = mem->shard.freelist_head; curr; curr = curr->next) {
+            heap_map_free(used, cell, curr->start, curr->size);
+            largest = curr->size > largest ? curr->size : largest;
+            ++free_blocks;
+            free_bytes += curr->size;
+        }
+        outside = (size_t)free_blocks * sizeof(freelist_t) + mem->shard.slot_capacity * sizeof(freelist_t *);
+    }
+
+    output_printf(out, "HEAP MAP (%d bytes per cell)\n", cell);
+    for (int row = 0; row < cells; row += HEAP_MAP_WIDTH) {
+        char line[HEAP_MAP_WIDTH + 1] = {0};
+        for (int c = row; c < cells && c < row + HEAP_MAP_WIDTH; ++c) {
+            int room      = c == cells - 1 ? capacity - c * cell : cell;
+            line[c - row] = used[c] == 0 ? '.' : used[c] == room ? '#' : 2 * used[c] >= room ? '+' : '-';
+        }
+        output_printf(out, "0x%-10ld |%-*s|\n", (long)row * cell, HEAP_MAP_WIDTH, line);
+    }
+    output_printf(out, "'#' used, '+' at least half used, '-' less than half used, '.' free\n");
+
+    int headers = (int)mem->buffer_index.count * BLOCK_HEADER_SIZE;
+    output_printf(out, "Heap Size: %d, Used: %d, Free Blocks: %d, Free Bytes: %d, Largest Free Block: %d\n", capacity,
+                  mem->heap_size, free_blocks, free_bytes, largest);
+    output_printf(out, "Fragmentation Index: %.2f%%, Metadata: %d header bytes in the heap (%.2f%% of used), %zu bytes "
+                  "outside it\n", free_bytes ? 100.0 * (free_bytes - largest) / free_bytes : 0.0, headers,
+                  mem->heap_size ? 100.0 * headers / mem->heap_size : 0.0, outside);
+    output_printf(out, "Resident: %zu of %zu mapped heap bytes, %llu bytes released so far\n\n", heap_resident(mem),
+                  mem->heap_mapped, (unsigned long long)mem->stats.released_bytes);
+    output_flush(out);
+    free(used);
+}
+
+/**
+ * @brief Function to print the row of a frame in the stack table
+ *
+ * @param mem
+ * @param out
+ * @param i frame slot
+ */
+static void print_frame_row(memory_t *mem, output_t *out, int i) {
+    output_printf(out, "| %-5d | %-13s | 0x%-14X | %-13d | %-10d |\n", mem->frame_status[i].number,
+                  name_text(&mem->names, mem->frame_status[i].name), mem->frame_status[i].func_address,
+                  mem->frame_status[i].frame_address, mem->stack_frame[i].size);
+}
+
+/**
+ * @brief Function to print the variables and pointers of a frame
+ *
+ * @param mem
+ * @param out
+ * @param i frame slot
+ */
+static void print_frame_contents(memory_t *mem, output_t *out, int i) {
+    output_printf(out, "\n\nFrame %d Contents:\n", mem->frame_status[i].number);
+    output_printf(out, "|---------------|----------|-----------------|\n");
+    output_printf(out, "| Variable Name |   Type   |      Value      |\n");
+    output_printf(out, "|---------------|----------|-----------------|\n");
+    frame_t   *frame = &mem->stack_frame[i];
+    int        cursor[NUM_VAR_TYPES];
+    var_type_t type;
+    memcpy(cursor, frame->var_first, sizeof(cursor));
+    for (var_record_t *var; (var = frame_next_var(mem, cursor, &type));) {
+        const char *name  = name_text(&mem->names, var->name);
+        var_value_t value = stack_value(mem, var, type);
+        if (type == VAR_INT) {
+            output_printf(out, "| %-13s | int      | %-15d |\n", name, value.int_value);
+        } else if (type == VAR_DOUBLE) {
+            output_printf(out, "| %-13s | double   | %-15lf |\n", name, value.double_value);
+        } else {
+            output_printf(out, "| %-13s | char     | %-15c |\n", name, value.char_value);
+        }
+    }
+    for (int j = 0; j < mem->config.max_pointers; ++j) {
+        if (frame->pointers[j] != NULL) {
+            output_printf(out, "| %-13s | pointer  | %-15p |\n", "pointer", frame->pointers[j]);
+        }
+    }
+    output_printf(out, "|---------------|----------|-----------------|\n");
+}
+
+/**
+ * @brief Function to forget which frames and buffers changed
+ *
+ * @param mem
+ */
+static void clear_dirty(memory_t *mem) {
+    for (int k = 0; k < mem->num_dirty_frames; ++k) {
+        mem->stack_frame[mem->dirty_frames[k]].dirty = false;
+    }
+    mem->num_dirty_frames = 0;
+
+    free(mem->dirty_buffers.entries);
+    mem->dirty_buffers = (name_index_t){0};
+}
+
+/**
+ * @brief Function to print the frames and buffers that changed since the last SM
+ *
+ * @details Changed frames are printed in full, deleted ones are listed without contents. Every
+ *      buffer created or deleted in between is listed with its current state.
+ *
+ * @param mem
+ * @param out
+ */
+static void print_delta(memory_t *mem, output_t *out) {
+    output_printf(out, "                     STACK (changes since last SM)\n");
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+    output_printf(out, "| Frame | Function Name | Function Address | Frame Address | Frame Size |\n");
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+    for (int k = 0; k < mem->num_dirty_frames; ++k) {
+        int i = mem->dirty_frames[k];
+        if (mem->frame_status[i].used) {
+            print_frame_row(mem, out, i);
+        } else {
+            output_printf(out, "| %-5d | %-13s | %-16s | %-13s | %-10s |\n", i + 1, "(deleted)", "-", "-", "-");
+        }
+    }
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+
+    for (int k = 0; k < mem->num_dirty_frames; ++k) {
+        if (mem->frame_status[mem->dirty_frames[k]].used) {
+            print_frame_contents(mem, out, mem->dirty_frames[k]);
+        }
+    }
+
+    output_printf(out, "\nHEAP (changes since last SM)\n");
+    output_printf(out, "Heap Size: %d\n", mem->heap_size);
+    output_printf(out, "|---------------|-----------------|--------|-----------|\n");
+    output_printf(out, "|  Buffer Name  |  Start Address  |  Size  |  Status   |\n");
+    output_printf(out, "|---------------|-----------------|--------|-----------|\n");
+    for (uint32_t k = 0; mem->dirty_buffers.entries && k <= mem->dirty_buffers.mask; ++k) {
+        index_entry_t *entry = &mem->dirty_buffers.entries[k];
+        if (entry->key == 0) {
+            continue;
+        }
+
+        const char    *name = name_text(&mem->names, (uint32_t)(entry->key - 1));
+        index_entry_t *live = index_find(&mem->buffer_index, entry->key, 0);
+        if (live) {
+            output_printf(out, "| %-13s | 0x%-13d | %-6d | allocated |\n", name, live->value + BLOCK_HEADER_SIZE,
+                          heap_block(mem->heap, live->value).size - BLOCK_HEADER_SIZE);
+        } else {
+            output_printf(out, "| %-13s | 0x%-13d | %-6s | freed     |\n", name, entry->value, "-");
+        }
+    }
+    output_printf(out, "|---------------|-----------------|--------|-----------|\n\n");
+}
+
+/**
+ * @brief Function to append raw bytes to an output buffer
+ *
+ * @param out
+ * @param data
+ * @param size
+ */
+static void output_write(output_t *out, const void *data, size_t size) {
+    output_reserve(out);
+    if (out->size + size > OUTPUT_BUFFER_SIZE) {
+        output_flush(out);
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+/**
+ * @brief Function to append a name as a JSON string
+ *
+ * @param out
+ * @param name
+ * @param length
+ */
+static void output_json_name(output_t *out, const char *name, size_t length) {
+    output_write(out, "\"", 1);
+    for (size_t i = 0; i < length && name[i]; ++i) {
+        if (name[i] == '"' || name[i] == '\\') {
+            output_printf(out, "\\%c", name[i]);
+        } else if ((unsigned char)name[i] < 0x20) {
+            output_printf(out, "\\u%04x", (unsigned char)name[i]);
+        } else {
+            output_write(out, &name[i], 1);
+        }
+    }
+    output_write(out, "\"", 1);
+}
+
+/**
+ * @brief Function to open the destination of an export
+ *
+ * @details The shared output buffer is flushed and pointed at the file, or left on stdout when no
+ *      path is given.
+ *
+ * @param mem
+ * @param path output file, NULL or empty for stdout
+ * @return output_t* the output buffer or NULL if the file could not be created
+ */
+static output_t *export_open(memory_t *mem, const char *path) {
+    output_t *out = &mem->output;
+    output_flush(out);
+    if (path && *path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(mem->error, "Error: Could not create %s\n", path);
+            return NULL;
+        }
+        out->fd = fd;
+    }
+
+    return out;
+}
+
+/**
+ * @brief Function to finish an export and point the output buffer back at stdout
+ *
+ * @param out
+ */
+static void export_close(output_t *out) {
+    output_flush(out);
+    if (out->fd != STDOUT_FILENO) {
+        close(out->fd);
+        out->fd = STDOUT_FILENO;
+    }
+}
+
+/**
+ * @brief Function to export the stack and heap as JSON
+ *
+ * @details Frames are listed from the top of the stack down with their live variables and the heap
+ *      offsets their pointers refer to. The heap is listed block by block in address order. The
+ *      JSON is formatted straight into the output buffer, which is written out as it fills, so
+ *      the export needs no memory proportional to the size of the state.
+ *
+ * @param mem
+ * @param path output file, NULL or empty for stdout
+ */
+static void export_json(memory_t *mem, const char *path) {
+    output_t *out = export_open(mem, path);
+    if (!out) {
+        return;
+    }
+
+    static const char *type_names[] = {[VAR_INT] = "int", [VAR_DOUBLE] = "double", [VAR_CHAR] = "char"};
+    bool               first_frame  = true;
+
+    output_printf(out, "{\"frames\":[");
+    for (int i = mem->config.max_frames - 1; i >= 0; --i) {
+        frame_status_t *status = &mem->frame_status[i];
+        frame_t        *frame  = &mem->stack_frame[i];
+        if (!status->used) {
+            continue;
+        }
+
+        output_printf(out, "%s{\"number\":%d,\"name\":", first_frame ? "" : ",", status->number);
+        output_json_name(out, name_text(&mem->names, status->name), MAX_NAME_SIZE);
+        output_printf(out, ",\"func_address\":%d,\"frame_address\":%d,\"size\":%d,\"variables\":[",
+                      status->func_address, status->frame_address, frame->size);
+        first_frame = false;
+
+        bool       first = true;
+        int        cursor[NUM_VAR_TYPES];
+        var_type_t type;
+        memcpy(cursor, frame->var_first, sizeof(cursor));
+        for (var_record_t *var; (var = frame_next_var(mem, cursor, &type));) {
+            var_value_t value = stack_value(mem, var, type);
+            output_printf(out, "%s{\"name\":", first ? "" : ",");
+            output_json_name(out, name_text(&mem->names, var->name), MAX_NAME_SIZE);
+            output_printf(out, ",\"type\":\"%s\",\"address\":%d,\"value\":", type_names[type], var->address);
+            if (type == VAR_INT) {
+                output_printf(out, "%d}", value.int_value);
+            } else if (type == VAR_DOUBLE && isfinite(value.double_value)) {
+                output_printf(out, "%.17g}", value.double_value);
+            } else if (type == VAR_DOUBLE) {
+                output_printf(out, "null}");
+            } else {
+                output_json_name(out, &value.char_value, 1);
+                output_write(out, "}", 1);
+            }
+            first = false;
+        }
+
+        output_printf(out, "],\"pointers\":[");
+        first = true;
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            if (frame->pointers[j]) {
+                output_printf(out, "%s%td", first ? "" : ",", (char *)frame->pointers[j] - mem->heap);
+                first = false;
+            }
+        }
+        output_printf(out, "]}");
+    }
+
+    output_printf(out, "],\"heap\":{\"capacity\":%d,\"used\":%d,\"blocks\":[", mem->config.heap_size,
+                  mem->heap_size);
+    for (int address = 0; address < mem->config.heap_size;) {
+        block_t block = heap_block(mem->heap, address);
+        output_printf(out, "%s{\"address\":%d,\"size\":%d,", address ? "," : "", address, block.size);
+        address += block.size;
+        if (heap_quarantined(mem, block.address)) {
+            output_printf(out, "\"state\":\"quarantined\"}");
+        } else if (!(block.flags & BLOCK_FREE)) {
+            const char *name = name_text(&mem->names, block.name);
+            output_printf(out, "\"state\":\"allocated\",\"name\":");
+            output_json_name(out, name, MAX_NAME_SIZE);
+            output_printf(out, ",\"start_address\":%d,\"buffer_size\":%d", block.address + BLOCK_HEADER_SIZE,
+                          block.size - BLOCK_HEADER_SIZE);
+            if (mem->buddy) {
+                output_printf(out, ",\"needed\":%u", mem->buddy_needed[block.address >> BUDDY_MIN_ORDER]);
+            }
+            output_write(out, "}", 1);
+        } else {
+            output_printf(out, "\"state\":\"free\"}");
+        }
+    }
+    output_printf(out, "]}}\n");
+
+    export_close(out);
+}
+
+/**
+ * @brief Function to write a binary snapshot of the stack and heap
+ *
+ * @details The snapshot is a header followed by a stream of fixed size records: one per frame,
+ *      followed by one per live variable and pointer of that frame, then one per heap block in
+ *      address order and a final end record. Names are ids into the name table that follows: the
+ *      number of names, the size of their text, the offset of every name and the NUL terminated
+ *      names themselves. Pointers are stored as heap offsets so snapshots do not depend on where
+ *      the heap was mapped.
+ *
+ * @param mem
+ * @param path
+ */
+static void export_snapshot(memory_t *mem, const char *path) {
+    output_t *out = export_open(mem, path);
+    if (!out) {
+        return;
+    }
+
+    snapshot_header_t header = {
+        .magic      = SNAPSHOT_MAGIC,
+        .byte_order = TRACE_BYTE_ORDER,
+        .version    = SNAPSHOT_VERSION,
+        .heap_size  = mem->config.heap_size,
+        .heap_used  = mem->heap_size,
+    };
+    output_write(out, &header, sizeof(header));
+
+    for (int i = mem->config.max_frames - 1; i >= 0; --i) {
+        frame_status_t *status = &mem->frame_status[i];
+        frame_t        *frame  = &mem->stack_frame[i];
+        if (!status->used) {
+            continue;
+        }
+
+        snapshot_record_t record = {.kind = SNAPSHOT_FRAME, .frame = status->number, .name = status->name};
+        record.a                 = status->func_address;
+        record.b = (int64_t)status->frame_address << 32 | (uint32_t)frame->size;
+        output_write(out, &record, sizeof(record));
+
+        int        cursor[NUM_VAR_TYPES];
+        var_type_t type;
+        memcpy(cursor, frame->var_first, sizeof(cursor));
+        for (var_record_t *var; (var = frame_next_var(mem, cursor, &type));) {
+            record = (snapshot_record_t){
+                .kind  = SNAPSHOT_VARIABLE,
+                .type  = (uint8_t)type,
+                .frame = status->number,
+                .name  = var->name,
+                .b     = var->address,
+            };
+            var_value_t value = stack_value(mem, var, type);
+            memcpy(&record.a, &value, sizeof(value));
+            output_write(out, &record, sizeof(record));
+        }
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            if (frame->pointers[j]) {
+                record = (snapshot_record_t){
+                    .kind  = SNAPSHOT_POINTER,
+                    .frame = status->number,
+                    .name  = NO_NAME,
+                    .a     = (char *)frame->pointers[j] - mem->heap,
+                };
+                output_write(out, &record, sizeof(record));
+            }
+        }
+    }
+
+    for (int address = 0; address < mem->config.heap_size;) {
+        block_t           block  = heap_block(mem->heap, address);
+        bool              free   = block.flags & BLOCK_FREE || heap_quarantined(mem, address);
+        snapshot_record_t record = {
+            .kind = free ? SNAPSHOT_FREE : SNAPSHOT_BUFFER,
+            .name = free ? NO_NAME : block.name,
+            .a    = address,
+            .b    = block.size,
+        };
+        output_write(out, &record, sizeof(record));
+        address += block.size;
+    }
+
+    snapshot_record_t end = {.kind = SNAPSHOT_END, .name = NO_NAME};
+    output_write(out, &end, sizeof(end));
+
+    output_write(out, &mem->names.count, sizeof(mem->names.count));
+    output_write(out, &mem->names.size, sizeof(mem->names.size));
+    output_write(out, mem->names.offsets, mem->names.count * sizeof(uint32_t));
+    output_write(out, mem->names.text, mem->names.size);
+    export_close(out);
+}
+
+/**
+ * @brief Function to write a binary snapshot of the stack and heap
+ *
+ * @param mem
+ * @param path
+ */
+void SB(memory_t *mem, char *path) {
+    if (heap_private(mem, "SB")) {
+        export_snapshot(mem, path);
+    }
+}
+
+/**
+ * @brief Function to write bytes at an offset of a file
+ *
+ * @param fd
+ * @param data
+ * @param size
+ * @param offset advanced past the bytes written
+ * @return true if every byte was written
+ */
+static bool image_put(int fd, const void *data, size_t size, uint64_t *offset) {
+    for (size_t done = 0; done < size;) {
+        ssize_t bytes = pwrite(fd, (const char *)data + done, size - done, (off_t)(*offset + done));
+        if (bytes <= 0) {
+            return false;
+        }
+        done += (size_t)bytes;
+    }
+    *offset += size;
+    return true;
+}
+
+/**
+ * @brief Function to write a region of the memory to an image
+ *
+ * @details Pages that are all zero are skipped and left as holes of the file, most of a large heap
+ *      or stack usually was never touched.
+ *
+ * @param fd
+ * @param data
+ * @param size
+ * @param offset where the region starts, advanced past it
+ * @return true if the region was written
+ */
+static bool image_put_region(int fd, const char *data, size_t size, uint64_t *offset) {
+    static const char zeros[4096];
+    for (size_t done = 0; done < size; done += sizeof(zeros)) {
+        size_t   chunk = size - done < sizeof(zeros) ? size - done : sizeof(zeros);
+        uint64_t at    = *offset + done;
+        if (memcmp(data + done, zeros, chunk) != 0 && !image_put(fd, data + done, chunk, &at)) {
+            return false;
+        }
+    }
+    *offset += size;
+    return true;
+}
+
+/**
+ * @brief Function to write the entries of a name index to an image
+ *
+ * @param fd
+ * @param index
+ * @param header slots and count of the index are stored in it
+ * @param k which index of the image it is
+ * @param offset advanced past the entries
+ * @return true if the entries were written
+ */
+static bool image_put_index(int fd, const name_index_t *index, image_header_t *header, int k, uint64_t *offset) {
+    header->index_slots[k]  = index->entries ? index->mask + 1 : 0;
+    header->index_counts[k] = index->count;
+    return image_put(fd, index->entries, header->index_slots[k] * sizeof(index_entry_t), offset);
+}
+
+/**
+ * @brief Function to read bytes from the state section of an image
+ *
+ * @param cursor advanced past the bytes read
+ * @param end end of the state section
+ * @param data
+ * @param size
+ * @return true if the section holds that many more bytes
+ */
+static bool image_take(const char **cursor, const char *end, void *data, size_t size) {
+    if ((size_t)(end - *cursor) < size) {
+        return false;
+    }
+    memcpy(data, *cursor, size);
+    *cursor += size;
+    return true;
+}
+
+/**
+ * @brief Function to read the entries of a name index from an image
+ *
+ * @param cursor
+ * @param end
+ * @param index an empty index, filled in
+ * @param header
+ * @param k which index of the image it is
+ * @return true if the index is well formed
+ */
+static bool image_take_index(const char **cursor, const char *end, name_index_t *index, const image_header_t *header,
+                             int k) {
+    uint32_t slots = header->index_slots[k];
+    if (slots == 0) {
+        return header->index_counts[k] == 0;
+    } else if ((slots & (slots - 1)) != 0 || 2 * header->index_counts[k] > slots ||
+               slots > (size_t)(end - *cursor) / sizeof(index_entry_t)) {
+        return false;
+    }
+
+    index->entries = (index_entry_t *)table_alloc(slots, sizeof(index_entry_t));
+    index->mask    = slots - 1;
+    index->count   = header->index_counts[k];
+    return image_take(cursor, end, index->entries, slots * sizeof(index_entry_t));
+}
+
+/**
+ * @brief Function to map a region of an image copy on write in place of a region of the memory
+ *
+ * @param fd
+ * @param header
+ * @param k which region of the image it is
+ * @param arena the region to replace, set to the mapping
+ * @param mapped bytes mapped for the region, set to the size of the mapping
+ * @return true if the region was mapped
+ */
+static bool image_map(int fd, const image_header_t *header, int k, char **arena, size_t *mapped) {
+    void *region = mmap(NULL, header->region_sizes[k], PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                        (off_t)header->region_offsets[k]);
+    if (region == MAP_FAILED) {
+        return false;
+    }
+    munmap(*arena, *mapped);
+    *arena  = (char *)region;
+    *mapped = header->region_sizes[k];
+    return true;
+}
+
+/**
+ * @brief Function to write the state of the instance to a memory image
+ *
+ * @details The image is written next to path and renamed over it once complete. An instance
+ *      loaded from the old image keeps its mapping of the old file, truncating that file in place
+ *      would fault on every page of it that was not copied yet.
+ *
+ * @param mem
+ * @param path
+ * @return true if the image was written
+ */
+static bool image_save(memory_t *mem, const char *path) {
+    char temp[PATH_BUFFER_SIZE];
+    int  length = snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int  fd     = length < (int)sizeof(temp) ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd == -1) {
+        fprintf(mem->error, "Error: Could not create %s\n", path);
+        return false;
+    }
+
+    image_header_t header = {
+        .magic           = IMAGE_MAGIC,
+        .byte_order      = TRACE_BYTE_ORDER,
+        .version         = IMAGE_VERSION,
+        .config          = mem->config,
+        .stack_pointer   = mem->stack_pointer,
+        .heap_size       = mem->heap_size,
+        .fit_policy      = mem->shard.fit_policy,
+        .num_frames_free = mem->num_frames_free,
+        .name_count      = mem->names.count,
+        .name_size       = mem->names.size,
+        .rover           = mem->shard.freelist_rover ? mem->shard.freelist_rover->start : -1,
+        .gc_active       = mem->gc.active,
+        .gc_pending      = mem->gc.pending,
+        .gc_cursor       = mem->gc.cursor,
+        .state_offset    = sizeof(image_header_t),
+    };
+    int       frames   = mem->config.max_frames;
+    size_t    pointers = (size_t)frames * mem->config.max_pointers;
+    int64_t  *offsets  = (int64_t *)table_alloc(pointers, sizeof(int64_t));
+    uint64_t  offset   = header.state_offset;
+    bool      ok       = image_put(fd, mem->frame_status, frames * sizeof(frame_status_t), &offset);
+    for (int i = 0; i < frames; ++i) {
+        frame_t      *frame  = &mem->stack_frame[i];
+        image_frame_t record = {.frame_address = frame->frame_address, .base = frame->base, .size = frame->size};
+        memcpy(record.var_first, frame->var_first, sizeof(record.var_first));
+        memcpy(record.var_last, frame->var_last, sizeof(record.var_last));
+        ok = ok && image_put(fd, &record, sizeof(record), &offset);
+        for (int j = 0; j < mem->config.max_pointers; ++j) {
+            offsets[(size_t)i * mem->config.max_pointers + j] =
+                frame->pointers[j] ? (char *)frame->pointers[j] - mem->heap : -1;
+        }
+    }
+    ok = ok && image_put(fd, offsets, pointers * sizeof(int64_t), &offset);
+    ok = ok && image_put(fd, mem->stack_frame[0].pointer_free, frames * mem->pointer_words * sizeof(uint64_t), &offset);
+    ok = ok && image_put(fd, mem->frames_free, (frames + 63) / 64 * sizeof(uint64_t), &offset);
+    ok = ok && image_put(fd, mem->names.offsets, mem->names.count * sizeof(uint32_t), &offset);
+    ok = ok && image_put(fd, mem->names.text, mem->names.size, &offset);
+    ok = ok && image_put_index(fd, &mem->names.index, &header, 0, &offset);
+    ok = ok && image_put_index(fd, &mem->frame_index, &header, 1, &offset);
+    ok = ok && image_put_index(fd, &mem->var_index, &header, 2, &offset);
+    ok = ok && image_put_index(fd, &mem->buffer_index, &header, 3, &offset);
+    ok = ok && image_put(fd, mem->shard.size_class_used, sizeof(mem->shard.size_class_used), &offset);
+    for (freelist_t *curr = mem->shard.freelist_head; ok && curr; curr = curr->next) {
+        int block[2] = {curr->start, curr->size};
+        ok           = image_put(fd, block, sizeof(block), &offset);
+        ++header.free_blocks;
+    }
+    size_t marks      = (size_t)mem->config.heap_size / HEAP_ALIGNMENT / 64 + 1;
+    ok                = ok && (!mem->gc.active || image_put(fd, mem->gc.marks, marks * sizeof(uint64_t), &offset));
+    header.state_size = offset - header.state_offset;
+    free(offsets);
+
+    char  *regions[IMAGE_REGIONS] = {mem->stack, mem->tables, mem->heap};
+    size_t sizes[IMAGE_REGIONS]   = {mem->stack_mapped, mem->tables_mapped, mem->heap_mapped};
+    for (int k = 0; ok && k < IMAGE_REGIONS; ++k) {
+        offset                   = ALIGN_UP(offset, IMAGE_ALIGNMENT);
+        header.region_offsets[k] = offset;
+        header.region_sizes[k]   = sizes[k];
+        ok                       = image_put_region(fd, regions[k], sizes[k], &offset);
+    }
+
+    uint64_t start = 0;
+    ok             = ok && ftruncate(fd, (off_t)offset) == 0 && image_put(fd, &header, sizeof(header), &start);
+    ok             = close(fd) == 0 && ok;
+    ok             = ok && rename(temp, path) == 0;
+    if (!ok) {
+        unlink(temp);
+        fprintf(mem->error, "Error: Could not write %s\n", path);
+    }
+    return ok;
+}
+
+/**
+ * @brief Function to check that the used entries of a restored index match its count and values
+ *
+ * @details An index with more used entries than its count could have no empty slot left, which
+ *      would make every probe for a missing key run forever.
+ *
+ * @param index
+ * @param limit values must be below this
+ * @return true if the index is sound
+ */
+static bool image_index_valid(const name_index_t *index, long limit) {
+    uint32_t used = 0;
+    for (uint32_t k = 0; index->entries && k <= index->mask; ++k) {
+        const index_entry_t *entry = &index->entries[k];
+        if (entry->key != 0) {
+            ++used;
+            if (entry->value < 0 || entry->value >= limit) {
+                return false;
+            }
+        }
+    }
+    return used == index->count;
+}
+
+/**
+ * @brief Function to check the restored state of an instance before anything is built on it
+ *
+ * @details Every name id, record link, stack address and index value read from the image is
+ *      bounded here, the variable chains are walked at most once around their pool so a cycle is
+ *      caught, and the heap blocks must tile the heap with every buffer found in the buffer index
+ *      and every free block in the free list or buddy bitmaps.
+ *
+ * @param mem
+ * @param header
+ * @return true if the state is consistent
+ */
+static bool image_valid(memory_t *mem, const image_header_t *header) {
+    const config_t     *config = &mem->config;
+    const name_table_t *names  = &mem->names;
+    int                 frames = config->max_frames;
+    bool ok = header->stack_pointer >= mem->stack_limit && header->stack_pointer <= config->mem_size &&
+              header->heap_size >= 0 && header->heap_size <= config->heap_size && header->num_frames_free >= 0 &&
+              header->num_frames_free <= frames && (names->count == 0 || names->size > 0) &&
+              (names->size == 0 || names->text[names->size - 1] == '\0');
+    for (uint32_t k = 0; ok && k < names->count; ++k) {
+        ok = names->offsets[k] < names->size;
+    }
+    // A used flag is read as a bool only once it is known to hold one
+    for (int i = 0; ok && i < frames; ++i) {
+        unsigned char used;
+        memcpy(&used, &mem->frame_status[i].used, sizeof(used));
+        ok = used <= 1;
+    }
+
+    for (int t = 0; ok && t < NUM_VAR_TYPES; ++t) {
+        const var_pool_t   *pool    = &mem->var_pools[t];
+        const var_record_t *records = mem->var_records[t];
+        ok = pool->capacity == var_pool_capacity(config, (var_type_t)t) && pool->fresh >= 0 &&
+             pool->fresh <= pool->capacity && pool->free >= -1 && pool->free < pool->fresh;
+        int steps = 0;
+        for (int r = pool->free; ok && r != -1; r = records[r].next) {
+            ok = ++steps <= pool->fresh && records[r].frame == -1 && records[r].next >= -1 &&
+                 records[r].next < pool->fresh;
+        }
+    }
+    for (int i = 0; ok && i < frames; ++i) {
+        const frame_t *frame = &mem->stack_frame[i];
+        if (!mem->frame_status[i].used) {
+            continue;
+        }
+        ok = mem->frame_status[i].name < names->count && frame->base >= mem->stack_limit &&
+             frame->base <= config->mem_size;
+        for (int t = 0; ok && t < NUM_VAR_TYPES; ++t) {
+            const var_pool_t   *pool    = &mem->var_pools[t];
+            const var_record_t *records = mem->var_records[t];
+            int                 last = -1, steps = 0;
+            ok = frame->var_first[t] < pool->fresh && frame->var_last[t] < pool->fresh;
+            for (int r = frame->var_first[t]; ok && r != -1; r = records[r].next) {
+                ok   = ++steps <= pool->fresh && records[r].frame == i && records[r].name < names->count &&
+                       records[r].address >= mem->stack_limit &&
+                       records[r].address <= config->mem_size - var_type_sizes[t] && records[r].next >= -1 &&
+                       records[r].next < pool->fresh;
+                last = r;
+            }
+            ok = ok && last == frame->var_last[t];
+        }
+    }
+
+    long var_values = 0;
+    for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+        long values = (long)var_pool_capacity(config, (var_type_t)t) * NUM_VAR_TYPES;
+        var_values  = values > var_values ? values : var_values;
+    }
+    ok = ok && image_index_valid(&names->index, names->count) && image_index_valid(&mem->frame_index, frames) &&
+         image_index_valid(&mem->var_index, var_values) &&
+         image_index_valid(&mem->buffer_index, config->heap_size);
+    for (uint32_t k = 0; ok && mem->frame_index.entries && k <= mem->frame_index.mask; ++k) {
+        const index_entry_t *entry = &mem->frame_index.entries[k];
+        ok = entry->key == 0 || mem->frame_status[entry->value].used;
+    }
+    for (uint32_t k = 0; ok && mem->var_index.entries && k <= mem->var_index.mask; ++k) {
+        const index_entry_t *entry = &mem->var_index.entries[k];
+        int                  t     = entry->value % NUM_VAR_TYPES;
+        ok = entry->key == 0 || (entry->value / NUM_VAR_TYPES < mem->var_pools[t].fresh && entry->scope >= 1 &&
+                                 entry->scope <= (uint32_t)frames);
+    }
+
+    // A free block of the free list is found from its header, one of a buddy heap from its bitmap
+    const heap_shard_t *shard   = &mem->shard;
+    uint32_t            buffers = 0, free_blocks = 0, orders[NUM_SIZE_CLASSES] = {0};
+    int                 held = 0, held_bytes = 0;
+    bool                prev_free = false;
+    ok = ok && (!HEAP_CHECK || (mem->quarantine->head >= 0 && mem->quarantine->head < HEAP_QUARANTINE &&
+                                mem->quarantine->count >= 0 && mem->quarantine->count <= HEAP_QUARANTINE));
+    for (int address = 0; ok && address < config->heap_size;) {
+        block_t block = heap_block(mem->heap, address);
+        int     k     = block.size > 0 ? size_class_of(block.size) : 0;
+        ok            = block.size >= (int)MIN_BLOCK_SIZE && block.size % HEAP_ALIGNMENT == 0 &&
+                        block.size <= config->heap_size - address;
+        if (ok && mem->buddy) {
+            ok = block.size == 1 << k && k >= BUDDY_MIN_ORDER && address % block.size == 0;
+        } else if (ok) {
+            ok = !(block.flags & BLOCK_PREV_FREE) == !prev_free;
+        }
+
+        if (ok && block.flags & BLOCK_FREE && mem->buddy) {
+            ok = mem->buddy_free[k][(address >> k) / 64] >> ((address >> k) % 64) & 1;
+            ++orders[k];
+        } else if (ok && block.flags & BLOCK_FREE) {
+            ok = block.name < shard->num_slots && shard->nodes[block.name] &&
+                 shard->nodes[block.name]->start == address && shard->nodes[block.name]->size == block.size;
+            ++free_blocks;
+        } else if (ok && heap_quarantined(mem, address)) {
+            // Every block held back by a checked heap must be in its ring exactly once
+            const quarantine_t *quarantine = mem->quarantine;
+            int                 found      = 0;
+            for (int j = 0; j < quarantine->count; ++j) {
+                found += quarantine->blocks[(quarantine->head + j) % HEAP_QUARANTINE] == address;
+            }
+            ok = block.name < names->count && found == 1;
+            ++held;
+            held_bytes += block.size;
+        } else if (ok) {
+            index_entry_t *entry  = index_find(&mem->buffer_index, name_id_key(block.name), 0);
+            uint32_t       needed = mem->buddy ? mem->buddy_needed[address >> BUDDY_MIN_ORDER] : BLOCK_HEADER_SIZE;
+            ok = block.name < names->count && entry && entry->value == address && needed >= BLOCK_HEADER_SIZE &&
+                 needed <= (uint32_t)block.size &&
+                 (!HEAP_CHECK || check_payload_end(mem, block) <= address + block.size);
+            ++buffers;
+        }
+        prev_free = block.flags & BLOCK_FREE;
+        address += ok ? block.size : 0;
+    }
+    ok = ok && buffers == mem->buffer_index.count && (mem->buddy || free_blocks == header->free_blocks) &&
+         (!HEAP_CHECK || (held == mem->quarantine->count && held_bytes == mem->quarantine->bytes));
+
+    // The counts, order map and hints of a buddy heap must agree with its bitmaps, a hint past the
+    // first free block would let the search run off the end of the bitmap
+    for (int k = 0; ok && mem->buddy && k < NUM_SIZE_CLASSES; ++k) {
+        const buddy_t *buddy = mem->buddy;
+        bool           order = k >= BUDDY_MIN_ORDER && k <= mem->buddy_order;
+        uint32_t       words = order ? (uint32_t)((((size_t)config->heap_size >> k) + 63) / 64) : 0, bits = 0;
+        uint32_t       first = words;
+        for (uint32_t w = 0; w < words; ++w) {
+            bits += (uint32_t)__builtin_popcountll(mem->buddy_free[k][w]);
+            first = first == words && mem->buddy_free[k][w] ? w : first;
+        }
+        ok = buddy->counts[k] == orders[k] && bits == orders[k] && !(buddy->order_map >> k & 1) == !orders[k] &&
+             (!orders[k] || buddy->hints[k] <= first);
+    }
+    return ok;
+}
+
+/**
+ * @brief Function to restore the state of an instance from a memory image
+ *
+ * @details The image is restored into a new instance that replaces the current one only once the
+ *      whole image has been read, so a bad image leaves the instance as it was. The geometry and a
+ *      collector cycle in progress come from the image, the collector, compaction, profiler and
+ *      tracing settings stay those of the instance, and so do its output and counters. Every frame and buffer is marked changed for
+ *      the next SM --delta.
+ *
+ * @param mem
+ * @param path
+ * @return true if the image was restored
+ */
+static bool image_load(memory_t *mem, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(mem->error, "Error: Could not open %s\n", path);
+        return false;
+    }
+
+    struct stat    info;
+    image_header_t header;
+    bool ok = fstat(fd, &info) == 0 && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+              memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) == 0 && header.byte_order == TRACE_BYTE_ORDER &&
+              header.version == IMAGE_VERSION && header.state_offset + header.state_size <= (uint64_t)info.st_size;
+    for (int k = 0; ok && k < IMAGE_REGIONS; ++k) {
+        ok = header.region_offsets[k] % IMAGE_ALIGNMENT == 0 && header.region_sizes[k] > 0 &&
+             header.region_offsets[k] + header.region_sizes[k] <= (uint64_t)info.st_size;
+    }
+    // The regions must cover the geometry before init sizes anything from it
+    ok = ok && header.config.max_frames > 0 && header.config.max_pointers > 0 && header.config.stack_size >= 0 &&
+         header.config.heap_size >= (int)MIN_BLOCK_SIZE && header.region_sizes[0] >= (uint64_t)header.config.stack_size &&
+         (long)header.config.stack_size + header.config.heap_size <= header.config.mem_size &&
+         (!header.config.buddy || ((header.config.heap_size & (header.config.heap_size - 1)) == 0 &&
+                                   header.config.heap_size >= 1 << BUDDY_MIN_ORDER)) &&
+         header.region_sizes[2] >= heap_mapping_size(&header.config) &&
+         (uint64_t)header.config.max_frames * header.config.max_pointers <= header.state_size / sizeof(int64_t);
+    char *state = ok ? (char *)mmap(NULL, header.state_offset + header.state_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : (char *)MAP_FAILED;
+    if (state == MAP_FAILED) {
+        fprintf(mem->error, "Error: %s is not a memory image\n", path);
+        close(fd);
+        return false;
+    }
+
+    config_t config          = header.config;
+    config.compact_threshold = mem->config.compact_threshold;
+    config.gc_slice          = mem->config.gc_slice;
+    config.profile           = mem->config.profile;
+    config.latency           = mem->config.latency;
+    config.spill             = mem->config.spill;
+
+    memory_t loaded;
+    init(&loaded, &config, NULL);
+    int frames = config.max_frames;
+    ok         = header.region_sizes[1] >= tables_size(&config) &&
+                 image_map(fd, &header, 0, &loaded.stack, &loaded.stack_mapped) &&
+                 image_map(fd, &header, 1, &loaded.tables, &loaded.tables_mapped) &&
+                 image_map(fd, &header, 2, &loaded.heap, &loaded.heap_mapped);
+    if (ok) {
+        tables_bind(&loaded);
+    }
+    if (ok && loaded.buddy) {
+        buddy_bind(&loaded);
+    }
+    if (ok && HEAP_CHECK) {
+        check_bind(&loaded);
+    }
+
+    const char *cursor   = state + header.state_offset, *end = cursor + header.state_size;
+    size_t      pointers = (size_t)frames * config.max_pointers;
+    int64_t    *offsets  = (int64_t *)table_alloc(pointers, sizeof(int64_t));
+    ok                   = ok && image_take(&cursor, end, loaded.frame_status, frames * sizeof(frame_status_t));
+    for (int i = 0; ok && i < frames; ++i) {
+        frame_t      *frame = &loaded.stack_frame[i];
+        image_frame_t record = {0};
+        ok                   = image_take(&cursor, end, &record, sizeof(record));
+        frame->frame_address = record.frame_address;
+        frame->base          = record.base;
+        frame->size          = record.size;
+        for (int t = 0; ok && t < NUM_VAR_TYPES; ++t) {
+            int capacity = var_pool_capacity(&config, (var_type_t)t);
+            ok           = record.var_first[t] >= -1 && record.var_first[t] < capacity &&
+                           record.var_last[t] >= -1 && record.var_last[t] < capacity &&
+                           (record.var_first[t] == -1) == (record.var_last[t] == -1);
+        }
+        memcpy(frame->var_first, record.var_first, sizeof(frame->var_first));
+        memcpy(frame->var_last, record.var_last, sizeof(frame->var_last));
+    }
+    ok = ok && image_take(&cursor, end, offsets, pointers * sizeof(int64_t));
+    for (size_t j = 0; ok && j < pointers; ++j) {
+        ok = offsets[j] >= -1 && offsets[j] < config.heap_size;
+        loaded.stack_frame[0].pointers[j] = ok && offsets[j] != -1 ? loaded.heap + offsets[j] : NULL;
+    }
+    free(offsets);
+    ok = ok && image_take(&cursor, end, loaded.stack_frame[0].pointer_free,
+                          frames * loaded.pointer_words * sizeof(uint64_t));
+    ok = ok && image_take(&cursor, end, loaded.frames_free, (frames + 63) / 64 * sizeof(uint64_t));
+
+    // The name table is sized from the header, so it must fit in the state before it is allocated
+    name_table_t *names = &loaded.names;
+    ok                  = ok && header.name_count <= header.state_size / sizeof(uint32_t) &&
+                          header.name_size <= header.state_size;
+    names->count        = ok ? header.name_count : 0;
+    names->size         = ok ? header.name_size : 0;
+    names->capacity     = names->size;
+    names->offsets      = (uint32_t *)table_alloc(ALIGN_UP(names->count, 1024), sizeof(uint32_t));
+    names->text         = (char *)table_alloc(names->size, 1);
+    ok                  = ok && image_take(&cursor, end, names->offsets, names->count * sizeof(uint32_t));
+    ok                  = ok && image_take(&cursor, end, names->text, names->size);
+    ok                  = ok && image_take_index(&cursor, end, &names->index, &header, 0);
+    ok                  = ok && image_take_index(&cursor, end, &loaded.frame_index, &header, 1);
+    ok                  = ok && image_take_index(&cursor, end, &loaded.var_index, &header, 2);
+    ok                  = ok && image_take_index(&cursor, end, &loaded.buffer_index, &header, 3);
+
+    // The whole heap free block of init gives way to the free blocks of the image, which get new
+    // node slots in their headers
+    heap_shard_t *shard = &loaded.shard;
+    shard->heap         = loaded.heap;
+    ok                  = ok && image_take(&cursor, end, shard->size_class_used, sizeof(shard->size_class_used));
+    freelist_clear(shard);
+    for (uint32_t k = 0; ok && k < header.free_blocks; ++k) {
+        int block[2];
+        ok = image_take(&cursor, end, block, sizeof(block)) && block[0] >= 0 && block[1] >= (int)MIN_BLOCK_SIZE &&
+             block[1] <= config.heap_size - block[0];
+        if (ok) {
+            freelist_t *node = freelist_new(shard, block[0], block[1]);
+            freelist_insert(shard, node);
+            shard->freelist_rover = block[0] == header.rover ? node : shard->freelist_rover;
+        }
+    }
+    if (ok && header.gc_active) {
+        size_t marks     = (size_t)config.heap_size / HEAP_ALIGNMENT / 64 + 1;
+        loaded.gc.marks  = (uint64_t *)table_alloc(marks, sizeof(uint64_t));
+        loaded.gc.active = true;
+        loaded.gc.cursor = header.gc_cursor;
+        ok               = image_take(&cursor, end, loaded.gc.marks, marks * sizeof(uint64_t)) &&
+                           header.gc_cursor >= 0 && header.gc_cursor <= config.heap_size;
+    }
+    ok = ok && image_valid(&loaded, &header);
+    munmap(state, header.state_offset + header.state_size);
+    close(fd);
+
+    if (!ok) {
+        fprintf(mem->error, "Error: %s is not a memory image\n", path);
+        destroy(&loaded);
+        return false;
+    }
+
+    shard->fit_policy      = (fit_policy_t)header.fit_policy;
+    shard->fit_probes      = mem->shard.fit_probes;
+    loaded.stack_pointer   = header.stack_pointer;
+    loaded.heap_size       = header.heap_size;
+    loaded.num_frames_free = header.num_frames_free;
+    for (int i = 0; i < frames && loaded.frame_status[i].used; ++i) {
+        loaded.top_frame = i;
+    }
+    loaded.gc.pending      = header.gc_pending;
+    loaded.output          = mem->output;
+    loaded.error           = mem->error;
+    loaded.stats           = mem->stats;
+    mem->output.data       = NULL;
+    buffer_owners_rebuild(&loaded);
+    destroy(mem);
+    *mem = loaded;
+
+    for (int i = 0; i < frames; ++i) {
+        if (mem->frame_status[i].used) {
+            frame_touch(mem, i);
+        }
+    }
+    for (uint32_t k = 0; mem->buffer_index.entries && k <= mem->buffer_index.mask; ++k) {
+        index_entry_t *entry = &mem->buffer_index.entries[k];
+        if (entry->key != 0) {
+            buffer_touch(mem, entry->key, entry->value + BLOCK_HEADER_SIZE);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Function to save the state of the instance to a memory image
+ *
+ * @details The image can be restored with LOAD, or with -I by every instance of a run.
+ *
+ * @param mem
+ * @param path
+ */
+void SAVE(memory_t *mem, char *path) {
+    if (heap_private(mem, "SAVE")) {
+        image_save(mem, path);
+    }
+}
+
+/**
+ * @brief Function to restore the state of the instance from a memory image written by SAVE
+ *
+ * @details The stack, the variable tables and the heap are mapped copy on write from the image, so
+ *      restoring takes about as long as reading the names and indexes, and instances restored from
+ *      the same image share its pages until they write to them.
+ *
+ * @param mem
+ * @param path
+ */
+void LOAD(memory_t *mem, char *path) {
+    if (heap_private(mem, "LOAD")) {
+        image_load(mem, path);
+    }
+}
+
+/**
+ * @brief Function to take a checkpoint that UNDO can roll the instance back to
+ *
+ * @details The frame records, the stack, the variable tables and the heap are made read only and
+ *      their pages are copied by the fault handler when they are first written, so a checkpoint
+ *      costs a few system calls and then one page copy per page dirtied before the next CKPT or
+ *      UNDO. Checkpoints nest up to MAX_CHECKPOINTS deep, LOAD drops them all.
+ *
+ * @param mem
+ */
+void CKPT(memory_t *mem) {
+    if (!heap_private(mem, "CKPT")) {
+        return;
+    }
+
+    checkpoints_t *ckpt = &mem->checkpoints;
+    if (ckpt->depth == MAX_CHECKPOINTS) {
+        fprintf(mem->error, "Error: Too many checkpoints, at most %d can be taken\n", MAX_CHECKPOINTS);
+        return;
+    }
+
+    if (ckpt->depth == 0) {
+        char  *bases[CHECKPOINT_REGIONS] = {mem->frame_arena, mem->stack, mem->tables, mem->heap};
+        size_t sizes[CHECKPOINT_REGIONS] = {mem->frame_arena_mapped, mem->stack_mapped, mem->tables_mapped,
+                                            mem->heap_mapped};
+        size_t offset   = 0;
+        ckpt->num_pages = 0;
+        for (int r = 0; r < CHECKPOINT_REGIONS; ++r) {
+            size_t granule   = arena_granule(sizes[r]);
+            ckpt->regions[r] = (checkpoint_region_t){
+                .base       = bases[r],
+                .size       = ALIGN_UP(sizes[r], granule),
+                .granule    = granule,
+                .offset     = offset,
+                .first_page = ckpt->num_pages,
+            };
+            offset += ckpt->regions[r].size;
+            ckpt->num_pages += ckpt->regions[r].size / granule;
+        }
+    }
+
+    checkpoint_region_t *last   = &ckpt->regions[CHECKPOINT_REGIONS - 1];
+    size_t               total  = last->offset + last->size;
+    void                *images = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                       -1, 0);
+    if (images == MAP_FAILED) {
+        fprintf(mem->error, "Error: Could not reserve %zu bytes for a checkpoint\n", total);
+        return;
+    }
+
+    checkpoint_t *level = &ckpt->levels[ckpt->depth];
+    *level              = (checkpoint_t){
+        .images          = (char *)images,
+        .images_mapped   = total,
+        .saved           = (uint64_t *)table_alloc((ckpt->num_pages + 63) / 64, sizeof(uint64_t)),
+        .stack_pointer   = mem->stack_pointer,
+        .heap_size       = mem->heap_size,
+        .num_frames_free = mem->num_frames_free,
+        .rover           = mem->shard.freelist_rover ? mem->shard.freelist_rover->start : -1,
+        .fit_policy      = mem->shard.fit_policy,
+        .gc_active       = mem->gc.active,
+        .gc_pending      = mem->gc.pending,
+        .gc_cursor       = mem->gc.cursor,
+    };
+    memcpy(level->size_class_used, mem->shard.size_class_used, sizeof(level->size_class_used));
+    if (mem->gc.active) {
+        size_t marks    = (size_t)mem->config.heap_size / HEAP_ALIGNMENT / 64 + 1;
+        level->gc_marks = (uint64_t *)table_alloc(marks, sizeof(uint64_t));
+        memcpy(level->gc_marks, mem->gc.marks, marks * sizeof(uint64_t));
+    }
+
+    if (ckpt->depth++ == 0) {
+        pthread_once(&checkpoint_once, checkpoint_install);
+        ckpt->next   = checkpointed;
+        checkpointed = mem;
+    }
+    checkpoint_arm(mem);
+}
+
+/**
+ * @brief Function to rebuild the free list and the buffer index from the blocks of the heap
+ *
+ * @param mem
+ * @param rover start of the free block next fit resumes from, -1 for none
+ */
+static void heap_rebuild(memory_t *mem, int rover) {
+    heap_shard_t *shard = &mem->shard;
+    freelist_clear(shard);
+    free(mem->buffer_index.entries);
+    mem->buffer_index = (name_index_t){0};
+
+    for (int address = 0; address < mem->config.heap_size;) {
+        block_t block = heap_block(mem->heap, address);
+        if (block.flags & BLOCK_FREE && !mem->buddy) {
+            freelist_t *node = freelist_new(shard, address, block.size);
+            freelist_insert(shard, node);
+            shard->freelist_rover = address == rover ? node : shard->freelist_rover;
+        } else if (!(block.flags & BLOCK_FREE) && !heap_quarantined(mem, address)) {
+            index_insert(&mem->buffer_index, name_id_key(block.name), 0, address);
+        }
+        address += block.size;
+    }
+}
+
+/**
+ * @brief Function to rebuild the frame and variable indexes from the frame records and tables
+ *
+ * @param mem
+ */
+static void frames_rebuild(memory_t *mem) {
+    free(mem->frame_index.entries);
+    free(mem->var_index.entries);
+    mem->frame_index = (name_index_t){0};
+    mem->var_index   = (name_index_t){0};
+    mem->top_frame   = -1;
+
+    for (int i = 0; i < mem->config.max_frames; ++i) {
+        if (!mem->frame_status[i].used) {
+            continue;
+        }
+        mem->top_frame = i;
+
+        frame_t *frame = &mem->stack_frame[i];
+        index_insert(&mem->frame_index, name_id_key(mem->frame_status[i].name), 0, i);
+        for (int t = 0; t < NUM_VAR_TYPES; ++t) {
+            var_record_t *records = mem->var_records[t];
+            for (int r = frame->var_first[t]; r != -1; r = records[r].next) {
+                index_insert(&mem->var_index, name_id_key(records[r].name), i + 1, r * NUM_VAR_TYPES + t);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Function to roll the instance back to its last checkpoint
+ *
+ * @details The saved pages are copied back over the tracked regions, the free list and the
+ *      indexes are rebuilt from them. The names interned since stay in the name table, and the
+ *      collector, compaction, profiler and STATS totals keep counting the commands undone. Every
+ *      frame used before or after the undo and every buffer that came or went is marked changed
+ *      for the next SM --delta.
+ *
+ * @param mem
+ */
+void UNDO(memory_t *mem) {
+    checkpoints_t *ckpt = &mem->checkpoints;
+    if (ckpt->depth == 0) {
+        fprintf(mem->error, "Error: No checkpoint to undo\n");
+        return;
+    }
+
+    int   frames = mem->config.max_frames;
+    bool *touch  = (bool *)table_alloc(frames, sizeof(bool));
+    for (int k = 0; k < mem->num_dirty_frames; ++k) {
+        touch[mem->dirty_frames[k]] = true;
+    }
+    for (int i = 0; i < frames; ++i) {
+        touch[i] = touch[i] || mem->frame_status[i].used;
+    }
+    name_index_t buffers = mem->buffer_index;  // the buffers before the undo
+    mem->buffer_index    = (name_index_t){0};
+
+    checkpoint_t *level = &ckpt->levels[--ckpt->depth];
+    checkpoint_disarm(mem);
+    for (size_t w = 0; w < (ckpt->num_pages + 63) / 64; ++w) {
+        for (uint64_t saved = level->saved[w]; saved; saved &= saved - 1) {
+            size_t page = w * 64 + __builtin_ctzll(saved);
+            int    r    = CHECKPOINT_REGIONS - 1;
+            while (ckpt->regions[r].first_page > page) {
+                --r;
+            }
+            checkpoint_region_t *region = &ckpt->regions[r];
+            size_t               start  = (page - region->first_page) * region->granule;
+            memcpy(region->base + start, level->images + region->offset + start, region->granule);
+        }
+    }
+
+    mem->stack_pointer    = level->stack_pointer;
+    mem->heap_size        = level->heap_size;
+    mem->num_frames_free  = level->num_frames_free;
+    mem->shard.fit_policy = (fit_policy_t)level->fit_policy;
+    mem->gc.active        = level->gc_active;
+    mem->gc.pending       = level->gc_pending;
+    mem->gc.cursor        = level->gc_cursor;
+    memcpy(mem->shard.size_class_used, level->size_class_used, sizeof(level->size_class_used));
+    if (level->gc_marks) {
+        size_t marks = (size_t)mem->config.heap_size / HEAP_ALIGNMENT / 64 + 1;
+        memcpy(mem->gc.marks, level->gc_marks, marks * sizeof(uint64_t));
+    }
+    int rover = level->rover;
+    checkpoint_release(level);
+
+    // The rebuild below writes to the tracked regions, so a checkpoint still taken saves the pages
+    // it changes
+    if (ckpt->depth) {
+        checkpoint_arm(mem);
+    } else {
+        checkpoint_unlink(mem);
+    }
+    heap_rebuild(mem, rover);
+    frames_rebuild(mem);
+    buffer_owners_rebuild(mem);
+
+    // The dirty flags came back with the frame records, they are set again for the changed frames
+    for (int i = 0; i < frames; ++i) {
+        mem->stack_frame[i].dirty = false;
+    }
+    mem->num_dirty_frames = 0;
+    for (int i = 0; i < frames; ++i) {
+        if (touch[i] || mem->frame_status[i].used) {
+            frame_touch(mem, i);
+        }
+    }
+    // A buffer changed when it is only on one side of the undo or at another address on the other
+    name_index_t *sides[] = {&buffers, &mem->buffer_index, &buffers};
+    for (int side = 0; side < 2; ++side) {
+        for (uint32_t k = 0; sides[side]->entries && k <= sides[side]->mask; ++k) {
+            index_entry_t *entry = &sides[side]->entries[k];
+            index_entry_t *other = entry->key != 0 ? index_find(sides[side + 1], entry->key, 0) : NULL;
+            if (entry->key != 0 && (!other || other->value != entry->value)) {
+                buffer_touch(mem, entry->key, entry->value + BLOCK_HEADER_SIZE);
+            }
+        }
+    }
+    free(buffers.entries);
+    free(touch);
+}
+
+/**
+ * @brief Function to compare two integers for qsort
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Function to print the shards of a shared heap
+ *
+ * @details Every shard is locked while it is read, so the table can be printed while other
+ *      instances keep allocating.
+ *
+ * @param out
+ * @param shared
+ */
+static void print_shards(output_t *out, shared_heap_t *shared) {
+    output_printf(out, "|-------|-----------------------|------------|-------------|--------------|------------|\n");
+    output_printf(out, "| Shard |         Range         | Free Bytes | Free Blocks | Acquisitions | Contended  |\n");
+    output_printf(out, "|-------|-----------------------|------------|-------------|--------------|------------|\n");
+    for (int k = 0; k < shared->num_shards; ++k) {
+        heap_shard_t *shard = &shared->shards[k];
+        int           bytes = 0, blocks = 0;
+        shard_lock(shard);
+        for (freelist_t *curr = shard->freelist_head; curr; curr = curr->next) {
+            bytes += curr->size;
+            ++blocks;
+        }
+        uint64_t acquisitions = shard->acquisitions, contended = shard->contended;
+        pthread_mutex_unlock(&shard->lock);
+
+        output_printf(out, "| %-5d | %10d-%-10d | %-10d | %-11d | %-12llu | %-10llu |\n", k, shard->start,
+                      shard->end - 1, bytes, blocks, (unsigned long long)acquisitions, (unsigned long long)contended);
+    }
+    output_printf(out, "|-------|-----------------------|------------|-------------|--------------|------------|\n");
+}
+
+/**
+ * @brief Function to print the heap section of SM for an instance attached to a shared heap
+ *
+ * @details Only the buffers of the instance are listed, in address order, followed by the shards
+ *      of the heap and the hit rate of the block cache of the instance.
+ *
+ * @param mem
+ * @param out
+ */
+static void print_shared_heap(memory_t *mem, output_t *out) {
+    int *addresses = (int *)malloc((mem->buffer_index.count + 1) * sizeof(int));
+    int  count     = 0;
+    if (!addresses) {
+        fprintf(stderr, "Error: Could not allocate memory for the heap listing\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t k = 0; mem->buffer_index.entries && k <= mem->buffer_index.mask; ++k) {
+        if (mem->buffer_index.entries[k].key != 0) {
+            addresses[count++] = mem->buffer_index.entries[k].value;
+        }
+    }
+    qsort(addresses, count, sizeof(int), compare_int);
+
+    output_printf(out, "\nHEAP (shared)\n");
+    output_printf(out, "Heap Size: %d\n", mem->heap_size);
+    output_printf(out, "|---------------|-----------------|--------|\n");
+    output_printf(out, "|  Buffer Name  |  Start Address  |  Size  |\n");
+    output_printf(out, "|---------------|-----------------|--------|\n");
+    for (int k = 0; k < count; ++k) {
+        block_t block = heap_block(mem->heap, addresses[k]);
+        output_printf(out, "| %-13s | 0x%-13d | %-6d |\n", name_text(&mem->names, block.name),
+                      block.address + BLOCK_HEADER_SIZE, block.size - BLOCK_HEADER_SIZE);
+    }
+    output_printf(out, "|---------------|-----------------|--------|\n");
+    free(addresses);
+
+    output_printf(out, "\nSHARDS\n");
+    print_shards(out, mem->shared);
+    output_printf(out, "Cache Hits: %llu, Cache Misses: %llu\n\n", (unsigned long long)mem->tcache.hits,
+                  (unsigned long long)mem->tcache.misses);
+}
+
+/**
+ * @brief Function to print the buffers and free blocks of a buddy heap
+ *
+ * @details Every buffer is listed with the bytes CH asked for and the block it got, the bytes of
+ *      the blocks beyond what CH needed, headers included, are the internal fragmentation.
+ *
+ * @param mem
+ * @param out
+ */
+static void print_buddy_heap(memory_t *mem, output_t *out) {
+    long long needed    = 0;
+    int       curr_addr = 0;
+    block_t   block;
+    output_printf(out, "\nHEAP (buddy)\n");
+    output_printf(out, "Heap Size: %d\n", mem->heap_size);
+    output_printf(out, "|---------------|-----------------|--------|--------|\n");
+    output_printf(out, "|  Buffer Name  |  Start Address  |  Size  | Block  |\n");
+    output_printf(out, "|---------------|-----------------|--------|--------|\n");
+    while (heap_next_buffer(mem, &curr_addr, &block)) {
+        uint32_t bytes = mem->buddy_needed[block.address >> BUDDY_MIN_ORDER];
+        output_printf(out, "| %-13s | 0x%-13d | %-6u | %-6d |\n", name_text(&mem->names, block.name),
+                      block.address + BLOCK_HEADER_SIZE, bytes - BLOCK_HEADER_SIZE, block.size);
+        needed += bytes;
+    }
+    output_printf(out, "|---------------|-----------------|--------|--------|\n");
+    output_printf(out, "Internal Fragmentation: %lld bytes, %.2f%% of the heap size\n", mem->heap_size - needed,
+                  mem->heap_size ? 100.0 * (mem->heap_size - needed) / mem->heap_size : 0.0);
+
+    output_printf(out, "\nFREE LIST\n");
+    output_printf(out, "|-----------------|--------|-------|\n");
+    output_printf(out, "|  Start Address  |  Size  | Order |\n");
+    output_printf(out, "|-----------------|--------|-------|\n");
+    for (int address = 0; address < mem->config.heap_size; address += block.size) {
+        block = heap_block(mem->heap, address);
+        if (block.flags & BLOCK_FREE) {
+            output_printf(out, "| 0x%-13d | %-6d | %-5d |\n", address, block.size, size_class_of(block.size));
+        }
+    }
+    output_printf(out, "|-----------------|--------|-------|\n\n");
+}
+
+/**
+ * @brief Function to print the stack and heap
+ *
+ * @details The output is collected in one buffer and written with as few write calls as possible.
+ *      In delta mode only the frames and buffers that changed since the previous SM are printed,
+ *      in JSON mode the whole state is exported to path, or stdout if path is empty.
+ *
+ * @param mem
+ * @param mode
+ * @param path
+ */
+void SM(memory_t *mem, sm_mode_t mode, char *path) {
+    output_t *out = &mem->output;
+    if (mode == SM_JSON) {
+        if (heap_private(mem, "SM --json")) {
+            export_json(mem, path);
+        }
+        return;
+    } else if (mode == SM_DELTA) {
+        print_delta(mem, out);
+        output_flush(out);
+        clear_dirty(mem);
+        return;
+    }
+
+    output_printf(out, "                               STACK\n");
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+    output_printf(out, "| Frame | Function Name | Function Address | Frame Address | Frame Size |\n");
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+    for (int i = mem->config.max_frames - 1; i >= 0; --i) {
+        if (mem->frame_status[i].used) {
+            print_frame_row(mem, out, i);
+        }
+    }
+    output_printf(out, "|-------|---------------|------------------|---------------|------------|\n");
+
+    for (int i = mem->config.max_frames - 1; i >= 0; --i) {
+        if (mem->frame_status[i].used) {
+            print_frame_contents(mem, out, i);
+        }
+    }
+
+    if (mem->shared || mem->buddy) {
+        if (mem->shared) {
+            print_shared_heap(mem, out);
+        } else {
+            print_buddy_heap(mem, out);
+        }
+        output_flush(out);
+        clear_dirty(mem);
+        return;
+    }
+
+    int     curr_addr = 0;
+    block_t block;
+    output_printf(out, "\nHEAP\n");
+    output_printf(out, "Heap Size: %d\n", mem->heap_size);
+    output_printf(out, "|---------------|-----------------|--------|\n");
+    output_printf(out, "|  Buffer Name  |  Start Address  |  Size  |\n");
+    output_printf(out, "|---------------|-----------------|--------|\n");
+    while (heap_next_buffer(mem, &curr_addr, &block)) {
+        output_printf(out, "| %-13s | 0x%-13d | %-6d |\n", name_text(&mem->names, block.name),
+                      block.address + BLOCK_HEADER_SIZE, block.size - BLOCK_HEADER_SIZE);
+    }
+    output_printf(out, "|---------------|-----------------|--------|\n");
+
+    output_printf(out, "\nFREE LIST\n");
+    output_printf(out, "|-----------------|--------|\n");
+    output_printf(out, "|  Start Address  |  Size  |\n");
+    output_printf(out, "|-----------------|--------|\n");
+    for (freelist_t *curr = mem->shard.freelist_head; curr; curr = curr->next) {
+        output_printf(out, "| 0x%-13d | %-6d |\n", curr->start, curr->size);
+    }
+    output_printf(out, "|-----------------|--------|\n\n");
+
+    output_flush(out);
+    clear_dirty(mem);
+}
+
+/**
+ * @brief Function to pack a command word into its opcode
+ *
+ * @details The first two letters are upper cased and packed into one integer, so commands can be
+ *      dispatched with a switch instead of a chain of string compares. Longer command words are
+ *      looked up case insensitively in a table of their own opcodes.
+ *
+ * @param word
+ * @return uint32_t the opcode or 0 if the word is not a command word
+ */
+static uint32_t command_opcode(const token_t *word) {
+    static const struct {
+        const char *word;
+        uint32_t    opcode;
+    } long_words[] = {
+        {"COMPACT", OPCODE_COMPACT},
+        {"PROF", OPCODE_PROF},
+        {"STATS", OPCODE_STATS},
+        {"SAVE", OPCODE_SAVE},
+        {"LOAD", OPCODE_LOAD},
+        {"CKPT", OPCODE_CKPT},
+        {"UNDO", OPCODE_UNDO},
+        {"FILL", OPCODE_FILL},
+        {"COPY", OPCODE_COPY},
+        {"SUM", OPCODE_SUM},
+    };
+
+    if (word->length > 2) {
+        for (size_t i = 0; i < sizeof(long_words) / sizeof(long_words[0]); ++i) {
+            if (strlen(long_words[i].word) == word->length &&
+                strncasecmp(word->text, long_words[i].word, word->length) == 0) {
+                return long_words[i].opcode;
+            }
+        }
+        return 0;
+    } else if (word->length == 0 || word->text[0] == '\0') {
+        return 0;
+    }
+
+    uint32_t opcode = (uint8_t)toupper((unsigned char)word->text[0]);
+    if (word->length == 2) {
+        opcode |= (uint32_t)(uint8_t)toupper((unsigned char)word->text[1]) << 8;
+    }
+    return opcode;
+}
+
+/**
+ * @brief Function to copy a token into a NUL terminated buffer
+ *
+ * @details Tokens that do not fit are cut, the handlers still see that they are too long since
+ *      the buffer is larger than any name.
+ *
+ * @param token
+ * @param buffer
+ * @param size
+ */
+static void token_copy(const token_t *token, char *buffer, size_t size) {
+    size_t length = token->length < size - 1 ? token->length : size - 1;
+    memcpy(buffer, token->text, length);
+    buffer[length] = '\0';
+}
+
+/**
+ * @brief Function to compare a token with a string
+ *
+ * @param token
+ * @param text
+ * @return true if the token is exactly text
+ */
+static bool token_equals(const token_t *token, const char *text) {
+    return token->length == strlen(text) && memcmp(token->text, text, token->length) == 0;
+}
+
+/**
+ * @brief Function to parse a decimal integer token
+ *
+ * @param token
+ * @param value
+ * @return true if the whole token is an integer that fits in an int
+ */
+static bool token_int(const token_t *token, int *value) {
+    const char *curr = token->text, *end = token->text + token->length;
+    bool        negative = curr < end && (*curr == '-' || *curr == '+') && *curr++ == '-';
+    long        number   = 0;
+
+    if (curr == end) {
+        return false;
+    }
+    for (; curr < end; ++curr) {
+        if (*curr < '0' || *curr > '9' || number > INT_MAX) {
+            return false;
+        }
+        number = number * 10 + (*curr - '0');
+    }
+
+    number = negative ? -number : number;
+    if (number < INT_MIN || number > INT_MAX) {
+        return false;
+    }
+    *value = (int)number;
+    return true;
+}
+
+/**
+ * @brief Function to parse a floating point token
+ *
+ * @param token
+ * @param value
+ * @return true if the whole token is a number
+ */
+static bool token_double(const token_t *token, double *value) {
+    char  number[64], *end;
+    token_copy(token, number, sizeof(number));
+    *value = strtod(number, &end);
+    return token->length > 0 && token->length < sizeof(number) && *end == '\0';
+}
+
+/**
+ * @brief Function to split a line into whitespace separated tokens
+ *
+ * @details The tokens point into the line, nothing is copied or allocated.
+ *
+ * @param line
+ * @param end
+ * @param tokens
+ * @return int the number of tokens, at most MAX_TOKENS + 1 so that extra arguments are noticed
+ */
+static int tokenize(const char *line, const char *end, token_t *tokens) {
+    int count = 0;
+    while (line < end && count <= MAX_TOKENS) {
+        while (line < end && isspace((unsigned char)*line)) {
+            ++line;
+        }
+        if (line == end || *line == '#') {
+            break;
+        }
+
+        tokens[count].text = line;
+        while (line < end && !isspace((unsigned char)*line)) {
+            ++line;
+        }
+        tokens[count].length = (size_t)(line - tokens[count].text);
+        ++count;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Function to parse the arguments of a command into a record
+ *
+ * @details The name arguments, if any, are left in their tokens, the caller decides how to store
+ *        them.
+ *
+ * @param tokens
+ * @param count
+ * @param record
+ * @param name set to the token of the name argument, with a NULL text for commands without one
+ * @param second set to the token of the second name argument of COPY, with a NULL text otherwise
+ * @return command_status_t
+ */
+static command_status_t parse_command(const token_t *tokens, int count, trace_record_t *record, token_t *name,
+                                      token_t *second) {
+    *record = (trace_record_t){.opcode = (uint16_t)command_opcode(&tokens[0])};
+    *name   = count > 1 ? tokens[1] : (token_t){0};
+    *second = (token_t){0};
+
+    int arguments, int_value = 0;
+    switch (record->opcode) {
+        case OPCODE('Q', 0):
+        case OPCODE('D', 'F'):
+        case OPCODE('S', 'C'):
+        case OPCODE('G', 'C'):
+        case OPCODE_COMPACT:
+        case OPCODE_PROF:
+        case OPCODE_STATS:
+        case OPCODE_CKPT:
+        case OPCODE_UNDO: arguments = 0; break;
+        case OPCODE('S', 'M'):
+            // SM takes an optional mode flag, JSON output can go to a file
+            if (count == 1) {
+                record->int_value = SM_FULL;
+            } else if (count == 2 && token_equals(&tokens[1], "--delta")) {
+                record->int_value = SM_DELTA;
+            } else if (count <= 3 && token_equals(&tokens[1], "--json")) {
+                record->int_value = SM_JSON;
+            } else {
+                return COMMAND_INVALID;
+            }
+            *name = count == 3 ? tokens[2] : (token_t){0};
+            return COMMAND_OK;
+        case OPCODE('H', 'M'):
+            // HM takes an optional cell size, 0 picks one that fits the heap in HEAP_MAP_CELLS cells
+            *name = (token_t){0};
+            if (count == 2 && token_int(&tokens[1], &int_value) && int_value > 0) {
+                record->int_value = int_value;
+            } else if (count != 1) {
+                return COMMAND_INVALID;
+            }
+            return COMMAND_OK;
+        case OPCODE_COPY:
+            if (count != 3) {
+                return COMMAND_INVALID;
+            }
+            *second = tokens[2];
+            return COMMAND_OK;
+        case OPCODE('D', 'H'):
+        case OPCODE('S', 'B'):
+        case OPCODE('A', 'P'):
+        case OPCODE_SUM:
+        case OPCODE_SAVE:
+        case OPCODE_LOAD: arguments = 1; break;
+        case OPCODE('C', 'F'):
+        case OPCODE('C', 'I'):
+        case OPCODE('C', 'D'):
+        case OPCODE('C', 'C'):
+        case OPCODE('C', 'H'):
+        case OPCODE_FILL: arguments = 2; break;
+        default: return COMMAND_INVALID;
+    }
+    if (count != arguments + 1) {
+        return COMMAND_INVALID;
+    }
+
+    if (record->opcode == OPCODE('C', 'D')) {
+        return token_double(&tokens[2], &record->double_value) ? COMMAND_OK : COMMAND_INVALID;
+    } else if (record->opcode == OPCODE('C', 'C')) {
+        record->int_value = (unsigned char)tokens[2].text[0];
+        return tokens[2].length == 1 ? COMMAND_OK : COMMAND_INVALID;
+    } else if (arguments == 2 && !token_int(&tokens[2], &int_value)) {
+        return COMMAND_INVALID;
+    }
+
+    record->int_value = int_value;
+    return record->opcode == OPCODE('Q', 0) ? COMMAND_QUIT : COMMAND_OK;
+}
+
+/**
+ * @brief Function to get the STATS slot of a command
+ *
+ * @param opcode a valid opcode other than Q
+ * @return stat_command_t
+ */
+static stat_command_t stats_command(uint32_t opcode) {
+    switch (opcode) {
+        case OPCODE('C', 'F'): return STAT_CF;
+        case OPCODE('D', 'F'): return STAT_DF;
+        case OPCODE('C', 'I'): return STAT_CI;
+        case OPCODE('C', 'D'): return STAT_CD;
+        case OPCODE('C', 'C'): return STAT_CC;
+        case OPCODE('C', 'H'): return STAT_CH;
+        case OPCODE('D', 'H'): return STAT_DH;
+        case OPCODE('S', 'M'): return STAT_SM;
+        case OPCODE('S', 'B'): return STAT_SB;
+        case OPCODE('S', 'C'): return STAT_SC;
+        case OPCODE('A', 'P'): return STAT_AP;
+        case OPCODE('G', 'C'): return STAT_GC;
+        case OPCODE_COMPACT: return STAT_COMPACT;
+        case OPCODE_PROF: return STAT_PROF;
+        case OPCODE_SAVE: return STAT_SAVE;
+        case OPCODE_LOAD: return STAT_LOAD;
+        case OPCODE_CKPT: return STAT_CKPT;
+        case OPCODE_UNDO: return STAT_UNDO;
+        case OPCODE('H', 'M'): return STAT_HM;
+        case OPCODE_FILL: return STAT_FILL;
+        case OPCODE_COPY: return STAT_COPY;
+        case OPCODE_SUM: return STAT_SUM;
+        default: return STAT_STATS;  // the only opcode left
+    }
+}
+
+/**
+ * @brief Function to run one parsed command
+ *
+ * @details In incremental GC mode every command is followed by one bounded collector slice. Every
+ *      command is counted, and timed together with its slice when latency tracing is on.
+ *
+ * @param mem
+ * @param record
+ * @param name the name argument of the command, ignored by commands without one
+ * @param second the second name argument of COPY, ignored by the other commands
+ * @return command_status_t
+ */
+static command_status_t run_command(memory_t *mem, const trace_record_t *record, char *name, char *second) {
+    uint64_t start = mem->config.latency ? clock_cycles() : 0;
+    ++mem->prof.commands;
+    switch (record->opcode) {
+        case OPCODE('Q', 0): return COMMAND_QUIT;
+        case OPCODE('D', 'F'): DF(mem); break;
+        case OPCODE('S', 'M'): SM(mem, (sm_mode_t)record->int_value, name); break;
+        case OPCODE('S', 'B'): SB(mem, name); break;
+        case OPCODE('S', 'C'): SC(mem); break;
+        case OPCODE('H', 'M'): HM(mem, (int)record->int_value); break;
+        case OPCODE_FILL: FILL(mem, name, (int)record->int_value); break;
+        case OPCODE_COPY: COPY(mem, name, second); break;
+        case OPCODE_SUM: SUM(mem, name); break;
+        case OPCODE_COMPACT: COMPACT(mem); break;
+        case OPCODE('G', 'C'): GC(mem); break;
+        case OPCODE_PROF: PROF(mem); break;
+        case OPCODE_STATS: STATS(mem); break;
+        case OPCODE_SAVE: SAVE(mem, name); break;
+        case OPCODE_LOAD: LOAD(mem, name); break;
+        case OPCODE_CKPT: CKPT(mem); break;
+        case OPCODE_UNDO: UNDO(mem); break;
+        case OPCODE('D', 'H'): DH(mem, name); break;
+        case OPCODE('A', 'P'): AP(mem, name); break;
+        case OPCODE('C', 'F'): CF(mem, name, (int)record->int_value); break;
+        case OPCODE('C', 'I'): CI(mem, name, (int)record->int_value); break;
+        case OPCODE('C', 'D'): CD(mem, name, record->double_value); break;
+        case OPCODE('C', 'C'): CC(mem, name, (char)record->int_value); break;
+        case OPCODE('C', 'H'): CH(mem, name, (int)record->int_value); break;
+        default: return COMMAND_INVALID;
+    }
+
+    if (mem->config.gc_slice && !mem->shared) {
+        gc_step(mem);
+    }
+    if (HEAP_CHECK && mem->shadow) {
+        check_pointers(mem);
+    }
+
+    stat_command_t command = stats_command(record->opcode);
+    ++mem->stats.commands[command];
+    if (mem->config.latency) {
+        latency_t *latency = &mem->stats.latency[command];
+        uint64_t   cycles  = clock_cycles() - start;
+        int        bucket  = 63 - __builtin_clzll(cycles | 1);
+        ++latency->count;
+        ++latency->buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1];
+        latency->cycles += cycles;
+        latency->max = cycles > latency->max ? cycles : latency->max;
+    }
+    return COMMAND_OK;
+}
 
 /**
- * @brief Structure to store the frame status
- *
- * @details This structure is used to store the status of the frame, whether it is used or not, the
- *         function address, frame address and the name of the function.
+ * @brief Function to run one command line
  *
+ * @param mem
+ * @param tokens
+ * @param count
+ * @return command_status_t
  */
-typedef struct __frame_status_t {
-    int  number;
-    char name[MAX_NAME_SIZE];
-    int  func_address;
-    int  frame_address;
-    bool used;
-} frame_status_t;
+static command_status_t execute(memory_t *mem, const token_t *tokens, int count) {
+    trace_record_t   record;
+    token_t          name_token, second_token;
+    command_status_t status = parse_command(tokens, count, &record, &name_token, &second_token);
+    if (status != COMMAND_OK) {
+        mem->stats.invalid += status == COMMAND_INVALID;
+        return status;
+    }
+
+    char name[PATH_BUFFER_SIZE] = "", second[PATH_BUFFER_SIZE] = "";
+    if (name_token.text) {
+        token_copy(&name_token, name, sizeof(name));
+    }
+    if (second_token.text) {
+        token_copy(&second_token, second, sizeof(second));
+    }
+    status = run_command(mem, &record, name, second);
+    mem->stats.invalid += status == COMMAND_INVALID;
+    return status;
+}
 
 /**
- * @brief Structure to store the free list
+ * @brief Function to map or read a whole trace into memory
  *
- * @details This structure is used to store the free list, it stores the start address of the free
- *        block, the size of the free block and a pointer to the next free block.
+ * @details Regular files are mapped read only, anything else such as a pipe on stdin is read into
+ *      one growing buffer.
  *
+ * @param path the trace file or - for stdin
+ * @param size
+ * @param mapped set when the trace was mapped rather than read
+ * @return const char* the trace, NULL if it could not be read
  */
-typedef struct __freelist_t {
-    int                  start;
-    int                  size;
-    struct __freelist_t *next;
-} freelist_t;
+static const char *trace_load(const char *path, size_t *size, bool *mapped) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Could not open trace %s\n", path);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *trace = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (trace != MAP_FAILED) {
+            madvise(trace, (size_t)info.st_size, MADV_SEQUENTIAL);
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            *size   = (size_t)info.st_size;
+            *mapped = true;
+            return (const char *)trace;
+        }
+    }
+
+    size_t  capacity = 1 << 16;
+    char   *buffer   = (char *)malloc(capacity);
+    ssize_t bytes    = 0;
+    *size            = 0;
+    *mapped          = false;
+    while (buffer && (bytes = read(fd, buffer + *size, capacity - *size)) > 0) {
+        *size += (size_t)bytes;
+        if (*size == capacity) {
+            char *grown = (char *)realloc(buffer, capacity *= 2);
+            if (!grown) {
+                free(buffer);
+            }
+            buffer = grown;
+        }
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (!buffer || bytes == -1) {
+        fprintf(stderr, "Error: Could not read trace %s\n", path);
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
 
 /**
- * @brief Structure to store the allocated buffer
- *
- * @details This structure is used to store the allocated buffer, it stores the name of the buffer,
- *         the start address of the buffer and the size of the buffer.
+ * @brief Function to release a trace loaded by trace_load
  *
+ * @param trace
+ * @param size
+ * @param mapped
  */
-typedef struct __allocated_t {
-    char name[MAX_NAME_SIZE];
-    int  start_address;
-} allocated_t;
+static void trace_unload(const char *trace, size_t size, bool mapped) {
+    if (mapped) {
+        munmap((void *)trace, size);
+    } else {
+        free((void *)trace);
+    }
+}
 
 /**
- * @brief Structure to store the integer
+ * @brief Function to replay a trace of commands without prompting
  *
- * @details This structure is used to store the integer, it stores the name of the integer, the
- *        value of the integer and a flag to check if the integer has been initialized or not.
+ * @details The trace holds one command per line, blank lines and text after # are ignored. Output
+ *      goes through the output buffer of the instance so replay is not bound by write calls.
  *
+ * @param mem
+ * @param path the trace file or - for stdin
+ * @return long the number of invalid commands, -1 if the trace could not be read
  */
-typedef struct __my_int_t {
-    char name[MAX_NAME_SIZE];
-    int  value;
-    bool initialized;
-} int_t;
+static long run_batch(memory_t *mem, const char *path) {
+    size_t      size;
+    bool        mapped;
+    const char *trace = trace_load(path, &size, &mapped);
+    if (!trace) {
+        return -1;
+    }
+
+    long        invalid = 0;
+    token_t     tokens[MAX_TOKENS + 1];
+    const char *line = trace, *end = trace + size;
+    for (long line_no = 1; line < end; ++line_no) {
+        const char *line_end = memchr(line, '\n', (size_t)(end - line));
+        line_end             = line_end ? line_end : end;
+
+        int count = tokenize(line, line_end, tokens);
+        if (count > 0) {
+            command_status_t status = execute(mem, tokens, count);
+            if (status == COMMAND_QUIT) {
+                break;
+            } else if (status == COMMAND_INVALID) {
+                fprintf(mem->error, "Error: %s:%ld: Invalid command\n", path, line_no);
+                ++invalid;
+            }
+        }
+        line = line_end + 1;
+    }
+
+    output_flush(&mem->output);
+    trace_unload(trace, size, mapped);
+    return invalid;
+}
 
 /**
- * @brief Structure to store the double
- *
- * @details This structure is used to store the double, it stores the name of the double, the
- *        value of the double and a flag to check if the double has been initialized or not.
+ * @brief Function to get the id of a name in the name table of a compiled trace
  *
+ * @param token
+ * @param name_table
+ * @return uint32_t
  */
-typedef struct __my_double_t {
-    char   name[MAX_NAME_SIZE];
-    double value;
-    bool   initialized;
-} double_t;
+static uint32_t trace_name_id(const token_t *token, name_table_t *name_table) {
+    char name[PATH_BUFFER_SIZE];
+    token_copy(token, name, sizeof(name));
+    return name_intern(name_table, name);
+}
 
 /**
- * @brief Structure to store the char
+ * @brief Function to compile a text trace into the binary trace format
  *
- * @details This structure is used to store the char, it stores the name of the char, the
- *        value of the char and a flag to check if the char has been initialized or not.
+ * @details The records are streamed to the output as the text is parsed, the name table follows
+ *      them and the header is written last once all offsets are known. Invalid commands are
+ *      reported and left out.
  *
+ * @param path the text trace or - for stdin
+ * @param output_path
+ * @return int the exit status
  */
-typedef struct __my_char_t {
-    char name[MAX_NAME_SIZE];
-    char value;
-    bool initialized;
-} char_t;
+static int trace_compile(const char *path, const char *output_path) {
+    size_t      size;
+    bool        mapped;
+    const char *trace = trace_load(path, &size, &mapped);
+    FILE       *out   = trace ? fopen(output_path, "wb") : NULL;
+    if (!out) {
+        if (trace) {
+            fprintf(stderr, "Error: Could not create %s\n", output_path);
+            trace_unload(trace, size, mapped);
+        }
+        return EXIT_FAILURE;
+    }
+
+    trace_header_t header = {.magic = TRACE_MAGIC, .byte_order = TRACE_BYTE_ORDER, .version = TRACE_VERSION};
+    name_table_t   name_table = {0};
+    token_t        tokens[MAX_TOKENS + 1];
+    bool           ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    const char *line = trace, *end = trace + size;
+    for (long line_no = 1; ok && line < end; ++line_no) {
+        const char *line_end = memchr(line, '\n', (size_t)(end - line));
+        line_end             = line_end ? line_end : end;
+
+        trace_record_t record;
+        token_t        name, second;
+        int            count = tokenize(line, line_end, tokens);
+        if (count > 0 && parse_command(tokens, count, &record, &name, &second) == COMMAND_INVALID) {
+            fprintf(stderr, "Error: %s:%ld: Invalid command\n", path, line_no);
+        } else if (count > 0) {
+            record.name_id = name.text ? trace_name_id(&name, &name_table) : TRACE_NO_NAME;
+            if (second.text) {
+                record.second_id = trace_name_id(&second, &name_table);
+            }
+            ok             = fwrite(&record, sizeof(record), 1, out) == 1;
+            ++header.record_count;
+        }
+        line = line_end + 1;
+    }
+
+    header.name_count   = name_table.count;
+    header.names_offset = sizeof(header) + header.record_count * sizeof(trace_record_t);
+    header.names_size   = name_table.size;
+    ok                  = ok && fwrite(name_table.offsets, sizeof(uint32_t), name_table.count, out) == name_table.count;
+    ok                  = ok && fwrite(name_table.text, 1, name_table.size, out) == name_table.size;
+    ok                  = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok                  = fclose(out) == 0 && ok;
+
+    name_table_free(&name_table);
+    trace_unload(trace, size, mapped);
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
 /**
- * @brief Structure to store the frame
- *
- * @details This structure is used to store the frame, it stores the frame address, the size of the
- *       frame, the integer, double, char and pointer arrays.
+ * @brief Function to get a name of a compiled trace from its id
  *
+ * @param offsets
+ * @param text the name text, NUL terminated after its last name
+ * @param header
+ * @param id
+ * @return char* the name, empty for an id without one
  */
-typedef struct __frame_t {
-    int                  frame_address;
-    int                  size;
-    struct __my_int_t    my_ints[MAX_INT];
-    struct __my_double_t my_doubles[MAX_DOUBLE];
-    struct __my_char_t   my_chars[MAX_CHAR];
-    void                *pointers[MAX_POINTER];
-} frame_t;
+static char *trace_name(const uint32_t *offsets, char *text, const trace_header_t *header, uint32_t id) {
+    return id < header->name_count && offsets[id] < header->names_size ? text + offsets[id] : text + header->names_size;
+}
 
 /**
- * @brief Structure to store the memory
+ * @brief Function to replay a compiled binary trace
  *
- * @details This structure is used to store the memory, it stores the frame status, stack frame,
- *       free list, stack size, heap size and the heap.
+ * @details The trace is mapped and its records are handed straight to the command handlers, no
+ *      text is parsed.
  *
+ * @param mem
+ * @param path
+ * @return int the exit status
  */
-typedef struct __memory_t {
-    struct __frame_status_t frame_status[MAX_FRAMES];
-    struct __frame_t        stack_frame[MAX_FRAMES];
-    struct __freelist_t    *freelist_head;
-    int                     stack_size;
-    int                     heap_size;
-    char                    heap[MAX_HEAP_SIZE];
-} memory_t;
+static int trace_replay(memory_t *mem, const char *path) {
+    size_t      size;
+    bool        mapped;
+    const char *trace = trace_load(path, &size, &mapped);
+    if (!trace) {
+        return EXIT_FAILURE;
+    }
+
+    const trace_header_t *header = (const trace_header_t *)trace;
+    if (size < sizeof(*header) || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != TRACE_BYTE_ORDER || header->version != TRACE_VERSION ||
+        header->names_offset != sizeof(*header) + header->record_count * sizeof(trace_record_t) ||
+        header->names_offset + (uint64_t)header->name_count * sizeof(uint32_t) + header->names_size > size) {
+        fprintf(mem->error, "Error: %s is not a compiled trace\n", path);
+        trace_unload(trace, size, mapped);
+        return EXIT_FAILURE;
+    }
+
+    // Names are copied once into a writable buffer since the handlers take mutable strings
+    const uint32_t *offsets = (const uint32_t *)(trace + header->names_offset);
+    char           *text    = (char *)malloc(header->names_size + 1);
+    if (!text) {
+        fprintf(stderr, "Error: Could not allocate memory for the trace names\n");
+        trace_unload(trace, size, mapped);
+        return EXIT_FAILURE;
+    }
+    memcpy(text, offsets + header->name_count, header->names_size);
+    text[header->names_size] = '\0';
+
+    const trace_record_t *records = (const trace_record_t *)(trace + sizeof(*header));
+    for (uint64_t i = 0; i < header->record_count; ++i) {
+        char *name   = trace_name(offsets, text, header, records[i].name_id);
+        char *second = records[i].opcode == OPCODE_COPY ? trace_name(offsets, text, header, records[i].second_id)
+                                                          : text + header->names_size;
+        command_status_t status = run_command(mem, &records[i], name, second);
+        if (status == COMMAND_QUIT) {
+            break;
+        } else if (status == COMMAND_INVALID) {
+            fprintf(mem->error, "Error: %s: record %llu: Invalid command\n", path, (unsigned long long)i + 1);
+            ++mem->stats.invalid;
+        }
+    }
 
-memory_t sys_memory;  // Global variable to store the memory
+    output_flush(&mem->output);
+    free(text);
+    trace_unload(trace, size, mapped);
+    return EXIT_SUCCESS;
+}
 
 /**
- * @brief Function to initialize the memory
- *
- * @details This function is used to initialize the memory, it initializes the frame status, stack
- *      frame, free list, stack size, heap size and the heap. It also initializes the free list
- *     head.
+ * @brief Function to read and run commands typed by the user
  *
+ * @param mem
+ * @return int the exit status
  */
-void init() {
-    for (int i = 0; i < MAX_FRAMES; ++i) {
-        sys_memory.frame_status[i] = (frame_status_t){
-            .number        = 0,
-            .func_address  = 0,
-            .frame_address = 0,
-            .used          = false,
-        };
-        memset(sys_memory.frame_status[i].name, '\0', sizeof(sys_memory.frame_status[i].name));
-
-        sys_memory.stack_frame[i] = (frame_t){
-            .frame_address = -1,
-            .size          = 0,
-        };
-        memset(sys_memory.stack_frame[i].my_ints, 0, sizeof(sys_memory.stack_frame[i].my_ints));
-        memset(sys_memory.stack_frame[i].my_doubles, 0, sizeof(sys_memory.stack_frame[i].my_doubles));
-        memset(sys_memory.stack_frame[i].my_chars, 0, sizeof(sys_memory.stack_frame[i].my_chars));
-        memset(sys_memory.stack_frame[i].pointers, 0, sizeof(sys_memory.stack_frame[i].pointers));
-    }
+static int run_interactive(memory_t *mem) {
+    char    line[1024];
+    token_t tokens[MAX_TOKENS + 1];
 
-    sys_memory.freelist_head = (freelist_t *)malloc(sizeof(freelist_t));
-    if (!sys_memory.freelist_head) {
-        fprintf(stderr, "Error: Could not allocate memory for the heap free list\n");
-        exit(EXIT_FAILURE);
-    }
+    printf("Type Q or q to quit\n");
+    while (1) {
+        output_flush(&mem->output);
+        printf("$ ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin)) {
+            return EXIT_SUCCESS;
+        }
 
-    sys_memory.stack_size = 0;
-    sys_memory.heap_size  = 0;
+        // A line that does not fit is dropped whole, its tail must not run as a command of its own
+        size_t length = strlen(line);
+        int    next   = length > 0 && line[length - 1] != '\n' ? getchar() : '\n';
+        if (next != '\n' && next != EOF) {
+            while (next != '\n' && next != EOF) {
+                next = getchar();
+            }
+            ++mem->stats.invalid;
+            printf("Invalid input, please try again\n");
+            continue;
+        }
 
-    sys_memory.freelist_head = &(freelist_t){
-        .start = 0,
-        .size  = MAX_HEAP_SIZE,
-        .next  = NULL,
-    };
+        int count = tokenize(line, line + length, tokens);
+        if (count > 0) {
+            command_status_t status = execute(mem, tokens, count);
+            if (status == COMMAND_QUIT) {
+                return EXIT_SUCCESS;
+            } else if (status == COMMAND_INVALID) {
+                printf("Invalid input, please try again\n");
+            }
+        }
+    }
 }
 
 /**
- * @brief Function to create a new frame
+ * @brief Function to compare two latencies for qsort
  *
- * @details This function is used to create a new frame, it checks if the function name is valid,
- *      if the stack size is less than the maximum stack size and if the function already exists.
+ * @param a
+ * @param b
+ * @return int
+ */
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Function to draw a buffer size from a benchmark size distribution
  *
- * @param func_name
- * @param func_address
+ * @param distribution
+ * @param state xorshift state
+ * @return int
  */
-void CF(char *func_name, int func_address) {
-    if (strlen(func_name) > MAX_NAME_SIZE) {
-        fprintf(stderr, "Error: Function name too long, name can be of at most 8 characters.\n");
-        return;
-    } else if (sys_memory.stack_size + FRAME_METADATA_OFFSET > MAX_STACK_SIZE) {
-        fprintf(stderr, "Error: Stack overflow, not enough memory available for new function\n");
-        return;
-    }
+static int bench_size(bench_sizes_t distribution, uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    double uniform = (double)(*state >> 11) / (double)(1ull << 53);
 
-    for (int i = 0; i < MAX_FRAMES; ++i) {
-        if (sys_memory.frame_status[i].used && strcmp(sys_memory.frame_status[i].name, func_name) == 0) {
-            fprintf(stderr, "Error: Function already exists\n");
-            return;
+    switch (distribution) {
+        case BENCH_UNIFORM: return 8 + (int)(uniform * 248);
+        // Pareto with alpha 1.2, most buffers are small but a few are up to 4 KiB
+        case BENCH_POWER_LAW: {
+            double size = 8.0 / pow(1.0 - uniform, 1.0 / 1.2);
+            return size > 4096 ? 4096 : (int)size;
         }
+        case BENCH_BIMODAL: return uniform < 0.8 ? 16 + (int)(uniform / 0.8 * 16) : 1024 + (int)((uniform - 0.8) / 0.2 * 1024);
     }
+    return 8;
+}
+
+/**
+ * @brief Function to run one benchmark workload under one fit policy
+ *
+ * @details The workload first fills the heap to BENCH_LIVE_BUFFERS buffers and then alternates
+ *      between freeing one buffer, picked by the free order, and creating a new one. Every CH and
+ *      DH call is timed on its own.
+ *
+ * @param mem
+ * @param config geometry the instance is set up with for the run
+ * @param distribution
+ * @param order
+ * @param policy a fit policy for AP, or buddy for a buddy heap
+ * @param result
+ */
+static void bench_run(memory_t *mem, const config_t *config, bench_sizes_t distribution, bench_order_t order,
+                      const char *policy, bench_result_t *result) {
+    static uint32_t alloc_ns[BENCH_OPERATIONS], free_ns[BENCH_OPERATIONS];
+    static int      live[BENCH_LIVE_BUFFERS];
 
-    for (int i = 0; i < MAX_FRAMES; ++i) {
-        if (!sys_memory.frame_status[i].used) {
-            sys_memory.frame_status[i] =
-                (frame_status_t){.used          = true,
-                                 .number        = i + 1,
-                                 .func_address  = func_address,
-                                 .frame_address = MEM_SIZE - sys_memory.stack_size - FRAME_METADATA_OFFSET};
-            strncpy(sys_memory.frame_status[i].name, func_name, sizeof(sys_memory.frame_status[i].name) - 1);
+    uint64_t state   = 88172645463325252ull;
+    int      allocs  = 0, frees = 0, head = 0, count = 0;
+    char     name[NAME_BUFFER_SIZE];
+    *result          = (bench_result_t){0};
 
-            sys_memory.stack_frame[i].frame_address = sys_memory.frame_status[i].frame_address;
+    config_t geometry = *config;
+    geometry.buddy    = strcmp(policy, "buddy") == 0;
+    init(mem, &geometry, NULL);
+    mem->error = fopen("/dev/null", "w");
+    if (!geometry.buddy) {
+        AP(mem, (char *)policy);
+    }
+    CF(mem, "bench", 0);
 
-            sys_memory.stack_size += FRAME_METADATA_OFFSET;
+    for (int op = 0; op < BENCH_OPERATIONS; ++op) {
+        if (count == BENCH_LIVE_BUFFERS || (count > 0 && op >= BENCH_LIVE_BUFFERS && op % 2)) {
+            // live[] is a ring of the buffers in creation order, head is the oldest
+            int pick = order == BENCH_FIFO ? 0 : order == BENCH_LIFO ? count - 1 : (int)(state % count);
+            int slot = (head + pick) % BENCH_LIVE_BUFFERS;
+            int id   = live[slot];
+            if (order == BENCH_FIFO) {
+                head = (head + 1) % BENCH_LIVE_BUFFERS;
+            } else {
+                live[slot] = live[(head + count - 1) % BENCH_LIVE_BUFFERS];
+            }
+            --count;
 
-            return;
+            snprintf(name, sizeof(name), "b%d", id);
+            uint64_t start   = clock_ns();
+            DH(mem, name);
+            free_ns[frees++] = (uint32_t)(clock_ns() - start);
+        } else {
+            int size = bench_size(distribution, &state);
+            snprintf(name, sizeof(name), "b%d", op);
+            uint64_t start    = clock_ns();
+            CH(mem, name, size);
+            alloc_ns[allocs++] = (uint32_t)(clock_ns() - start);
+
+            if (heap_find_buffer(mem, name) != -1) {
+                live[(head + count++) % BENCH_LIVE_BUFFERS] = op;
+            } else {
+                ++result->failed;
+            }
+            result->peak_heap = mem->heap_size > result->peak_heap ? mem->heap_size : result->peak_heap;
         }
     }
 
-    printf("Error: Cannot create another frame, maximum number of frames have been reached\n");
-    return;
+    result->fragmentation = heap_fragmentation(mem);
+
+    qsort(alloc_ns, allocs, sizeof(uint32_t), compare_latency);
+    qsort(free_ns, frees, sizeof(uint32_t), compare_latency);
+    result->alloc_p50 = allocs ? alloc_ns[allocs / 2] : 0;
+    result->alloc_p99 = allocs ? alloc_ns[(int)(allocs * 0.99)] : 0;
+    result->free_p50  = frees ? free_ns[frees / 2] : 0;
+    result->free_p99  = frees ? free_ns[(int)(frees * 0.99)] : 0;
+
+    if (mem->error) {
+        fclose(mem->error);
+    }
+    destroy(mem);
 }
 
 /**
- * @brief Function to delete a frame
+ * @brief Function to benchmark every fit policy and the buddy allocator on every synthetic workload
  *
- * @details This function is used to delete a frame, it checks if the stack is empty, if the frame
- *     exists and then deletes the frame.
+ * @details Errors of failed CH calls are discarded while the benchmark runs, they are counted in
+ *      the Failed column instead.
  *
+ * @return int the exit status
  */
-void DF() {
-    if (sys_memory.stack_size == 0) {
-        fprintf(stderr, "Error: Stack is empty, no functions to delete\n");
-        return;
-    }
+static int run_bench() {
+    static const char *distributions[] = {[BENCH_UNIFORM] = "uniform", [BENCH_POWER_LAW] = "power-law",
+                                          [BENCH_BIMODAL] = "bimodal"};
+    static const char *orders[]        = {[BENCH_LIFO] = "LIFO", [BENCH_FIFO] = "FIFO", [BENCH_RANDOM] = "random"};
+    static const char *policies[]      = {"first", "best", "next", "seg", "buddy"};
 
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            sys_memory.frame_status[i] =
-                (frame_status_t){.used = false, .number = 0, .func_address = -1, .frame_address = -1};
-            memset(sys_memory.frame_status[i].name, '\0', sizeof(sys_memory.frame_status[i].name));
+    memory_t memory;
+    config_t config = {
+        .mem_size     = BENCH_HEAP_SIZE + MAX_STACK_SIZE,
+        .stack_size   = MAX_STACK_SIZE,
+        .heap_size    = BENCH_HEAP_SIZE,
+        .max_frames   = 1,
+        .frame_size   = MAX_FRAME_SIZE,
+        .max_ints     = MAX_INT,
+        .max_doubles  = MAX_DOUBLE,
+        .max_chars    = MAX_CHAR,
+        .max_pointers = BENCH_LIVE_BUFFERS,
+    };
 
-            sys_memory.stack_size -= sys_memory.stack_frame[i].size;
+    printf("%d operations per run, %d live buffers, %d byte heap\n", BENCH_OPERATIONS, BENCH_LIVE_BUFFERS,
+           BENCH_HEAP_SIZE);
+    printf("|-----------|--------|--------|----------|----------|----------|----------|-----------|--------|--------|\n");
+    printf("| Sizes     | Order  | Policy | CH p50   | CH p99   | DH p50   | DH p99   | Peak Heap | Frag   | Failed |\n");
+    printf("|-----------|--------|--------|----------|----------|----------|----------|-----------|--------|--------|\n");
+    fflush(stdout);
 
-            memset(&sys_memory.stack_frame[i], 0, sizeof(sys_memory.stack_frame[i]));
+    for (int d = 0; d < 3; ++d) {
+        for (int o = 0; o < 3; ++o) {
+            for (int p = 0; p < 5; ++p) {
+                bench_result_t result;
+                bench_run(&memory, &config, (bench_sizes_t)d, (bench_order_t)o, policies[p], &result);
 
-            return;
+                printf("| %-9s | %-6s | %-6s | %5uns  | %5uns  | %5uns  | %5uns  | %-9d | %5.1f%% | %-6d |\n",
+                       distributions[d], orders[o], policies[p], result.alloc_p50, result.alloc_p99, result.free_p50,
+                       result.free_p99, result.peak_heap, result.fragmentation, result.failed);
+                fflush(stdout);
+            }
         }
     }
+    printf("|-----------|--------|--------|----------|----------|----------|----------|-----------|--------|--------|\n");
+    return EXIT_SUCCESS;
 }
 
 /**
- * @brief Function to create an integer
+ * @brief Function to check whether a trace is a compiled binary trace
  *
- * @param name
- * @param value
+ * @param path
+ * @return true if the file starts with the compiled trace magic
  */
-void CI(char *name, int value) {
-    int curr_frame = -1;
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            curr_frame = i;
-            break;
-        }
+static bool trace_is_compiled(const char *path) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    int  fd       = open(path, O_RDONLY);
+    bool compiled = fd != -1 && read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+                    memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+    if (fd != -1) {
+        close(fd);
     }
+    return compiled;
+}
 
-    if (curr_frame == -1) {
-        fprintf(stderr, "Error: No frames exist, cannot create integer\n");
-        return;
-    } else if (sys_memory.stack_frame[curr_frame].size + sizeof(int) > MAX_FRAME_SIZE) {
-        fprintf(stderr, "Error: The frame is full, cannot create more data on it\n");
-        return;
-    }
+/**
+ * @brief Function to replay traces handed out by the trace runner until none are left
+ *
+ * @details Every trace is replayed on a fresh instance with the geometry of the command line, attached
+ *      to the shared heap of the runner if it has one. Its output and errors go to <name>.out and
+ *      <name>.err in the output directory, or are discarded when there is none.
+ *
+ * @param arg the runner_t shared by the workers
+ * @return void* NULL
+ */
+static void *runner_worker(void *arg) {
+    runner_t *runner = (runner_t *)arg;
+    memory_t  memory;
+    char      path[PATH_BUFFER_SIZE];
+
+    for (int i; (i = atomic_fetch_add(&runner->next, 1)) < runner->count;) {
+        const char *name = strrchr(runner->paths[i], '/') + 1;
+        init(&memory, &sys_config, runner->shared);
+        if (runner->output_dir) {
+            snprintf(path, sizeof(path), "%s/%s.out", runner->output_dir, name);
+            memory.output.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            snprintf(path, sizeof(path), "%s/%s.err", runner->output_dir, name);
+            memory.error = fopen(path, "w");
+        } else {
+            memory.output.fd = open("/dev/null", O_WRONLY);
+            memory.error     = fopen("/dev/null", "w");
+        }
 
-    for (int i = 0; i < MAX_INT; ++i) {
-        if (!sys_memory.stack_frame[curr_frame].my_ints[i].initialized) {
-            strncpy(sys_memory.stack_frame[curr_frame].my_ints[i].name, name,
-                    sizeof(sys_memory.stack_frame[curr_frame].my_ints[i].name));
-            sys_memory.stack_frame[curr_frame].my_ints[i].value       = value;
-            sys_memory.stack_frame[curr_frame].my_ints[i].initialized = true;
-            sys_memory.stack_frame[curr_frame].size += sizeof(int);
-            sys_memory.stack_size += sizeof(int);
+        if (memory.output.fd == -1 || !memory.error) {
+            fprintf(stderr, "Error: Could not create the output of %s\n", runner->paths[i]);
+            runner->invalid[i] = -1;
+        } else if (runner->image && !image_load(&memory, runner->image)) {
+            runner->invalid[i] = -1;
+        } else if (trace_is_compiled(runner->paths[i])) {
+            runner->invalid[i] = trace_replay(&memory, runner->paths[i]) == EXIT_SUCCESS ? 0 : -1;
+        } else {
+            runner->invalid[i] = run_batch(&memory, runner->paths[i]);
+        }
 
-            return;
+        if (memory.output.fd != -1) {
+            close(memory.output.fd);
+        }
+        if (memory.error) {
+            fclose(memory.error);
         }
+        if (runner->stats) {
+            stats_t stats = stats_read(&memory);
+            pthread_mutex_lock(&runner->stats_lock);
+            stats_add(runner->stats, &stats);
+            pthread_mutex_unlock(&runner->stats_lock);
+        }
+        destroy(&memory);
     }
+
+    return NULL;
 }
 
 /**
- * @brief Function to create a double
+ * @brief Function to compare two paths for qsort
  *
- * @param name
- * @param value
+ * @param a
+ * @param b
+ * @return int
  */
-void CD(char *name, double value) {
-    int curr_frame = -1;
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            curr_frame = i;
-            break;
+static int compare_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Function to replay every trace of a directory on a pool of threads
+ *
+ * @details Text and compiled traces are both accepted. Each worker owns its simulator instance, the
+ *      only state the workers share is the counter handing out the traces and their results, and
+ *      in shared heap mode the heap. A summary of the traces that failed or had invalid commands
+ *      is printed in path order once all of them have run, followed by the lock and cache counters
+ *      of the shared heap.
+ *
+ * @param dir
+ * @param output_dir where the output of each trace goes, NULL to discard it
+ * @param threads number of worker threads
+ * @param shards number of shards of the heap shared by all traces, 0 for a private heap per trace
+ * @return int the exit status
+ */
+static int run_parallel(const char *dir, const char *output_dir, int threads, int shards, const char *image,
+                        const char *stats_path) {
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        fprintf(stderr, "Error: Could not open directory %s\n", dir);
+        return EXIT_FAILURE;
+    }
+
+    stats_t  stats    = {.start_cycles = clock_cycles(), .start_ns = clock_ns()};
+    runner_t runner   = {.output_dir = output_dir,
+                         .shared     = shards ? shared_heap_create(&sys_config, shards) : NULL,
+                         .image      = image,
+                         .stats      = stats_path ? &stats : NULL,
+                         .stats_lock = PTHREAD_MUTEX_INITIALIZER};
+    int      capacity = 0;
+    for (struct dirent *entry; (entry = readdir(handle));) {
+        char        path[PATH_BUFFER_SIZE];
+        struct stat info;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+
+        if (runner.count == capacity) {
+            capacity     = 2 * capacity + 64;
+            runner.paths = (char **)realloc(runner.paths, capacity * sizeof(char *));
+        }
+        if (!runner.paths || !(runner.paths[runner.count++] = strdup(path))) {
+            fprintf(stderr, "Error: Could not allocate memory for the trace list\n");
+            exit(EXIT_FAILURE);
         }
     }
+    closedir(handle);
 
-    if (curr_frame == -1) {
-        fprintf(stderr, "Error: No frames exist, cannot create double\n");
-        return;
-    } else if (sys_memory.stack_frame[curr_frame].size + sizeof(double) > MAX_FRAME_SIZE) {
-        fprintf(stderr, "Error: The frame is full, cannot create more data on it\n");
-        return;
+    qsort(runner.paths, runner.count, sizeof(char *), compare_path);
+    threads            = threads < runner.count ? threads : runner.count;
+    runner.invalid     = (long *)calloc(runner.count + 1, sizeof(long));
+    pthread_t *workers = (pthread_t *)malloc((threads + 1) * sizeof(pthread_t));
+    if (!runner.invalid || !workers) {
+        fprintf(stderr, "Error: Could not allocate memory for the trace runner\n");
+        exit(EXIT_FAILURE);
     }
 
-    for (int i = 0; i < MAX_DOUBLE; ++i) {
-        if (!sys_memory.stack_frame[curr_frame].my_doubles[i].initialized) {
-            strncpy(sys_memory.stack_frame[curr_frame].my_doubles[i].name, name,
-                    sizeof(sys_memory.stack_frame[curr_frame].my_doubles[i].name));
-            sys_memory.stack_frame[curr_frame].my_doubles[i].value       = value;
-            sys_memory.stack_frame[curr_frame].my_doubles[i].initialized = true;
-            sys_memory.stack_frame[curr_frame].size += sizeof(double);
-            sys_memory.stack_size += sizeof(double);
+    uint64_t start   = clock_ns();
+    int      started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, runner_worker, &runner) == 0) {
+        ++started;
+    }
+    if (started < threads) {
+        // Run whatever is left on this thread if the pool could not be fully started
+        runner_worker(&runner);
+    }
+    for (int t = 0; t < started; ++t) {
+        pthread_join(workers[t], NULL);
+    }
+    double seconds = (clock_ns() - start) / 1e9;
 
-            return;
+    int failed = 0;
+    for (int i = 0; i < runner.count; ++i) {
+        if (runner.invalid[i] < 0) {
+            printf("%s: failed\n", runner.paths[i]);
+            ++failed;
+        } else if (runner.invalid[i] > 0) {
+            printf("%s: %ld invalid commands\n", runner.paths[i], runner.invalid[i]);
         }
+        free(runner.paths[i]);
+    }
+    printf("Ran %d traces on %d threads in %.3fs, %d failed\n", runner.count, started, seconds, failed);
+    if (stats_path && !stats_dump(stats_path, &stats)) {
+        ++failed;
     }
+    if (runner.shared) {
+        output_t out = {.fd = STDOUT_FILENO};
+        print_shards(&out, runner.shared);
+        output_printf(&out, "Cache Hits: %lld, Cache Misses: %lld\n", atomic_load(&runner.shared->tcache_hits),
+                      atomic_load(&runner.shared->tcache_misses));
+        output_flush(&out);
+        free(out.data);
+        shared_heap_destroy(runner.shared);
+    }
+
+    free(runner.paths);
+    free(runner.invalid);
+    free(workers);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /**
- * @brief Function to create a char
+ * @brief Function to set one geometry value by name
  *
- * @param name
+ * @param key
  * @param value
+ * @return true if the key is known and the value is valid
  */
-void CC(char *name, char value) {
-    int curr_frame = -1;
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            curr_frame = i;
-            break;
-        }
-    }
+static bool config_set(const char *key, const char *value) {
+    static const struct {
+        const char *key;
+        int        *field;
+    } fields[] = {
+        {"mem_size", &sys_config.mem_size},       {"stack_size", &sys_config.stack_size},
+        {"heap_size", &sys_config.heap_size},     {"frames", &sys_config.max_frames},
+        {"frame_size", &sys_config.frame_size},   {"ints", &sys_config.max_ints},
+        {"doubles", &sys_config.max_doubles},     {"chars", &sys_config.max_chars},
+        {"pointers", &sys_config.max_pointers},   {"compact_threshold", &sys_config.compact_threshold},
+        {"gc_slice", &sys_config.gc_slice},       {"profile", &sys_config.profile},
+        {"latency", &sys_config.latency},         {"spill", &sys_config.spill},
+        {"buddy", &sys_config.buddy},
+    };
 
-    if (curr_frame == -1) {
-        fprintf(stderr, "Error: No frames exist, cannot create char\n");
-        return;
-    } else if (sys_memory.stack_frame[curr_frame].size + sizeof(char) > MAX_FRAME_SIZE) {
-        fprintf(stderr, "Error: The frame is full, cannot create more data on it\n");
-        return;
+    char *end;
+    long  number = strtol(value, &end, 0);
+    int   shift  = 0;
+    // Allow k, m and g suffixes so large heaps can be written as 64m or 1g
+    switch (tolower((unsigned char)*end)) {
+        case 'k': shift = 10, ++end; break;
+        case 'm': shift = 20, ++end; break;
+        case 'g': shift = 30, ++end; break;
     }
-    for (int i = 0; i < MAX_CHAR; ++i) {
-        if (!sys_memory.stack_frame[curr_frame].my_chars[i].initialized) {
-            strncpy(sys_memory.stack_frame[curr_frame].my_chars[i].name, name,
-                    sizeof(sys_memory.stack_frame[curr_frame].my_chars[i].name));
-            sys_memory.stack_frame[curr_frame].my_chars[i].value       = value;
-            sys_memory.stack_frame[curr_frame].my_chars[i].initialized = true;
-            sys_memory.stack_frame[curr_frame].size += sizeof(char);
-            sys_memory.stack_size += sizeof(char);
+    if (end == value || *end != '\0' || number <= 0) {
+        fprintf(stderr, "Error: Invalid value '%s' for %s\n", value, key);
+        return false;
+    } else if (number > INT_MAX >> shift) {
+        // Block headers and every heap offset are 32 bit, so the geometry stays below 2g
+        fprintf(stderr, "Error: Value '%s' for %s is too large, at most %d is supported\n", value, key, INT_MAX);
+        return false;
+    }
+    number <<= shift;
 
-            return;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (strcmp(fields[i].key, key) == 0) {
+            *fields[i].field = (int)number;
+            return true;
         }
     }
+
+    fprintf(stderr, "Error: Unknown configuration key '%s'\n", key);
+    return false;
 }
 
 /**
- * @brief Function to create a heap
+ * @brief Function to read geometry values from a config file
  *
- * @param buffer_name
- * @param size
+ * @details Every line holds one "key = value" pair, blank lines and lines starting with # are
+ *      ignored.
+ *
+ * @param path
+ * @return true if the whole file was read without errors
  */
-void CH(char *buffer_name, int size) {
-    if (sys_memory.heap_size + size + BUFFER_METADATA_SIZE > MAX_HEAP_SIZE) {
-        fprintf(stderr, "Error: The heap is full, cannot create more data\n");
-        return;
+static bool config_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open config file %s\n", path);
+        return false;
     }
 
-    int frame_idx   = -1;
-    int pointer_idx = -1;
-    int i           = MAX_FRAMES - 1;
-    while (i >= 0) {
-        if (sys_memory.frame_status[i].used == false) {
-            --i;
+    char line[256], key[64], value[64];
+    bool ok = true;
+    for (int line_no = 1; ok && fgets(line, sizeof(line), file); ++line_no) {
+        char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0') {
+            continue;
+        } else if (sscanf(text, "%63[^= \t] = %63s", key, value) != 2) {
+            fprintf(stderr, "Error: %s:%d: expected key = value\n", path, line_no);
+            ok = false;
         } else {
-            frame_idx = i;
-            for (int j = 0; j < MAX_POINTER; ++j) {
-                if (sys_memory.stack_frame[i].pointers[j] == NULL) {
-                    pointer_idx = j;
-                    break;
-                }
-            }
-            if (pointer_idx != -1) {
-                break;
-            }
-            --i;
+            ok = config_set(key, value);
         }
     }
 
-    if (pointer_idx == -1) {
-        fprintf(stderr, "Error: No pointers available in frame, cannot create buffer\n");
-        return;
-    } else if (frame_idx == -1) {
-        fprintf(stderr, "Error: No frames exist, cannot create buffer\n");
-        return;
+    fclose(file);
+    return ok;
+}
+
+/**
+ * @brief Function to check that the geometry is consistent
+ *
+ * @details A memory size that was not given explicitly grows to fit the stack and the heap. The heap
+ *      size is rounded down to whole HEAP_ALIGNMENT units, block sizes keep their flags in the low
+ *      bits.
+ *
+ * @param mem_size_set
+ * @return true if the geometry can be simulated
+ */
+static bool config_check(bool mem_size_set) {
+    sys_config.heap_size -= sys_config.heap_size % HEAP_ALIGNMENT;
+    if (sys_config.buddy && sys_config.heap_size > 0) {
+        sys_config.heap_size = 1 << size_class_of(sys_config.heap_size);
+    }
+    if (!mem_size_set && (long)sys_config.stack_size + sys_config.heap_size > sys_config.mem_size) {
+        if ((long)sys_config.stack_size + sys_config.heap_size > INT_MAX) {
+            fprintf(stderr, "Error: The stack and heap together cannot exceed %d bytes\n", INT_MAX);
+            return false;
+        }
+        sys_config.mem_size = sys_config.stack_size + sys_config.heap_size;
     }
 
-    allocated_t *buffer_meta   = (allocated_t *)(sys_memory.heap + sys_memory.heap_size);
-    buffer_meta->start_address = sys_memory.heap_size + BUFFER_METADATA_SIZE;
-    strncpy(buffer_meta->name, buffer_name, 7);
-    buffer_meta->name[7] = '\0';
+    if ((long)sys_config.stack_size + sys_config.heap_size > sys_config.mem_size) {
+        fprintf(stderr, "Error: The stack and heap do not fit in %d bytes of memory\n", sys_config.mem_size);
+        return false;
+    } else if (sys_config.heap_size < (sys_config.buddy ? 1 << BUDDY_MIN_ORDER : (int)MIN_BLOCK_SIZE)) {
+        fprintf(stderr, "Error: The heap must be larger than the buffer metadata\n");
+        return false;
+    } else if (sys_config.compact_threshold > 100) {
+        fprintf(stderr, "Error: The compaction threshold is a percentage of at most 100\n");
+        return false;
+    } else if (sys_config.profile > MAX_PROF_EVENTS) {
+        fprintf(stderr, "Error: The profiler buffers at most %d events\n", MAX_PROF_EVENTS);
+        return false;
+    }
 
-    sys_memory.heap_size += size + BUFFER_METADATA_SIZE;
-    sys_memory.stack_frame[frame_idx].pointers[pointer_idx] = (void *)&sys_memory.heap[buffer_meta->start_address];
+    return true;
+}
 
-    return;
+/**
+ * @brief Function to print the command line usage
+ *
+ * @param program
+ */
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -f trace   replay the commands of a trace file, - for stdin, without prompting\n"
+            "  -o file    with -f, compile the trace into a binary trace instead of running it\n"
+            "  -r file    replay a compiled binary trace\n"
+            "  -R dir     replay every trace of a directory in parallel, with -o the output of each\n"
+            "             trace goes to <name>.out and <name>.err in the given directory\n"
+            "  -j count   number of threads of -R, defaults to the number of online cores\n"
+            "  -S count   with -R, run all traces against one heap split into count locked shards\n"
+            "  -t file    write the counters of STATS to file at exit, - for stderr, with -R for all traces\n"
+            "  -T         time every command with the cycle counter for the latency histograms (latency)\n"
+            "  -I image   start every instance from a memory image written by SAVE, mapped copy on write\n"
+            "  -B         benchmark the fit policies and the buddy allocator on synthetic workloads and exit\n"
+            "  -C file    read the geometry from a config file of key = value lines\n"
+            "  -m bytes   total memory size, less than 2g like the heap (mem_size)\n"
+            "  -s bytes   maximum stack size (stack_size)\n"
+            "  -H bytes   heap size, less than 2g since heap offsets are 32 bit (heap_size)\n"
+            "  -n count   maximum number of frames (frames)\n"
+            "  -z bytes   maximum size of a frame (frame_size)\n"
+            "  -i count   integers per frame on average, sizes the pool shared by the frames (ints)\n"
+            "  -d count   doubles per frame on average, sizes the pool shared by the frames (doubles)\n"
+            "  -c count   chars per frame on average, sizes the pool shared by the frames (chars)\n"
+            "  -p count   pointers per frame (pointers)\n"
+            "  -F percent compact the heap once its fragmentation reaches percent (compact_threshold)\n"
+            "  -G count   collect garbage incrementally, sweeping count buffers per command (gc_slice)\n"
+            "  -L         let CH put the pointer in a lower frame when the top frame is full (spill)\n"
+            "  -b         allocate buffers with a binary buddy allocator, the heap is rounded down to a power\n"
+            "             of two (buddy)\n"
+            "  -P events  profile CH and DH for PROF, buffering up to events events between folds (profile)\n"
+            "Sizes accept k, m and g suffixes.\n",
+            program);
 }
 
 /**
- * @brief Function to print the stack and heap
+ * @brief Function to parse the command line options
+ *
+ * @details Options are applied in order, so values given after -C override the config file.
  *
+ * @param argc
+ * @param argv
+ * @param options filled in from the options given, fields of options not given are left untouched
  */
-void SM() {
-    printf("                               STACK\n");
-    printf("|-------|---------------|------------------|---------------|------------|\n");
-    printf("| Frame | Function Name | Function Address | Frame Address | Frame Size |\n");
-    printf("|-------|---------------|------------------|---------------|------------|\n");
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            printf("| %-5d | %-13s | 0x%-14X | %-13d | %-10d |\n", sys_memory.frame_status[i].number,
-                   sys_memory.frame_status[i].name, sys_memory.frame_status[i].func_address,
-                   sys_memory.frame_status[i].frame_address, sys_memory.stack_frame[i].size);
-        }
-    }
-    printf("|-------|---------------|------------------|---------------|------------|\n");
-
-    for (int i = MAX_FRAMES - 1; i >= 0; --i) {
-        if (sys_memory.frame_status[i].used) {
-            printf("\n\nFrame %d Contents:\n", sys_memory.frame_status[i].number);
-            printf("|---------------|----------|-----------------|\n");
-            printf("| Variable Name |   Type   |      Value      |\n");
-            printf("|---------------|----------|-----------------|\n");
-            for (int j = 0; j < MAX_INT; ++j) {
-                if (sys_memory.stack_frame[i].my_ints[j].initialized) {
-                    printf("| %-13s | int      | %-15d |\n", sys_memory.stack_frame[i].my_ints[j].name,
-                           sys_memory.stack_frame[i].my_ints[j].value);
-                }
-            }
-            for (int j = 0; j < MAX_DOUBLE; ++j) {
-                if (sys_memory.stack_frame[i].my_doubles[j].initialized) {
-                    printf("| %-13s | double   | %-15lf |\n", sys_memory.stack_frame[i].my_doubles[j].name,
-                           sys_memory.stack_frame[i].my_doubles[j].value);
-                }
+static void parse_options(int argc, char *argv[], options_t *options) {
+    static const char *keys[] = {
+        ['m'] = "mem_size", ['s'] = "stack_size", ['H'] = "heap_size", ['n'] = "frames", ['z'] = "frame_size",
+        ['i'] = "ints",     ['d'] = "doubles",    ['c'] = "chars",     ['p'] = "pointers",
+        ['F'] = "compact_threshold", ['G'] = "gc_slice", ['P'] = "profile",
+    };
+
+    bool mem_size_set = false;
+    int  opt;
+    while ((opt = getopt(argc, argv, "f:o:r:R:j:S:t:TI:BC:m:s:H:n:z:i:d:c:p:F:G:P:Lbh")) != -1) {
+        if (opt == 'B') {
+            exit(run_bench());
+        } else if (opt == 'f') {
+            options->trace_path = optarg;
+        } else if (opt == 'o' || opt == 'r') {
+            options->compiled_path = optarg;
+            options->replay        = opt == 'r';
+        } else if (opt == 'R') {
+            options->trace_dir = optarg;
+        } else if (opt == 't') {
+            options->stats_path = optarg;
+        } else if (opt == 'I') {
+            options->image_path = optarg;
+        } else if (opt == 'T' || opt == 'L' || opt == 'b') {
+            *(opt == 'T' ? &sys_config.latency : opt == 'L' ? &sys_config.spill : &sys_config.buddy) = 1;
+        } else if (opt == 'j' || opt == 'S') {
+            char *end;
+            long  value = strtol(optarg, &end, 10);
+            if (end == optarg || *end || value < 1 || value > (opt == 'j' ? 4096 : MAX_SHARDS)) {
+                fprintf(stderr, "Error: Invalid %s count '%s'\n", opt == 'j' ? "thread" : "shard", optarg);
+                exit(EXIT_FAILURE);
             }
-            for (int j = 0; j < MAX_CHAR; ++j) {
-                if (sys_memory.stack_frame[i].my_chars[j].initialized) {
-                    printf("| %-13s | char     | %-15c |\n", sys_memory.stack_frame[i].my_chars[j].name,
-                           sys_memory.stack_frame[i].my_chars[j].value);
-                }
+            *(opt == 'j' ? &options->threads : &options->shards) = (int)value;
+        } else if (opt == 'C') {
+            int mem_size = sys_config.mem_size;
+            if (!config_load(optarg)) {
+                exit(EXIT_FAILURE);
             }
-            for (int j = 0; j < MAX_POINTER; ++j) {
-                if (sys_memory.stack_frame[i].pointers[j] != NULL) {
-                    printf("| %-13s | pointer  | %-15p |\n", "pointer", sys_memory.stack_frame[i].pointers[j]);
-                }
+            mem_size_set |= mem_size != sys_config.mem_size;
+        } else if (opt != 'h' && opt != '?' && keys[opt]) {
+            if (!config_set(keys[opt], optarg)) {
+                exit(EXIT_FAILURE);
             }
-            printf("|---------------|----------|-----------------|\n");
+            mem_size_set |= opt == 'm';
+        } else {
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
         }
     }
 
-    int curr_addr = 0;
-    printf("\nHEAP\n");
-    printf("Heap Size: %d\n", sys_memory.heap_size);
-    printf("|---------------|-----------------|--------|\n");
-    printf("|  Buffer Name  |  Start Address  |  Size  |\n");
-    printf("|---------------|-----------------|--------|\n");
-    while (curr_addr < sys_memory.heap_size) {
-        allocated_t *buffer_meta = (allocated_t *)(sys_memory.heap + curr_addr);
-        int          bufferSize  = *(int *)(sys_memory.heap + curr_addr + BUFFER_METADATA_SIZE - sizeof(int));
-        printf("| %-13s | 0x%-13d | %-6d |\n", buffer_meta->name, buffer_meta->start_address, bufferSize);
-        curr_addr += bufferSize + BUFFER_METADATA_SIZE;
+    if (!config_check(mem_size_set)) {
+        exit(EXIT_FAILURE);
+    } else if (options->shards && !options->trace_dir) {
+        fprintf(stderr, "Error: -S needs the traces to run given with -R\n");
+        exit(EXIT_FAILURE);
+    } else if (options->shards && sys_config.buddy) {
+        fprintf(stderr, "Error: -b needs a private heap for every trace and cannot be used with -S\n");
+        exit(EXIT_FAILURE);
+    } else if (options->shards && options->image_path) {
+        fprintf(stderr, "Error: -I needs a private heap for every trace and cannot be used with -S\n");
+        exit(EXIT_FAILURE);
+    } else if (options->compiled_path && !options->replay && !options->trace_path && !options->trace_dir) {
+        fprintf(stderr, "Error: -o needs the text trace to compile given with -f or the traces given with -R\n");
+        exit(EXIT_FAILURE);
     }
-
-    printf("|---------------|-----------------|--------|\n\n");
 }
 
 /**
  * @brief Main function
  *
+ * @param argc
+ * @param argv
  * @return int
  */
-int main() {
-    char   input[3], name[8];
-    int    func_address, int_value, buffer_size;
-    double double_value;
-    char   char_value;
+int main(int argc, char *argv[]) {
+    long      cores   = sysconf(_SC_NPROCESSORS_ONLN);
+    options_t options = {.threads = cores > 0 ? (int)cores : 1};
+    parse_options(argc, argv, &options);
 
-    printf("Type Q or q to quit\n");
-    init();
-    while (1) {
-        printf("$ ");
-        scanf("%s", input);
-        if (strcmp(input, "Q") == 0 || strcmp(input, "q") == 0) {
-            exit(EXIT_SUCCESS);
-        } else if (strcmp(input, "DF") == 0) {
-            DF();
-        } else if (strcmp(input, "SM") == 0) {
-            SM();
-        } else if (strcmp(input, "CF") == 0) {
-            scanf("%s %d", name, &func_address);
-            CF(name, func_address);
-        } else if (strcmp(input, "CI") == 0) {
-            scanf("%s %d", name, &int_value);
-            CI(name, int_value);
-        } else if (strcmp(input, "CD") == 0) {
-            scanf("%s %lf", name, &double_value);
-            CD(name, double_value);
-        } else if (strcmp(input, "CC") == 0) {
-            scanf("%s %c", name, &char_value);
-            CC(name, char_value);
-        } else if (strcmp(input, "CH") == 0) {
-            scanf("%s %d", name, &buffer_size);
-            CH(name, buffer_size);
-        } else if (strcmp(input, "DH") == 0) {
-            scanf("%s", name);
-            printf("Not Implemented yet!\n");
-        } else {
-            printf("Invalid input, please try again\n");
-        }
+    if (options.trace_dir) {
+        return run_parallel(options.trace_dir, options.replay ? NULL : options.compiled_path, options.threads,
+                            options.shards, options.image_path, options.stats_path);
+    } else if (options.compiled_path && !options.replay) {
+        return trace_compile(options.trace_path, options.compiled_path);
     }
 
-    return 0;
+    memory_t memory;
+    int      status;
+    init(&memory, &sys_config, NULL);
+    if (options.image_path && !image_load(&memory, options.image_path)) {
+        status = EXIT_FAILURE;
+    } else if (options.compiled_path) {
+        status = trace_replay(&memory, options.compiled_path);
+    } else if (options.trace_path) {
+        status = run_batch(&memory, options.trace_path) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        status = run_interactive(&memory);
+    }
+    output_flush(&memory.output);
+    if (options.stats_path) {
+        stats_t stats = stats_read(&memory);
+        status        = stats_dump(options.stats_path, &stats) ? status : EXIT_FAILURE;
+    }
+    destroy(&memory);
+    return status;
 }
@@ -0,0 +1,137 @@
+#!/bin/sh
+# Replays every trace of perf/traces, checks its output against perf/golden and compares its wall
+# time and peak resident memory against perf/baseline.txt.
+#
+# Usage: perf/run.sh [--update] binary
+#
+# The first line of a trace is a comment with the options it is replayed with:
+#     # perf: -H 4m -m 8m -p 1024
+#
+# SM prints the pointers of a frame as host addresses, which change from run to run, so they are
+# masked before the output is compared.
+#
+# Output that differs from the golden always fails. A trace regresses when its best wall time of
+# PERF_RUNS runs or its peak RSS is more than PERF_THRESHOLD percent over the baseline.
+# Differences below PERF_SLACK_US microseconds and PERF_SLACK_KB kilobytes are noise and never
+# count. With --update the goldens and baselines are written from this binary instead.
+#
+# The baselines only mean something on the machine that wrote them, so baseline.txt records the
+# host name and CPU model it was written on. On any other machine a regression is reported as a
+# warning and does not fail the run.
+
+set -u
+
+update=0
+if [ "${1:-}" = "--update" ]; then
+    update=1
+    shift
+fi
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [--update] binary" >&2
+    exit 2
+fi
+
+binary=$1
+dir=$(dirname "$0")
+threshold=${PERF_THRESHOLD:-25}
+runs=${PERF_RUNS:-5}
+slack_us=${PERF_SLACK_US:-5000}
+slack_kb=${PERF_SLACK_KB:-1024}
+baseline=$dir/baseline.txt
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+host="$(uname -n) $(sed -n 's/^model name[^:]*: //p' /proc/cpuinfo 2>/dev/null | head -n 1)"
+if [ $update -eq 1 ]; then
+    printf '# trace wall_us max_rss_kb\n# host %s\n' "$host" > "$scratch/baseline.txt"
+    strict=1
+elif [ "$(sed -n 's/^# host //p' "$baseline")" = "$host" ]; then
+    strict=1
+else
+    strict=0
+    echo "note: $baseline was written on another machine, regressions are only warnings"
+fi
+
+failed=0
+for trace in "$dir"/traces/*.txt; do
+    name=$(basename "$trace" .txt)
+    options=$(sed -n '1s/^# perf://p' "$trace")
+
+    best=
+    rss=0
+    run=0
+    while [ $run -lt "$runs" ]; do
+        start=$(date +%s%N)
+        # shellcheck disable=SC2086
+        "$binary" -f "$trace" -t "$scratch/stats" $options > "$scratch/raw" 2> "$scratch/err"
+        status=$?
+        end=$(date +%s%N)
+        if [ $status -ne 0 ]; then
+            echo "FAIL $name: exit status $status"
+            failed=1
+            continue 2
+        fi
+
+        sed 's/^\(| pointer  *| pointer  | \)0x[0-9a-f]* */\1<pointer>       /' "$scratch/raw" > "$scratch/out"
+        wall=$(( (end - start) / 1000 ))
+        if [ -z "$best" ] || [ $wall -lt "$best" ]; then
+            best=$wall
+        fi
+        peak=$(sed -n 's/^max_rss_kb //p' "$scratch/stats")
+        peak=${peak:-0}
+        if [ "$peak" -gt $rss ]; then
+            rss=$peak
+        fi
+        run=$((run + 1))
+    done
+
+    if [ $update -eq 1 ]; then
+        cp "$scratch/out" "$dir/golden/$name.out"
+        cp "$scratch/err" "$dir/golden/$name.err"
+        echo "$name $best $rss" >> "$scratch/baseline.txt"
+        echo "UPDATE $name: ${best}us, ${rss}kB"
+        continue
+    fi
+
+    problems=
+    if ! cmp -s "$scratch/out" "$dir/golden/$name.out" || ! cmp -s "$scratch/err" "$dir/golden/$name.err"; then
+        diff "$dir/golden/$name.out" "$scratch/out" | head -n 20
+        diff "$dir/golden/$name.err" "$scratch/err" | head -n 20
+        problems="output differs from golden"
+    fi
+
+    line=$(awk -v name="$name" '$1 == name' "$baseline")
+    if [ -z "$line" ] && [ -z "$problems" ] && [ $strict -eq 0 ]; then
+        echo "warn $name: no baseline"
+        continue
+    elif [ -z "$line" ]; then
+        echo "FAIL $name: ${problems:+$problems, }no baseline"
+        failed=1
+        continue
+    fi
+    report=$(echo "$line" | awk -v wall="$best" -v rss="$rss" -v threshold="$threshold" -v slack_us="$slack_us" \
+        -v slack_kb="$slack_kb" '{
+        slow = wall - $2 > slack_us && wall > $2 * (1 + threshold / 100)
+        big  = rss - $3 > slack_kb && rss > $3 * (1 + threshold / 100)
+        printf "%s%s%dus (baseline %dus, %+.1f%%), %dkB (baseline %dkB, %+.1f%%)", slow ? "time regression, " : "",
+            big ? "memory regression, " : "", wall, $2, $2 ? 100 * (wall - $2) / $2 : 0, rss, $3,
+            $3 ? 100 * (rss - $3) / $3 : 0
+    }')
+    case $report in
+        *regression*) problems="${problems:+$problems, }over the baseline" ;;
+    esac
+
+    if [ -z "$problems" ]; then
+        echo "ok   $name: $report"
+    elif [ "$problems" = "over the baseline" ] && [ $strict -eq 0 ]; then
+        echo "warn $name: $problems: $report"
+    else
+        echo "FAIL $name: $problems: $report"
+        failed=1
+    fi
+done
+
+if [ $update -eq 1 ]; then
+    mv "$scratch/baseline.txt" "$baseline"
+fi
+exit $failed